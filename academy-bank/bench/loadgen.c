@@ -0,0 +1,374 @@
+// Academy Bank - end-to-end load generator
+//
+// Opens N concurrent text sessions against a running academy-bank
+// (--listen, --prefork or under ynetd), registers and logs in a fresh user
+// on each, then keeps every session busy with commands drawn from a weighted
+// mix until the duration is up. Each session has one command in flight and
+// waits for its prompt, as a checker does. Reports throughput and latency
+// quantiles per command; a reply starting with "[!]" or "usage" counts as an
+// error.
+//
+// usage: loadgen [-h host] [-p port] [-c connections] [-d seconds] [-m mix]
+//
+// mix is a comma-separated list of command=weight, for example
+// "deposit-flag=4,list-flag=1,buy=2,my-flags=2". Commands are register,
+// login, deposit-flag, list-flag, buy and my-flags; login logs out first and
+// logs in as the session's latest user. list-flag needs a flag that user
+// deposited and buy a listing some session created; until then a
+// deposit-flag is sent in their place.
+
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_CONNS 4096
+#define POOL_SZ 4096
+#define HEAD_SZ 128
+
+typedef enum {
+  CMD_REGISTER,
+  CMD_LOGIN,
+  CMD_DEPOSIT_FLAG,
+  CMD_LIST_FLAG,
+  CMD_BUY,
+  CMD_MY_FLAGS,
+  CMD_KINDS
+} CmdKind;
+
+static const char *const CMD_NAMES[CMD_KINDS] = {
+    "register", "login", "deposit-flag", "list-flag", "buy", "my-flags",
+};
+
+typedef enum { PHASE_GREETING, PHASE_SETUP, PHASE_RUNNING } Phase;
+
+typedef struct {
+  int fd;
+  int id;
+  Phase phase;
+  unsigned users;     // users this session has registered
+  char name[48];      // the one it is logged in as
+  uint64_t last_flag; // most recent flag it deposited, 0 if none
+  bool logging_out;   // a login's logout is in flight
+  CmdKind inflight;
+  uint64_t sent_ns;
+  char head[HEAD_SZ]; // start of the reply, for ids and errors
+  size_t head_len;
+  char tail[3]; // last bytes seen, to spot the prompt across reads
+} Session;
+
+static unsigned weights[CMD_KINDS];
+static unsigned weight_total;
+static OpMetric *cmd_metrics[CMD_KINDS];
+
+// Listing ids created by any session, for buy to pick from.
+static uint64_t pool[POOL_SZ];
+static size_t pool_len;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng_next(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static int parse_mix(const char *mix) {
+  char buf[512];
+  if (strlen(mix) >= sizeof(buf))
+    return -1;
+  strcpy(buf, mix);
+  memset(weights, 0, sizeof(weights));
+  weight_total = 0;
+  for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+    char *eq = strchr(tok, '=');
+    if (!eq)
+      return -1;
+    *eq = '\0';
+    int k = 0;
+    while (k < CMD_KINDS && strcmp(CMD_NAMES[k], tok) != 0)
+      k++;
+    int w = atoi(eq + 1);
+    if (k == CMD_KINDS || w < 0)
+      return -1;
+    weights[k] = (unsigned)w;
+    weight_total += (unsigned)w;
+  }
+  return weight_total ? 0 : -1;
+}
+
+static CmdKind pick_command(const Session *s) {
+  unsigned r = (unsigned)(rng_next() % weight_total);
+  int k = 0;
+  while (r >= weights[k])
+    r -= weights[k++];
+  if ((k == CMD_LIST_FLAG && !s->last_flag) || (k == CMD_BUY && !pool_len))
+    return CMD_DEPOSIT_FLAG;
+  return (CmdKind)k;
+}
+
+static int send_line(Session *s, CmdKind kind, const char *line) {
+  size_t len = strlen(line);
+  s->inflight = kind;
+  s->head_len = 0;
+  s->sent_ns = metrics_now_ns();
+  ssize_t n = send(s->fd, line, len, MSG_NOSIGNAL);
+  return n == (ssize_t)len ? 0 : -1;
+}
+
+static int send_command(Session *s, CmdKind kind) {
+  char line[160];
+  switch (kind) {
+  case CMD_REGISTER:
+    snprintf(s->name, sizeof(s->name), "lg%d_%d_%u", (int)getpid(), s->id,
+             s->users++);
+    snprintf(line, sizeof(line), "register %s pw\n", s->name);
+    break;
+  case CMD_LOGIN:
+    // A running session is logged in already; log out first, untimed.
+    if (s->phase == PHASE_RUNNING && !s->logging_out) {
+      s->logging_out = true;
+      return send_line(s, kind, "logout\n");
+    }
+    s->logging_out = false;
+    s->last_flag = 0;
+    snprintf(line, sizeof(line), "login %s pw\n", s->name);
+    break;
+  case CMD_DEPOSIT_FLAG:
+    snprintf(line, sizeof(line), "deposit-flag FLAG{load_%d_%llu}\n", s->id,
+             (unsigned long long)rng_next());
+    break;
+  case CMD_LIST_FLAG:
+    snprintf(line, sizeof(line), "list-flag %llu 1 load\n",
+             (unsigned long long)s->last_flag);
+    break;
+  case CMD_BUY:
+    snprintf(line, sizeof(line), "buy %llu\n",
+             (unsigned long long)pool[rng_next() % pool_len]);
+    break;
+  default:
+    snprintf(line, sizeof(line), "my-flags\n");
+    break;
+  }
+  return send_line(s, kind, line);
+}
+
+// Records the finished command and picks up the ids later commands need.
+static void finish_reply(Session *s) {
+  s->head[s->head_len] = '\0';
+  bool error = strncmp(s->head, "[!]", 3) == 0 ||
+               strncmp(s->head, "usage", 5) == 0;
+  metrics_record(cmd_metrics[s->inflight], s->sent_ns, error);
+  unsigned long long id;
+  if (sscanf(s->head, "Stored flag id=%llu", &id) == 1)
+    s->last_flag = id;
+  else if (sscanf(s->head, "Created listing id=%llu", &id) == 1)
+    pool[pool_len < POOL_SZ ? pool_len++ : rng_next() % POOL_SZ] = id;
+}
+
+// Feeds received bytes to the session. Returns 1 once a full reply (ending
+// in the prompt) has arrived.
+static int consume(Session *s, const char *data, size_t len) {
+  size_t n = HEAD_SZ - 1 - s->head_len;
+  if (n > len)
+    n = len;
+  memcpy(s->head + s->head_len, data, n);
+  s->head_len += n;
+  for (size_t i = 0; i < len; i++) {
+    s->tail[0] = s->tail[1];
+    s->tail[1] = s->tail[2];
+    s->tail[2] = data[i];
+  }
+  return memcmp(s->tail, "\n> ", 3) == 0;
+}
+
+// Sends the next command once the previous reply is in. Returns -1 if the
+// session is finished.
+static int advance(Session *s, bool stopping) {
+  if (s->phase == PHASE_GREETING) {
+    s->phase = PHASE_SETUP;
+    return send_command(s, CMD_REGISTER);
+  }
+  if (s->logging_out)
+    return send_command(s, CMD_LOGIN);
+  finish_reply(s);
+  if (stopping)
+    return -1;
+  if (s->phase == PHASE_SETUP && s->inflight == CMD_REGISTER)
+    return send_command(s, CMD_LOGIN);
+  s->phase = PHASE_RUNNING;
+  return send_command(s, pick_command(s));
+}
+
+static int connect_to(const struct addrinfo *ai) {
+  int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                  ai->ai_protocol);
+  if (fd < 0)
+    return -1;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+static void report(double elapsed, int conns) {
+  uint64_t total = 0;
+  for (int k = 0; k < CMD_KINDS; k++)
+    total += cmd_metrics[k]->count;
+  printf("%d connections, %.1f s, %llu commands, %.0f commands/s\n", conns,
+         elapsed, (unsigned long long)total, (double)total / elapsed);
+  printf("%-13s %9s %7s %10s %9s %9s %9s %9s\n", "command", "count", "errors",
+         "per_s", "p50_us", "p99_us", "p999_us", "max_us");
+  for (int k = 0; k < CMD_KINDS; k++) {
+    const OpMetric *m = cmd_metrics[k];
+    if (!m->count)
+      continue;
+    printf("%-13s %9llu %7llu %10.0f %9.1f %9.1f %9.1f %9.1f\n", m->name,
+           (unsigned long long)m->count, (unsigned long long)m->errors,
+           (double)m->count / elapsed,
+           (double)metrics_percentile_ns(m, 0.5) / 1e3,
+           (double)metrics_percentile_ns(m, 0.99) / 1e3,
+           (double)metrics_percentile_ns(m, 0.999) / 1e3,
+           (double)m->max_ns / 1e3);
+  }
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-h host] [-p port] [-c connections] [-d seconds] "
+          "[-m mix]\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  const char *host = "127.0.0.1";
+  const char *port = "6969";
+  const char *mix =
+      "register=1,login=1,deposit-flag=4,list-flag=2,buy=2,my-flags=2";
+  int conns = 16;
+  double seconds = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:d:m:")) != -1) {
+    switch (opt) {
+    case 'h':
+      host = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 'c':
+      conns = atoi(optarg);
+      break;
+    case 'd':
+      seconds = atof(optarg);
+      break;
+    case 'm':
+      mix = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (conns <= 0 || conns > MAX_CONNS || seconds <= 0 || parse_mix(mix)) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (int k = 0; k < CMD_KINDS; k++)
+    cmd_metrics[k] = metrics_op("loadgen", CMD_NAMES[k]);
+  rng_state ^= (uint64_t)getpid() << 32;
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM};
+  struct addrinfo *ai = NULL;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    fprintf(stderr, "Cannot resolve %s:%s\n", host, port);
+    return 1;
+  }
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  Session *sessions = calloc((size_t)conns, sizeof(Session));
+  if (ep < 0 || !sessions) {
+    freeaddrinfo(ai);
+    return 1;
+  }
+  for (int i = 0; i < conns; i++)
+    sessions[i].fd = -1;
+  int open_count = 0;
+  for (int i = 0; i < conns; i++) {
+    Session *s = &sessions[i];
+    s->id = i;
+    s->fd = connect_to(ai);
+    if (s->fd < 0) {
+      fprintf(stderr, "Cannot connect to %s:%s\n", host, port);
+      break;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+    epoll_ctl(ep, EPOLL_CTL_ADD, s->fd, &ev);
+    open_count++;
+  }
+  freeaddrinfo(ai);
+
+  uint64_t start = metrics_now_ns();
+  uint64_t deadline = start + (uint64_t)(seconds * 1e9);
+  struct epoll_event events[64];
+  char buf[65536];
+  int live = open_count;
+  int dropped = 0;
+  while (live > 0) {
+    uint64_t now = metrics_now_ns();
+    bool stopping = now >= deadline;
+    int wait_ms = stopping ? 1000 : (int)((deadline - now) / 1000000) + 1;
+    int n = epoll_wait(ep, events, 64, wait_ms);
+    if (n < 0 && errno != EINTR)
+      break;
+    if (n == 0 && stopping)
+      break; // sessions still waiting on a reply are abandoned
+    for (int i = 0; i < n; i++) {
+      Session *s = events[i].data.ptr;
+      ssize_t got = recv(s->fd, buf, sizeof(buf), 0);
+      if (got < 0 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      bool done = got <= 0;
+      if (got <= 0)
+        dropped++;
+      else if (consume(s, buf, (size_t)got))
+        done = advance(s, metrics_now_ns() >= deadline) != 0;
+      if (done) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, s->fd, NULL);
+        close(s->fd);
+        s->fd = -1;
+        live--;
+      }
+    }
+  }
+  double elapsed = (double)(metrics_now_ns() - start) / 1e9;
+
+  report(elapsed, open_count);
+  if (dropped)
+    printf("%d connections closed by the server\n", dropped);
+  for (int i = 0; i < conns; i++) {
+    if (sessions[i].fd >= 0)
+      close(sessions[i].fd);
+  }
+  free(sessions);
+  close(ep);
+  return open_count == conns ? 0 : 1;
+}
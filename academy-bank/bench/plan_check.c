@@ -0,0 +1,24 @@
+// Academy Bank - query plan check
+//
+// Opens a fresh SQLite database with the current schema and migrations and
+// fails unless the flag and listing page scans search through their
+// indexes. Run by `make check`.
+//
+// usage: plan_check [db_path]
+
+#include "storage_backend.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : ":memory:";
+  Storage *storage = NULL;
+  if (storage_open(path, &storage) != STORAGE_OK) {
+    fprintf(stderr, "plan_check: cannot open %s\n", path);
+    return 1;
+  }
+  bool ok = storage_sqlite_check_plans(storage, stdout);
+  storage_close(storage);
+  puts(ok ? "query plans ok" : "query plans FAILED");
+  return ok ? 0 : 1;
+}
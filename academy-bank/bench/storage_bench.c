@@ -0,0 +1,220 @@
+// Academy Bank - storage microbenchmark
+//
+// Drives the storage API with the same call sequences the REPL issues for
+// register, login and buy, and reports per-operation cost. With clients > 1
+// it instead forks that many processes against one database file, the way
+// ynetd runs one academy-bank per connection, and reports the aggregate
+// session throughput. Tuning comes from the ACADEMY_BANK_* environment, and
+// the backend from db_path's scheme (see storage_open).
+//
+// usage: storage_bench [db_path] [iterations] [clients]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "storage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, int iters, double elapsed) {
+  printf("%-10s %8d ops %10.3f ms %10.2f us/op %12.0f ops/s\n", name, iters,
+         elapsed * 1e3, elapsed * 1e6 / iters, iters / elapsed);
+}
+
+static int bench_register(Storage *s, int iters) {
+  double t0 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    User u = {0};
+    snprintf(u.name, sizeof(u.name), "bench_user_%d", i);
+    snprintf(u.password, sizeof(u.password), "pw_%d", i);
+    u.balance = 100;
+    if (storage_user_insert(s, &u, &u) != STORAGE_OK) {
+      fprintf(stderr, "register %d failed\n", i);
+      return -1;
+    }
+  }
+  report("register", iters, now_sec() - t0);
+  return 0;
+}
+
+static int bench_login(Storage *s, int iters) {
+  double t0 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    User u;
+    char name[NAME_SZ];
+    snprintf(name, sizeof(name), "bench_user_%d", i);
+    if (storage_user_get_by_name(s, name, &u) != STORAGE_OK) {
+      fprintf(stderr, "login %d failed\n", i);
+      return -1;
+    }
+  }
+  report("login", iters, now_sec() - t0);
+  return 0;
+}
+
+// Mirrors the storage calls made by cmd_buy: a listing lookup, the purchase
+// transaction and a refresh of the buyer.
+static int bench_buy(Storage *s, int iters) {
+  User seller = {0};
+  strcpy(seller.name, "bench_seller");
+  seller.balance = 100;
+  Flag flag = {0};
+  Listing listing = {0};
+  if (storage_user_insert(s, &seller, &seller) != STORAGE_OK)
+    return -1;
+  flag.uid = seller.uid;
+  strcpy(flag.secret, "FLAG{bench}");
+  if (storage_flag_insert(s, &flag, &flag) != STORAGE_OK)
+    return -1;
+  listing.fid = flag.id;
+  listing.price = 1;
+  strcpy(listing.note, "bench");
+  if (storage_listing_insert(s, &listing, &listing) != STORAGE_OK)
+    return -1;
+
+  double t0 = now_sec();
+  for (int i = 0; i < iters; i++) {
+    uint64_t buyer_uid = (uint64_t)(i + 1);
+    Listing l;
+    Flag f;
+    User buyer;
+    if (storage_listing_get_by_id(s, listing.id, &l) != STORAGE_OK ||
+        storage_purchase_listing(s, l.id, buyer_uid, l.price, 0, &f) !=
+            STORAGE_OK ||
+        storage_user_get_by_id(s, buyer_uid, &buyer) != STORAGE_OK) {
+      fprintf(stderr, "buy %d failed\n", i);
+      return -1;
+    }
+  }
+  report("buy", iters, now_sec() - t0);
+  return 0;
+}
+
+static int open_storage(const char *db_path, Storage **out) {
+  StorageOptions opts;
+  storage_options_default(&opts);
+  storage_options_from_env(&opts);
+  if (storage_open_with_options(db_path, &opts, out) != STORAGE_OK) {
+    fprintf(stderr, "Failed to open storage at %s\n", db_path);
+    return -1;
+  }
+  return 0;
+}
+
+static int count_flag(const Flag *f, void *ctx) {
+  (void)f;
+  (*(int *)ctx)++;
+  return 0;
+}
+
+// One client session: log in, deposit a flag, buy the shared listing and
+// list the resulting flags, iters times. Exits non-zero on the first failed
+// storage call, which is how lock timeouts show up.
+static int run_client(const char *db_path, int client, int iters,
+                      uint64_t listing_id) {
+  Storage *s = NULL;
+  if (open_storage(db_path, &s))
+    return 1;
+  User u = {0};
+  snprintf(u.name, sizeof(u.name), "bench_client_%d", client);
+  strcpy(u.password, "pw");
+  u.balance = (uint64_t)iters;
+  if (storage_user_insert(s, &u, &u) != STORAGE_OK) {
+    storage_close(s);
+    return 1;
+  }
+  int nflags = 0;
+  for (int i = 0; i < iters; i++) {
+    Flag f = {0};
+    f.uid = u.uid;
+    snprintf(f.secret, sizeof(f.secret), "FLAG{%d_%d}", client, i);
+    if (storage_user_get_by_name(s, u.name, &u) != STORAGE_OK ||
+        storage_flag_insert(s, &f, &f) != STORAGE_OK ||
+        storage_purchase_listing(s, listing_id, u.uid, 1, 0, &f) !=
+            STORAGE_OK ||
+        storage_iter_flags_for_user(s, u.uid, count_flag, &nflags) !=
+            STORAGE_OK) {
+      fprintf(stderr, "client %d failed at iteration %d\n", client, i);
+      storage_close(s);
+      return 1;
+    }
+  }
+  storage_close(s);
+  return 0;
+}
+
+static int bench_concurrent(const char *db_path, int iters, int clients) {
+  Storage *s = NULL;
+  if (open_storage(db_path, &s))
+    return -1;
+  User seller = {0};
+  snprintf(seller.name, sizeof(seller.name), "bench_seller_%d", (int)getpid());
+  Flag flag = {0};
+  Listing listing = {0};
+  int ok = storage_user_insert(s, &seller, &seller) == STORAGE_OK;
+  flag.uid = seller.uid;
+  strcpy(flag.secret, "FLAG{bench}");
+  ok = ok && storage_flag_insert(s, &flag, &flag) == STORAGE_OK;
+  listing.fid = flag.id;
+  listing.price = 1;
+  strcpy(listing.note, "bench");
+  ok = ok && storage_listing_insert(s, &listing, &listing) == STORAGE_OK;
+  storage_close(s);
+  if (!ok)
+    return -1;
+
+  double t0 = now_sec();
+  for (int c = 0; c < clients; c++) {
+    pid_t pid = fork();
+    if (pid < 0)
+      return -1;
+    if (pid == 0)
+      _exit(run_client(db_path, c, iters, listing.id));
+  }
+  int failed = 0;
+  for (int c = 0; c < clients; c++) {
+    int status;
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+      failed++;
+  }
+  double elapsed = now_sec() - t0;
+  report("sessions", clients * iters, elapsed);
+  printf("%d/%d clients failed\n", failed, clients);
+  return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+  const char *db_path = argc > 1 ? argv[1] : ":memory:";
+  int iters = argc > 2 ? atoi(argv[2]) : 20000;
+  int clients = argc > 3 ? atoi(argv[3]) : 1;
+  if (iters <= 0 || clients <= 0 ||
+      (clients > 1 && strcmp(db_path, ":memory:") == 0)) {
+    fprintf(stderr, "usage: %s [db_path] [iterations] [clients]\n", argv[0]);
+    return 1;
+  }
+
+  if (clients > 1)
+    return bench_concurrent(db_path, iters, clients) ? 1 : 0;
+
+  Storage *s = NULL;
+  if (open_storage(db_path, &s))
+    return 1;
+  printf("%s backend, %s\n", storage_backend_name(s), db_path);
+
+  int rc = 0;
+  if (bench_register(s, iters) || bench_login(s, iters) || bench_buy(s, iters))
+    rc = 1;
+
+  storage_close(s);
+  return rc;
+}
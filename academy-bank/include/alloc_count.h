@@ -0,0 +1,15 @@
+// Academy Bank - allocation counting
+//
+// Only linked into the alloc-count build (ACADEMY_BANK_COUNT_ALLOCS), where
+// it wraps malloc, calloc and realloc to count heap allocations. admin-stats
+// then shows how many each command made, which is zero for a warm session.
+
+#ifndef ACADEMY_BANK_ALLOC_COUNT_H
+#define ACADEMY_BANK_ALLOC_COUNT_H
+
+#include <stdint.h>
+
+// Allocations made by this process so far.
+uint64_t alloc_count(void);
+
+#endif // ACADEMY_BANK_ALLOC_COUNT_H
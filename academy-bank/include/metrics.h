@@ -0,0 +1,46 @@
+// Academy Bank - latency metrics
+//
+// Process-wide registry of per-operation latency histograms. Buckets are
+// linear within each power of two of nanoseconds, HDR-style, so a sample is
+// reported to within 1/16 of its value and recording one is a single array
+// increment. Not thread-safe: every server mode runs its sessions on one
+// thread per process, and each process keeps its own numbers.
+
+#ifndef ACADEMY_BANK_METRICS_H
+#define ACADEMY_BANK_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_SUB_BITS 4
+#define METRICS_MAX_BITS 40 // samples are clamped to 2^40 ns, about 18 min
+#define METRICS_BUCKETS                                                        \
+  ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+typedef struct {
+  const char *kind; // "storage", "command" or "frame"
+  const char *name;
+  uint64_t count;
+  uint64_t errors;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[METRICS_BUCKETS];
+} OpMetric;
+
+// Returns the metric for (kind, name), registering it on first use. kind and
+// name must outlive the process. Never NULL: once the registry is full, new
+// names share one metric that is not listed.
+OpMetric *metrics_op(const char *kind, const char *name);
+
+uint64_t metrics_now_ns(void);
+// Records the time since start_ns, as returned by metrics_now_ns.
+void metrics_record(OpMetric *m, uint64_t start_ns, bool error);
+// Upper bound of the bucket holding quantile q (0..1); 0 with no samples.
+uint64_t metrics_percentile_ns(const OpMetric *m, double q);
+
+// Registered metrics in registration order.
+size_t metrics_count(void);
+const OpMetric *metrics_at(size_t i);
+
+#endif // ACADEMY_BANK_METRICS_H
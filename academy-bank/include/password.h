@@ -0,0 +1,81 @@
+// Academy Bank - password hashing
+//
+// Passwords are stored in User.password as salted scrypt hashes that carry
+// their own cost, so raising it leaves existing hashes valid:
+//
+//   $scrypt$<log2 N>$<r>$<p>$<salt hex>$<key hex>
+//
+// Rows written before hashing hold the plain password. They still verify,
+// and a successful check also produces a hash to store in their place.
+//
+// scrypt is slow on purpose. Successful checks are remembered in a bounded
+// per-process cache keyed by user name; an entry holds an HMAC of the stored
+// hash and the password under a random per-process key, and no longer
+// matches once either changes. The server runs hashes on a PasswordPool so
+// the event loop never waits on one; the REPL and prefork workers run them
+// inline.
+//
+// The cache only helps a process that serves many logins. Deployed under
+// ynetd, every connection is a fresh REPL process, so it never hits there;
+// the REPL hashes at PASSWORD_REPL_LOG2_N instead to keep each login cheap.
+
+#ifndef ACADEMY_BANK_PASSWORD_H
+#define ACADEMY_BANK_PASSWORD_H
+
+#include "storage.h"
+
+#include <stdbool.h>
+
+#define PASSWORD_MAX 255        // longest password read from a command
+#define PASSWORD_HASH_SZ 128    // sizeof(User.password)
+#define PASSWORD_REPL_LOG2_N 12 // default scrypt cost for the REPL
+
+typedef struct {
+  int scrypt_log2_n;
+  int scrypt_r;
+  int scrypt_p;
+  int login_cache_entries; // 0 disables the cache
+} PasswordOptions;
+
+void password_options_default(PasswordOptions *opts);
+// Overrides from ACADEMY_BANK_SCRYPT_LOG2_N, ACADEMY_BANK_SCRYPT_R,
+// ACADEMY_BANK_SCRYPT_P and ACADEMY_BANK_LOGIN_CACHE.
+void password_options_from_env(PasswordOptions *opts);
+// Call once, before any hashing. Returns false if the options are out of
+// range or the cache cannot be allocated.
+bool password_init(const PasswordOptions *opts);
+
+typedef enum { PASSWORD_HASH, PASSWORD_VERIFY } PasswordOp;
+
+// One hash or check. The caller owns the job and must not touch it while a
+// pool has it. password is wiped once the job has run.
+typedef struct PasswordJob {
+  PasswordOp op;
+  char name[NAME_SZ]; // VERIFY: cache key
+  char password[PASSWORD_MAX + 1];
+  char stored[PASSWORD_HASH_SZ]; // VERIFY: what the user row holds
+  char hash[PASSWORD_HASH_SZ];   // the new hash, or "" if none
+  bool ok;                       // HASH: hashed; VERIFY: matched
+  void *owner;
+  struct PasswordJob *next;
+} PasswordJob;
+
+void password_job_run(PasswordJob *job);
+// True if name logged in with this password against this stored value
+// recently enough to still be cached. Cheap; no scrypt.
+bool password_check_cached(const char *name, const char *password,
+                           const char *stored);
+
+typedef struct PasswordPool PasswordPool;
+
+// Starts threads workers. Returns NULL on failure.
+PasswordPool *password_pool_new(int threads);
+// Stops the workers. Jobs still queued are dropped unrun.
+void password_pool_free(PasswordPool *pool);
+// Readable while finished jobs are waiting to be taken.
+int password_pool_fd(const PasswordPool *pool);
+void password_pool_submit(PasswordPool *pool, PasswordJob *job);
+// Next finished job, or NULL once there are none.
+PasswordJob *password_pool_take(PasswordPool *pool);
+
+#endif // ACADEMY_BANK_PASSWORD_H
@@ -0,0 +1,92 @@
+// Academy Bank - binary protocol
+//
+// A session starts in the text REPL. A client that sends BANK_PROTO_MAGIC as
+// the very first byte (after reading the greeting up to the first prompt)
+// switches the session to length-prefixed binary frames for the rest of the
+// connection.
+//
+// Every request and response is a BankFrameHeader followed by len payload
+// bytes, all in host byte order. Requests leave status zero; responses echo
+// the op and carry a BankStatus. Record payloads are the storage.h structs
+// copied as-is, and list responses are len / sizeof(record) of them back to
+// back. Passwords are never sent back.
+
+#ifndef ACADEMY_BANK_PROTOCOL_H
+#define ACADEMY_BANK_PROTOCOL_H
+
+#include "storage.h"
+
+#include <stdint.h>
+
+#define BANK_PROTO_MAGIC 0xB1
+#define BANK_PROTO_MAX_PAYLOAD 4096
+
+typedef enum {
+  BANK_OP_REGISTER = 1,       // BankCredentials -> User
+  BANK_OP_LOGIN = 2,          // BankCredentials -> User
+  BANK_OP_LOGOUT = 3,         // -> empty
+  BANK_OP_WHOAMI = 4,         // -> User
+  BANK_OP_BALANCE = 5,        // -> User, refreshed from storage
+  BANK_OP_DEPOSIT_FLAG = 6,   // BankDepositRequest -> Flag
+  BANK_OP_MY_FLAGS = 7,       // [BankPageRequest] -> Flag[]
+  BANK_OP_LIST_FLAG = 8,      // BankListRequest -> Listing
+  BANK_OP_MY_LISTINGS = 9,    // [BankPageRequest] -> Listing[]
+  BANK_OP_VIEW_LISTING = 10,  // BankIdRequest -> Listing
+  BANK_OP_BUY = 11,           // BankIdRequest -> Flag
+  BANK_OP_DELETE_USER = 12,   // -> empty
+  BANK_OP_DELETE_FLAG = 13,   // BankIdRequest -> empty
+  BANK_OP_DELETE_LISTING = 14 // BankIdRequest -> empty
+} BankOp;
+
+typedef enum {
+  BANK_STATUS_OK = 0,
+  BANK_STATUS_NOT_FOUND = 1,
+  BANK_STATUS_CONFLICT = 2,
+  BANK_STATUS_INVALID = 3,
+  BANK_STATUS_INSUFFICIENT_FUNDS = 4,
+  BANK_STATUS_NOT_LOGGED_IN = 5,
+  BANK_STATUS_FORBIDDEN = 6,
+  BANK_STATUS_ERROR = 255
+} BankStatus;
+
+typedef struct {
+  uint32_t len;
+  uint8_t op;
+  uint8_t status;
+  uint16_t reserved;
+} BankFrameHeader;
+
+typedef struct {
+  char name[NAME_SZ];
+  char password[128];
+} BankCredentials;
+
+typedef struct {
+  char secret[FLAG_SZ];
+} BankDepositRequest;
+
+typedef struct {
+  uint64_t fid;
+  uint64_t price;
+  char note[NOTE_SZ];
+} BankListRequest;
+
+typedef struct {
+  uint64_t id;
+} BankIdRequest;
+
+// Optional payload for the list ops: up to limit records with id > after_id,
+// in id order. An empty payload lists everything.
+typedef struct {
+  uint64_t after_id;
+  uint32_t limit;
+  uint32_t reserved;
+} BankPageRequest;
+
+_Static_assert(sizeof(BankFrameHeader) == 8, "frame header layout");
+_Static_assert(sizeof(BankPageRequest) == 16, "page request layout");
+_Static_assert(sizeof(User) == 8 + NAME_SZ + 8 + 128, "User layout");
+_Static_assert(sizeof(Flag) == 16 + FLAG_SZ, "Flag layout");
+_Static_assert(sizeof(Listing) == 32 + NOTE_SZ, "Listing layout");
+
+#endif // ACADEMY_BANK_PROTOCOL_H
@@ -0,0 +1,52 @@
+// Academy Bank - in-process record cache
+//
+// Bounded LRU caches of User, Flag and Listing records keyed by id, plus users
+// by name. Records are copied in and out, never handed out by pointer. The
+// storage layer keeps it write-through; this module only knows about records,
+// not about the database behind them.
+
+#ifndef ACADEMY_BANK_RECORD_CACHE_H
+#define ACADEMY_BANK_RECORD_CACHE_H
+
+#include "storage.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct RecordCache RecordCache;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+} RecordCacheStats;
+
+// capacity is per record type. Returns NULL on allocation failure.
+RecordCache *record_cache_new(size_t capacity);
+void record_cache_free(RecordCache *cache);
+void record_cache_clear(RecordCache *cache);
+void record_cache_stats(const RecordCache *cache, RecordCacheStats *out);
+
+bool record_cache_get_user(RecordCache *cache, uint64_t uid, User *out);
+bool record_cache_get_user_by_name(RecordCache *cache, const char *name,
+                                   User *out);
+void record_cache_put_user(RecordCache *cache, const User *user);
+void record_cache_drop_user(RecordCache *cache, uint64_t uid);
+// Adds delta (mod 2^64) to a cached balance; a no-op if uid is not cached.
+void record_cache_adjust_balance(RecordCache *cache, uint64_t uid,
+                                 uint64_t delta);
+
+bool record_cache_get_flag(RecordCache *cache, uint64_t id, Flag *out);
+void record_cache_put_flag(RecordCache *cache, const Flag *flag);
+void record_cache_drop_flag(RecordCache *cache, uint64_t id);
+void record_cache_drop_flags_for_user(RecordCache *cache, uint64_t uid);
+
+bool record_cache_get_listing(RecordCache *cache, uint64_t id, Listing *out);
+void record_cache_put_listing(RecordCache *cache, const Listing *listing);
+void record_cache_drop_listing(RecordCache *cache, uint64_t id);
+void record_cache_drop_listings_for_flag(RecordCache *cache, uint64_t fid);
+void record_cache_drop_all_listings(RecordCache *cache);
+// Bumps a cached listing's sale_count; a no-op if id is not cached.
+void record_cache_record_sale(RecordCache *cache, uint64_t id);
+
+#endif // ACADEMY_BANK_RECORD_CACHE_H
@@ -3,6 +3,7 @@
 #ifndef ACADEMY_BANK_STORAGE_H
 #define ACADEMY_BANK_STORAGE_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -41,19 +42,67 @@ typedef struct {
 
 typedef struct Storage Storage;
 
+// Connection tuning applied by storage_open_with_options. String pragmas are
+// passed through to SQLite (NULL keeps its default), mmap_size < 0 and
+// cache_size == 0 keep the defaults, and busy_timeout_ms bounds how long a
+// locked database is retried with backoff before STORAGE_ERR.
+// record_cache_entries sizes the in-process User/Flag/Listing cache per
+// record type; 0 disables it. read_connections opens that many read-only
+// SQLite connections for read calls made outside a transaction (WAL only);
+// 0 keeps every call on the one connection.
+typedef struct {
+  const char *journal_mode;
+  const char *synchronous;
+  int64_t mmap_size;
+  int cache_size;
+  int busy_timeout_ms;
+  int record_cache_entries;
+  int read_connections;
+} StorageOptions;
+
 typedef enum {
   STORAGE_OK = 0,
   STORAGE_NOT_FOUND = 1,
   STORAGE_CONFLICT = 2,
   STORAGE_INVALID = 3,
+  STORAGE_INSUFFICIENT_FUNDS = 4,
   STORAGE_ERR = -1
 } StorageResult;
 
+// Iterator callbacks return non-zero to stop early. They must not call back
+// into the same iterator on the same Storage, which owns a single cursor.
 typedef int (*flag_iter_cb)(const Flag *flag, void *ctx);
 typedef int (*listing_iter_cb)(const Listing *listing, void *ctx);
 
+// Resumable keyset position in one user's flags or listings. It is plain
+// data, so callers can keep it between requests; inserts and deletes do not
+// invalidate it. done is set once a page comes back short.
+typedef struct {
+  uint64_t uid;
+  uint64_t after_id;
+  size_t page_size;
+  bool done;
+} StorageCursor;
+
+void storage_options_default(StorageOptions *opts);
+// Overrides opts from ACADEMY_BANK_JOURNAL_MODE, ACADEMY_BANK_SYNCHRONOUS,
+// ACADEMY_BANK_MMAP_SIZE, ACADEMY_BANK_CACHE_SIZE,
+// ACADEMY_BANK_BUSY_TIMEOUT_MS, ACADEMY_BANK_RECORD_CACHE and
+// ACADEMY_BANK_READ_CONNECTIONS when they are set.
+void storage_options_from_env(StorageOptions *opts);
+
+// db_path selects the backend by scheme: "log:<file>" opens the append-only
+// log backend (an empty file name or ":memory:" keeps it in memory),
+// "sqlite:<file>" or a path without a scheme opens SQLite, and
+// "shard:<n>:<path>" spreads users over n databases opened from <path>.0 to
+// <path>.<n-1>.
 StorageResult storage_open(const char *db_path, Storage **out_storage);
+StorageResult storage_open_with_options(const char *db_path,
+                                        const StorageOptions *opts,
+                                        Storage **out_storage);
 void storage_close(Storage *storage);
+// "sqlite", "log" or "shard".
+const char *storage_backend_name(const Storage *storage);
 
 StorageResult storage_user_get_by_id(Storage *storage, uint64_t uid,
                                      User *out_user);
@@ -69,6 +118,11 @@ StorageResult storage_flag_get_by_id(Storage *storage, uint64_t id,
                                      Flag *out_flag);
 StorageResult storage_iter_flags_for_user(Storage *storage, uint64_t uid,
                                           flag_iter_cb cb, void *ctx);
+// Keyset pagination: passes at most limit records with id > after_id to cb,
+// in id order. limit 0 means no limit.
+StorageResult storage_page_flags_for_user(Storage *storage, uint64_t uid,
+                                          uint64_t after_id, size_t limit,
+                                          flag_iter_cb cb, void *ctx);
 StorageResult storage_flag_insert(Storage *storage, const Flag *flag,
                                   Flag *out_flag);
 StorageResult storage_flag_update(Storage *storage, const Flag *flag);
@@ -78,10 +132,87 @@ StorageResult storage_listing_get_by_id(Storage *storage, uint64_t id,
                                         Listing *out_listing);
 StorageResult storage_iter_listings_for_user(Storage *storage, uint64_t uid,
                                              listing_iter_cb cb, void *ctx);
+StorageResult storage_page_listings_for_user(Storage *storage, uint64_t uid,
+                                             uint64_t after_id, size_t limit,
+                                             listing_iter_cb cb, void *ctx);
+
+void storage_cursor_init(StorageCursor *cursor, uint64_t uid,
+                         uint64_t after_id, size_t page_size);
+// Pass the next page to cb and advance the cursor past it.
+StorageResult storage_cursor_next_flags(Storage *storage, StorageCursor *cursor,
+                                        flag_iter_cb cb, void *ctx);
+StorageResult storage_cursor_next_listings(Storage *storage,
+                                           StorageCursor *cursor,
+                                           listing_iter_cb cb, void *ctx);
 
 StorageResult storage_listing_insert(Storage *storage, const Listing *listing,
                                      Listing *out_listing);
 StorageResult storage_listing_update(Storage *storage, const Listing *listing);
 StorageResult storage_listing_delete_by_id(Storage *storage, uint64_t id);
 
+// Buys listing_id for buyer_uid in a single transaction: debits price from the
+// buyer, credits price - fee to the seller, delivers a copy of the flag and
+// bumps the listing's sale count. Returns STORAGE_NOT_FOUND if the listing no
+// longer exists at that price and STORAGE_INSUFFICIENT_FUNDS if the buyer
+// cannot afford it; nothing is written in either case.
+StorageResult storage_purchase_listing(Storage *storage, uint64_t listing_id,
+                                       uint64_t buyer_uid, uint64_t price,
+                                       uint64_t fee, Flag *out_flag);
+
+typedef struct {
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t busy_retries; // lock waits retried by the busy handler
+  uint64_t reader_reads; // reads served by a read-only connection
+} StorageStats;
+
+// Counters since open. Backends without a record cache, busy handler or
+// read connections report zero for those. Per-call latencies are in the
+// metrics registry.
+void storage_get_stats(Storage *storage, StorageStats *out);
+
+// Group commit. While enabled, the first write opens a batch transaction that
+// later writes join, and none of them is durable or visible to other
+// connections until storage_batch_commit. Each write still succeeds or fails
+// on its own. Disabling commits any open batch.
+StorageResult storage_set_group_commit(Storage *storage, bool enable);
+// Writes issued since the open batch began; 0 when no batch is open.
+size_t storage_batch_pending(const Storage *storage);
+// Commits the open batch, if any, syncing it as the synchronous setting
+// asks. On failure none of the batch's writes can be relied on.
+StorageResult storage_batch_commit(Storage *storage);
+// Parts of the storage whose open batch the calls since the last take could
+// see, as a bitmask: one bit per shard for the shard backend, bit 0 for the
+// others. A server takes them after serving each session, so that when a
+// commit fails it only drops sessions whose replies depend on lost writes.
+uint64_t storage_batch_take_parts(Storage *storage);
+// storage_batch_commit that also sets *lost to the parts whose writes did
+// not commit; 0 on success.
+StorageResult storage_batch_commit_parts(Storage *storage, uint64_t *lost);
+
+// Online backup. The copy is taken in steps of pages_per_step database pages
+// (log backend: that many 4 KiB pages of log), pausing pause_ms between
+// steps, so writers on other connections and in other processes keep going
+// while it runs. Any batch open on storage is committed first. The result is
+// a consistent image of the database as it stood at one instant during the
+// call, in the backend's own file format.
+typedef struct {
+  int pages_per_step;
+  int pause_ms;
+} StorageBackupOptions;
+
+void storage_backup_options_default(StorageBackupOptions *opts);
+// Overrides opts from ACADEMY_BANK_BACKUP_PAGES and
+// ACADEMY_BANK_BACKUP_PAUSE_MS when they are set.
+void storage_backup_options_from_env(StorageBackupOptions *opts);
+// Streams a snapshot to fd, which stays open. STORAGE_INVALID for sharded
+// storage, which has no single image to stream.
+StorageResult storage_snapshot_to_fd(Storage *storage, int fd,
+                                     const StorageBackupOptions *opts);
+// Writes a snapshot next to dest_path, syncs it and renames it into place,
+// so dest_path never holds a partial copy. Sharded storage writes shard i to
+// dest_path.<i>, each taken at an instant of its own.
+StorageResult storage_backup_to_file(Storage *storage, const char *dest_path,
+                                     const StorageBackupOptions *opts);
+
 #endif // ACADEMY_BANK_STORAGE_H
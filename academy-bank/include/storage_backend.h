@@ -0,0 +1,103 @@
+// Academy Bank - storage backend interface
+//
+// storage.c picks a backend from the scheme of the path given to
+// storage_open and forwards every storage.h call through its StorageOps.
+// A backend embeds struct Storage as the first member of its own handle.
+// Arguments are validated in storage.c, so ops never see NULL handles or
+// output pointers that storage.h documents as required.
+
+#ifndef ACADEMY_BANK_STORAGE_BACKEND_H
+#define ACADEMY_BANK_STORAGE_BACKEND_H
+
+#include "storage.h"
+
+#include <stdio.h>
+
+typedef struct {
+  const char *name;
+  void (*close)(Storage *storage);
+
+  StorageResult (*user_get_by_id)(Storage *storage, uint64_t uid,
+                                  User *out_user);
+  StorageResult (*user_get_by_name)(Storage *storage, const char *name,
+                                    User *out_user);
+  StorageResult (*user_insert)(Storage *storage, const User *user,
+                               User *out_user);
+  StorageResult (*user_update)(Storage *storage, const User *user);
+  StorageResult (*user_delete_by_id)(Storage *storage, uint64_t uid);
+
+  StorageResult (*flag_get_by_id)(Storage *storage, uint64_t id,
+                                  Flag *out_flag);
+  StorageResult (*page_flags_for_user)(Storage *storage, uint64_t uid,
+                                       uint64_t after_id, size_t limit,
+                                       flag_iter_cb cb, void *ctx);
+  StorageResult (*flag_insert)(Storage *storage, const Flag *flag,
+                               Flag *out_flag);
+  StorageResult (*flag_update)(Storage *storage, const Flag *flag);
+  StorageResult (*flag_delete_by_id)(Storage *storage, uint64_t id);
+
+  StorageResult (*listing_get_by_id)(Storage *storage, uint64_t id,
+                                     Listing *out_listing);
+  StorageResult (*page_listings_for_user)(Storage *storage, uint64_t uid,
+                                          uint64_t after_id, size_t limit,
+                                          listing_iter_cb cb, void *ctx);
+  StorageResult (*listing_insert)(Storage *storage, const Listing *listing,
+                                  Listing *out_listing);
+  StorageResult (*listing_update)(Storage *storage, const Listing *listing);
+  StorageResult (*listing_delete_by_id)(Storage *storage, uint64_t id);
+
+  StorageResult (*purchase_listing)(Storage *storage, uint64_t listing_id,
+                                    uint64_t buyer_uid, uint64_t price,
+                                    uint64_t fee, Flag *out_flag);
+
+  // Group commit: storage.c calls batch_begin before the first write of a
+  // batch and batch_commit once; writes in between must not commit alone.
+  // batch_rollback discards the batch instead; the shard backend uses it to
+  // abort a two-phase purchase.
+  StorageResult (*batch_begin)(Storage *storage);
+  StorageResult (*batch_commit)(Storage *storage);
+  StorageResult (*batch_rollback)(Storage *storage);
+  // Optional, for backends split into parts that commit on their own (the
+  // shard backend's shards). batch_take_parts returns the parts used under
+  // an open batch since the last call, batch_lost_parts those whose batch
+  // writes did not commit; storage.c treats other backends as one part.
+  uint64_t (*batch_take_parts)(Storage *storage);
+  uint64_t (*batch_lost_parts)(Storage *storage);
+
+  void (*stats)(Storage *storage, StorageStats *out);
+
+  // Online backup; storage.c has already committed any open batch. A
+  // backend that is more than one database sets backup_to_file instead of
+  // snapshot and writes one file per part.
+  StorageResult (*snapshot)(Storage *storage, int fd,
+                            const StorageBackupOptions *opts);
+  StorageResult (*backup_to_file)(Storage *storage, const char *dest_path,
+                                  const StorageBackupOptions *opts);
+} StorageOps;
+
+// The batch fields belong to storage.c; backends leave them zeroed.
+struct Storage {
+  const StorageOps *ops;
+  bool group_commit;
+  bool batch_open;
+  size_t batch_writes;
+};
+
+// Backend constructors; path has its scheme already stripped.
+StorageResult storage_sqlite_open(const char *path, const StorageOptions *opts,
+                                  Storage **out_storage);
+StorageResult storage_log_open(const char *path, const StorageOptions *opts,
+                               Storage **out_storage);
+StorageResult storage_shard_open(const char *path, const StorageOptions *opts,
+                                 Storage **out_storage);
+
+// Helpers for snapshot. storage_write_all retries short writes and EINTR;
+// storage_pause sleeps between backup steps.
+bool storage_write_all(int fd, const void *data, size_t len);
+void storage_pause(int ms);
+
+// Prints the query plan of each sqlite page scan to out. False unless every
+// one searches through its index, or if storage is not sqlite.
+bool storage_sqlite_check_plans(Storage *storage, FILE *out);
+
+#endif // ACADEMY_BANK_STORAGE_BACKEND_H
@@ -0,0 +1,33 @@
+#define _GNU_SOURCE
+
+#include "alloc_count.h"
+
+#include <stddef.h>
+
+// glibc's own entry points, which the wrappers below forward to.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocations;
+
+void *malloc(size_t size) {
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+// realloc(ptr, 0) frees rather than allocates.
+void *realloc(void *ptr, size_t size) {
+  if (!ptr || size)
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+uint64_t alloc_count(void) {
+  return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
@@ -1,145 +1,353 @@
+#define _GNU_SOURCE
+
+#ifdef ACADEMY_BANK_COUNT_ALLOCS
+#include "alloc_count.h"
+#endif
+#include "metrics.h"
+#include "password.h"
+#include "protocol.h"
 #include "storage.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_SZ 1024
+#define INPUT_SZ 16384
+#define MAX_PAGE 1000
 
 typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} OutBuf;
+
+// Records a text command works on. Each session allocates one on its first
+// command and every handler reuses it, with storage calls filling it in
+// place, so a warm session serves requests without touching the heap.
+typedef struct {
+  Listing listing;
+  Flag flag;
+  PasswordJob job;
+  User user;
+} Scratch;
+
+typedef struct AppContext AppContext;
+typedef void (*job_done_fn)(AppContext *app, PasswordJob *job);
+
+// Per-session state. The REPL has exactly one; server mode keeps one per
+// connection, all sharing a single Storage. Command output is appended to
+// out and written to the client once the command has run.
+//
+// With a hash_pool, register and login park on a password job: job is set,
+// later input waits, and app_resume finishes the command in job_done.
+struct AppContext {
   Storage *storage;
   User *current_user;
   bool logged_in;
-} AppContext;
-
-static void print_banner(void) {
-  printf("===============================\n");
-  printf("   Welcome to Academy Bank\n");
-  printf("===============================\n");
-}
-
-static void print_help(void) {
-  printf("Commands:\n");
-  printf("  help                       - Show this help\n");
-  printf("  register <name> <paswd>    - Create a new user (100 credits)\n");
-  printf("  login <name> <paswd>       - Log in as existing user\n");
-  printf("  whoami                     - Show current user\n");
-  printf("  balance                    - Show balance\n");
-  printf("  deposit-flag <secret>      - Store a secret flag\n");
-  printf("  my-flags                   - List your flags\n");
-  printf("  list-flag <fid> <price> <note> - Create a listing for a flag\n");
-  printf("  my-listings                - List your listings\n");
-  printf("  view-listing <id>          - View listing by id\n");
-  printf("  buy <listing_id>           - Buy a listing\n");
-  printf("  delete-user                - Delete current user\n");
-  printf("  delete-flag <id>           - Delete a flag by id\n");
-  printf("  delete-listing <id>        - Delete a listing by id\n");
-  printf("  logout                     - Logout\n");
-  printf("  exit                       - Exit\n");
+  bool pipelined;
+  bool negotiated;
+  bool binary;
+  bool failed;
+  StorageCursor flag_cursor;
+  StorageCursor listing_cursor;
+  Scratch *scratch;
+  PasswordPool *hash_pool;
+  PasswordJob *job;
+  job_done_fn job_done;
+  OpMetric *job_metric;
+  uint64_t job_start;
+  size_t job_out_at;
+  OutBuf out;
+};
+
+static const char BANNER_TEXT[] = "===============================\n"
+                                  "   Welcome to Academy Bank\n"
+                                  "===============================\n";
+
+static const char HELP_TEXT[] =
+    "Commands:\n"
+    "  help                       - Show this help\n"
+    "  register <name> <paswd>    - Create a new user (100 credits)\n"
+    "  login <name> <paswd>       - Log in as existing user\n"
+    "  whoami                     - Show current user\n"
+    "  balance                    - Show balance\n"
+    "  deposit-flag <secret>      - Store a secret flag\n"
+    "  my-flags [n [after]|next]  - List your flags, n per page\n"
+    "  list-flag <fid> <price> <note> - Create a listing for a flag\n"
+    "  my-listings [n [after]|next] - List your listings, n per page\n"
+    "  view-listing <id>          - View listing by id\n"
+    "  buy <listing_id>           - Buy a listing\n"
+    "  delete-user                - Delete current user\n"
+    "  delete-flag <id>           - Delete a flag by id\n"
+    "  delete-listing <id>        - Delete a listing by id\n"
+    "  logout                     - Logout\n"
+    "  pipeline                   - No prompts; a blank line ends each reply\n"
+    "  exit                       - Exit\n";
+
+static const char PROMPT_TEXT[] = "\n> ";
+
+static void oom(void);
+
+static void out_reserve(OutBuf *out, size_t extra) {
+  if (out->cap - out->len >= extra)
+    return;
+  size_t cap = out->cap ? out->cap : 256;
+  while (cap - out->len < extra)
+    cap *= 2;
+  char *data = realloc(out->data, cap);
+  if (!data)
+    oom();
+  out->data = data;
+  out->cap = cap;
+}
+
+static void app_write(AppContext *app, const char *data, size_t len) {
+  out_reserve(&app->out, len);
+  memcpy(app->out.data + app->out.len, data, len);
+  app->out.len += len;
+}
+
+static void app_puts(AppContext *app, const char *s) {
+  app_write(app, s, strlen(s));
 }
 
+__attribute__((format(printf, 2, 0))) static void
+app_vprintf(AppContext *app, const char *fmt, va_list ap) {
+  out_reserve(&app->out, 128);
+  for (;;) {
+    size_t avail = app->out.cap - app->out.len;
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(app->out.data + app->out.len, avail, fmt, copy);
+    va_end(copy);
+    if (n < 0)
+      return;
+    if ((size_t)n < avail) {
+      app->out.len += (size_t)n;
+      return;
+    }
+    out_reserve(&app->out, (size_t)n + 1);
+  }
+}
+
+__attribute__((format(printf, 2, 3))) static void
+app_printf(AppContext *app, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  app_vprintf(app, fmt, ap);
+  va_end(ap);
+}
+
+// Prints a reply that reports a failed command; op_done counts the command
+// as an error whatever the text says.
+__attribute__((format(printf, 2, 3))) static void
+app_fail(AppContext *app, const char *fmt, ...) {
+  va_list ap;
+  app->failed = true;
+  va_start(ap, fmt);
+  app_vprintf(app, fmt, ap);
+  va_end(ap);
+}
+
+static void print_banner(AppContext *app) { app_puts(app, BANNER_TEXT); }
+
+static void print_help(AppContext *app) { app_puts(app, HELP_TEXT); }
+
 static void oom(void) {
   printf("error: OOM\n");
   exit(1);
 }
 
+static Scratch *scratch_of(AppContext *app) {
+  if (!app->scratch && !(app->scratch = malloc(sizeof(Scratch))))
+    oom();
+  return app->scratch;
+}
+
 static void require_login(AppContext *app) {
   if (!app->logged_in) {
-    printf("[!] You must be logged in.\n");
+    app_fail(app, "[!] You must be logged in.\n");
   }
 }
 
 static int print_flag_cb(const Flag *flag, void *ctx) {
-  (void)ctx;
-  printf("  id=%llu secret=%s\n", (unsigned long long)flag->id, flag->secret);
+  AppContext *app = ctx;
+  app_printf(app, "  id=%llu secret=%s\n", (unsigned long long)flag->id,
+             flag->secret);
   return 0;
 }
 
 static int print_listing_cb(const Listing *l, void *ctx) {
-  (void)ctx;
-  printf("  id=%llu fid=%llu price=%llu sales=%llu note=%s\n",
-         (unsigned long long)l->id, (unsigned long long)l->fid,
-         (unsigned long long)l->price, (unsigned long long)l->sale_count,
-         l->note);
+  AppContext *app = ctx;
+  app_printf(app, "  id=%llu fid=%llu price=%llu sales=%llu note=%s\n",
+             (unsigned long long)l->id, (unsigned long long)l->fid,
+             (unsigned long long)l->price, (unsigned long long)l->sale_count,
+             l->note);
   return 0;
 }
 
+// Runs the session's scratch job. Without a pool it runs inline and done
+// follows at once; with one the command is parked until the server hands the
+// finished job to app_resume.
+static void run_password_job(AppContext *app, job_done_fn done) {
+  PasswordJob *job = &app->scratch->job;
+  if (!app->hash_pool) {
+    password_job_run(job);
+    done(app, job);
+    return;
+  }
+  job->owner = app;
+  app->job = job;
+  app->job_done = done;
+  password_pool_submit(app->hash_pool, job);
+}
+
+// Swaps a plain-text password left from before hashing for its new hash.
+// The row is reread first: balance may have moved while the job ran.
+static void store_rehash(AppContext *app, User *user, const char *hash) {
+  User fresh;
+  if (storage_user_get_by_id(app->storage, user->uid, &fresh) != STORAGE_OK)
+    return;
+  memcpy(fresh.password, hash, sizeof(fresh.password));
+  if (storage_user_update(app->storage, &fresh) == STORAGE_OK)
+    *user = fresh;
+}
+
+static void register_hashed(AppContext *app, PasswordJob *job);
+
 static void cmd_register(AppContext *app, const char *args) {
-  User *new_user = malloc(sizeof(User));
-  if (!new_user)
-    oom();
+  User *new_user = &scratch_of(app)->user;
 
   while (*args == ' ')
     args++;
   if (sscanf(args, "%63s %255s", new_user->name, new_user->password) < 2) {
-    printf("usage: register <name> <password>\n");
-    free(new_user);
+    app_fail(app, "usage: register <name> <password>\n");
     return;
   }
   new_user->balance = 100;
 
+  // Spare the hash when the name is taken; insert still catches a race.
+  User existing;
+  if (storage_user_get_by_name(app->storage, new_user->name, &existing) ==
+      STORAGE_OK) {
+    app_fail(app, "[!] Username already exists\n");
+    return;
+  }
+  PasswordJob *job = &app->scratch->job;
+  job->op = PASSWORD_HASH;
+  snprintf(job->password, sizeof(job->password), "%s", new_user->password);
+  run_password_job(app, register_hashed);
+}
+
+static void register_hashed(AppContext *app, PasswordJob *job) {
+  User *new_user = &app->scratch->user;
+  if (!job->ok) {
+    app_fail(app, "[!] Failed to register\n");
+    return;
+  }
+  memcpy(new_user->password, job->hash, sizeof(new_user->password));
+
   StorageResult r = storage_user_insert(app->storage, new_user, new_user);
   if (r == STORAGE_OK) {
-    printf("Registered user %s with uid=%llu and balance=%llu\n",
-           new_user->name, (unsigned long long)new_user->uid,
-           (unsigned long long)new_user->balance);
+    app_printf(app, "Registered user %s with uid=%llu and balance=%llu\n",
+               new_user->name, (unsigned long long)new_user->uid,
+               (unsigned long long)new_user->balance);
   } else if (r == STORAGE_CONFLICT) {
-    printf("[!] Username already exists\n");
+    app_fail(app, "[!] Username already exists\n");
   } else {
-    printf("[!] Failed to register\n");
+    app_fail(app, "[!] Failed to register\n");
   }
-  free(new_user);
 }
 
-static void cmd_login(AppContext *app, const char *args) {
-  User *user = malloc(sizeof(User));
-  char password[256];
+// Checks password against the scratch user, from the login cache when it
+// can and otherwise on a password job; done gets the outcome either way.
+static void verify_password(AppContext *app, const char *password,
+                            job_done_fn done) {
+  User *user = &app->scratch->user;
+  PasswordJob *job = &app->scratch->job;
+  job->op = PASSWORD_VERIFY;
+  memcpy(job->name, user->name, sizeof(job->name));
+  memcpy(job->stored, user->password, sizeof(job->stored));
+  if (password_check_cached(user->name, password, user->password)) {
+    job->ok = true;
+    job->hash[0] = '\0';
+    done(app, job);
+    return;
+  }
+  snprintf(job->password, sizeof(job->password), "%s", password);
+  run_password_job(app, done);
+}
 
-  if (!user)
+// Logs the session in as the scratch user once its password checked out.
+// Only this allocates: the session's own copy, which lives until logout.
+static void login_as(AppContext *app, PasswordJob *job) {
+  User *user = &app->scratch->user;
+  if (job->hash[0])
+    store_rehash(app, user, job->hash);
+  if (!(app->current_user = malloc(sizeof(User))))
     oom();
+  *app->current_user = *user;
+  app->logged_in = true;
+}
 
-  if (app->current_user) {
-    printf("[!] Logout first\n");
+static void login_checked(AppContext *app, PasswordJob *job) {
+  if (!job->ok) {
+    app_fail(app, "[!] Invalid credentials\n");
     return;
   }
+  login_as(app, job);
+  app_printf(app, "Logged in as %s (uid=%llu)\n", app->current_user->name,
+             (unsigned long long)app->current_user->uid);
+}
 
-  if (!user) {
-    printf("error: oom\n");
+// The user is looked up in scratch and checked by verify_password.
+static void cmd_login(AppContext *app, const char *args) {
+  User *user = &scratch_of(app)->user;
+  char password[256];
+
+  if (app->current_user) {
+    app_fail(app, "[!] Logout first\n");
     return;
   }
 
   while (*args == ' ')
     args++;
   if (sscanf(args, "%63s %255s", user->name, password) < 2) {
-    printf("usage: login <name> <password>\n");
-    goto cleanup;
+    app_fail(app, "usage: login <name> <password>\n");
+    return;
   }
 
   if (storage_user_get_by_name(app->storage, user->name, user) != STORAGE_OK) {
-    printf("[!] Login failed\n");
-    goto cleanup;
-  }
-  if (strncmp(password, user->password, sizeof(password)) != 0) {
-    printf("[!] Invalid credentials\n");
-    goto cleanup;
+    app_fail(app, "[!] Login failed\n");
+    return;
   }
-  app->current_user = user;
-  app->logged_in = true;
-  printf("Logged in as %s (uid=%llu)\n", user->name,
-         (unsigned long long)user->uid);
-  return;
-
-cleanup:
-  free(user);
-  return;
+  verify_password(app, password, login_checked);
 }
 
 static void cmd_whoami(AppContext *app) {
   if (app->logged_in) {
-    printf("%s uid=%llu balance=%llu\n", app->current_user->name,
-           (unsigned long long)app->current_user->uid,
-           (unsigned long long)app->current_user->balance);
+    app_printf(app, "%s uid=%llu balance=%llu\n", app->current_user->name,
+               (unsigned long long)app->current_user->uid,
+               (unsigned long long)app->current_user->balance);
   } else {
-    printf("Not logged in\n");
+    app_fail(app, "Not logged in\n");
   }
 }
 
@@ -150,7 +358,8 @@ static void cmd_balance(AppContext *app) {
   }
   if (storage_user_get_by_id(app->storage, app->current_user->uid,
                              app->current_user) == STORAGE_OK) {
-    printf("Balance: %llu\n", (unsigned long long)app->current_user->balance);
+    app_printf(app, "Balance: %llu\n",
+               (unsigned long long)app->current_user->balance);
   }
 }
 
@@ -162,24 +371,20 @@ static void cmd_deposit_flag(AppContext *app, const char *args) {
   while (*args == ' ')
     args++;
   if (*args == '\0') {
-    printf("usage: deposit-flag <secret>\n");
+    app_fail(app, "usage: deposit-flag <secret>\n");
     return;
   }
 
-  Flag *flag = malloc(sizeof(Flag));
-  if (!flag)
-    oom();
+  Flag *flag = &scratch_of(app)->flag;
 
   flag->uid = app->current_user->uid;
   strncpy(flag->secret, args, sizeof(flag->secret) - 1);
 
   if (storage_flag_insert(app->storage, flag, flag) == STORAGE_OK) {
-    printf("Stored flag id=%llu\n", (unsigned long long)flag->id);
+    app_printf(app, "Stored flag id=%llu\n", (unsigned long long)flag->id);
   } else {
-    printf("[!] Failed to store flag\n");
+    app_fail(app, "[!] Failed to store flag\n");
   }
-
-  free(flag);
 }
 
 static void cmd_my_flags(AppContext *app) {
@@ -187,9 +392,9 @@ static void cmd_my_flags(AppContext *app) {
     require_login(app);
     return;
   }
-  printf("Your flags:\n");
+  app_printf(app, "Your flags:\n");
   storage_iter_flags_for_user(app->storage, app->current_user->uid,
-                              print_flag_cb, NULL);
+                              print_flag_cb, app);
 }
 
 static void cmd_list_flag(AppContext *app, const char *args) {
@@ -198,35 +403,30 @@ static void cmd_list_flag(AppContext *app, const char *args) {
     return;
   }
 
-  Listing *listing = malloc(sizeof(Listing));
-  Flag *flag = malloc(sizeof(Flag));
-  if (!listing || !flag)
-    oom();
+  Listing *listing = &scratch_of(app)->listing;
+  Flag *flag = &app->scratch->flag;
 
+  listing->note[0] = '\0';
   if (sscanf(args, "%llu %llu %47[^\n]", (unsigned long long *)&listing->fid,
              (unsigned long long *)&listing->price, listing->note) < 2) {
-    printf("usage: list-flag <fid> <price> <note>\n");
-    goto cleanup;
+    app_fail(app, "usage: list-flag <fid> <price> <note>\n");
+    return;
   }
   listing->sale_count = 0;
 
   if (storage_flag_get_by_id(app->storage, listing->fid, flag) != STORAGE_OK ||
       flag->uid != app->current_user->uid) {
-    printf("Invalid flag id\n");
-    goto cleanup;
+    app_fail(app, "Invalid flag id\n");
+    return;
   }
 
   if (storage_listing_insert(app->storage, listing, listing) == STORAGE_OK) {
-    printf("Created listing id=%llu price=%llu\n",
-           (unsigned long long)listing->id, (unsigned long long)listing->price);
+    app_printf(app, "Created listing id=%llu price=%llu\n",
+               (unsigned long long)listing->id,
+               (unsigned long long)listing->price);
   } else {
-    printf("[!] Failed to create listing\n");
+    app_fail(app, "[!] Failed to create listing\n");
   }
-
-cleanup:
-  free(listing);
-  free(flag);
-  return;
 }
 
 static void cmd_my_listings(AppContext *app) {
@@ -234,108 +434,132 @@ static void cmd_my_listings(AppContext *app) {
     require_login(app);
     return;
   }
-  printf("Your listings:\n");
+  app_printf(app, "Your listings:\n");
   storage_iter_listings_for_user(app->storage, app->current_user->uid,
-                                 print_listing_cb, NULL);
+                                 print_listing_cb, app);
+}
+
+// Page arguments for my-flags and my-listings: "<n> [after_id]" starts a
+// cursor, "next" resumes it. Returns false after printing an error.
+static bool page_cursor(AppContext *app, const char *cmd, const char *args,
+                        StorageCursor *cursor) {
+  unsigned long n = 0;
+  unsigned long long after_id = 0;
+  if (strncmp(args, "next", 4) == 0 && strchr(" \r", args[4])) {
+    if (!cursor->page_size || cursor->uid != app->current_user->uid) {
+      app_fail(app, "[!] Start with %s <n> [after_id]\n", cmd);
+      return false;
+    }
+    return true;
+  }
+  if (sscanf(args, "%lu %llu", &n, &after_id) < 1 || n == 0 ||
+      n > MAX_PAGE) {
+    app_fail(app, "usage: %s [<n> [after_id]|next] (n <= %d)\n", cmd,
+             MAX_PAGE);
+    return false;
+  }
+  storage_cursor_init(cursor, app->current_user->uid, after_id, n);
+  return true;
+}
+
+static void cmd_my_flags_page(AppContext *app, const char *args) {
+  if (args[strspn(args, " \r")] == '\0') {
+    cmd_my_flags(app);
+    return;
+  }
+  if (!app->logged_in) {
+    require_login(app);
+    return;
+  }
+  if (!page_cursor(app, "my-flags", args, &app->flag_cursor))
+    return;
+  app_printf(app, "Your flags:\n");
+  storage_cursor_next_flags(app->storage, &app->flag_cursor, print_flag_cb,
+                            app);
+  if (!app->flag_cursor.done)
+    app_printf(app, "More: my-flags next\n");
+}
+
+static void cmd_my_listings_page(AppContext *app, const char *args) {
+  if (args[strspn(args, " \r")] == '\0') {
+    cmd_my_listings(app);
+    return;
+  }
+  if (!app->logged_in) {
+    require_login(app);
+    return;
+  }
+  if (!page_cursor(app, "my-listings", args, &app->listing_cursor))
+    return;
+  app_printf(app, "Your listings:\n");
+  storage_cursor_next_listings(app->storage, &app->listing_cursor,
+                               print_listing_cb, app);
+  if (!app->listing_cursor.done)
+    app_printf(app, "More: my-listings next\n");
 }
 
 static void cmd_view_listing(AppContext *app, const char *args) {
-  Listing *listing = malloc(sizeof(Listing));
-  if (!listing)
-    oom();
+  Listing *listing = &scratch_of(app)->listing;
 
+  listing->id = 0;
   sscanf(args, "%llu", (unsigned long long *)&listing->id);
   if (storage_listing_get_by_id(app->storage, listing->id, listing) ==
       STORAGE_OK) {
-    printf("Listing id=%llu fid=%llu price=%llu sales=%llu note=%s\n",
-           (unsigned long long)listing->id, (unsigned long long)listing->fid,
-           (unsigned long long)listing->price,
-           (unsigned long long)listing->sale_count, listing->note);
+    app_printf(app, "Listing id=%llu fid=%llu price=%llu sales=%llu note=%s\n",
+               (unsigned long long)listing->id,
+               (unsigned long long)listing->fid,
+               (unsigned long long)listing->price,
+               (unsigned long long)listing->sale_count, listing->note);
   } else {
-    printf("[!] Listing not found\n");
+    app_fail(app, "[!] Listing not found\n");
   }
+}
 
-  free(listing);
+static uint64_t platform_fee(uint64_t price) {
+  uint64_t fee = price * 0.05;
+  return fee ? fee : 10;
 }
 
 static void cmd_buy(AppContext *app, const char *args) {
-  uint64_t platform_fee;
 
   if (!app->logged_in) {
     require_login(app);
     return;
   }
 
-  Listing *listing = malloc(sizeof(Listing));
-  Flag *flag = malloc(sizeof(Flag));
-  User *seller = malloc(sizeof(User));
-
-  if (!listing || !flag || !seller)
-    oom();
+  Listing *listing = &scratch_of(app)->listing;
+  Flag *flag = &app->scratch->flag;
 
+  listing->id = 0;
   sscanf(args, "%llu", (unsigned long long *)&listing->id);
 
   if (storage_listing_get_by_id(app->storage, listing->id, listing) !=
       STORAGE_OK) {
-    printf("[!] Listing not found\n");
-    goto cleanup;
-  }
-
-  if (storage_flag_get_by_id(app->storage, listing->fid, flag) != STORAGE_OK) {
-    printf("[!] Original flag not found\n");
-    goto cleanup;
-  }
-
-  if (storage_user_get_by_id(app->storage, app->current_user->uid,
-                             app->current_user) != STORAGE_OK) {
-    printf("[!] User not found\n");
-    goto cleanup;
-  }
-
-  if (storage_user_get_by_id(app->storage, flag->uid, seller) != STORAGE_OK) {
-    printf("[!] Corrupted listing\n");
-    goto cleanup;
-  }
-
-  if (app->current_user->balance < listing->price) {
-    printf("[!] Insufficient funds\n");
-    goto cleanup;
-  }
-
-  platform_fee = listing->price * 0.05;
-  platform_fee = platform_fee ? platform_fee : 10;
-  app->current_user->balance -= listing->price;
-  seller->balance += listing->price - platform_fee;
-
-  if (storage_user_update(app->storage, app->current_user) != STORAGE_OK) {
-    printf("[!] Failed to update balance\n");
-    goto cleanup;
-  }
-
-  if (storage_user_update(app->storage, seller) != STORAGE_OK) {
-    printf("[!] Failed to update balance for seller\n");
-    goto cleanup;
-  }
-
-  flag->uid = app->current_user->uid;
-  if (storage_flag_insert(app->storage, flag, flag) != STORAGE_OK) {
-    printf("[!] Failed to deliver flag\n");
-    goto cleanup;
+    app_fail(app, "[!] Listing not found\n");
+    return;
   }
 
-  listing->sale_count += 1;
-  if (storage_listing_update(app->storage, listing) != STORAGE_OK) {
-    printf("[!] Failed to update listing\n");
-    goto cleanup;
+  switch (storage_purchase_listing(app->storage, listing->id,
+                                   app->current_user->uid, listing->price,
+                                   platform_fee(listing->price), flag)) {
+  case STORAGE_OK:
+    break;
+  case STORAGE_NOT_FOUND:
+    app_fail(app, "[!] Listing not found\n");
+    return;
+  case STORAGE_INSUFFICIENT_FUNDS:
+    app_fail(app, "[!] Insufficient funds\n");
+    return;
+  default:
+    app_fail(app, "[!] Purchase failed\n");
+    return;
   }
 
-  printf("Purchased listing. New flag id=%lu secret=%s\n", flag->id,
-         flag->secret);
+  (void)storage_user_get_by_id(app->storage, app->current_user->uid,
+                               app->current_user);
 
-cleanup:
-  free(listing);
-  free(flag);
-  free(seller);
+  app_printf(app, "Purchased listing. New flag id=%lu secret=%s\n", flag->id,
+             flag->secret);
 }
 
 static void cmd_delete_user(AppContext *app) {
@@ -361,39 +585,38 @@ static void cmd_delete_user(AppContext *app) {
   storage_iter_listings_for_user(app->storage, app->current_user->uid, cb_list,
                                  NULL);
   if (has_flags || has_listings) {
-    printf("[!] Cannot delete user with existing flags or listings\n");
+    app_fail(app, "[!] Cannot delete user with existing flags or listings\n");
     return;
   }
   StorageResult r =
       storage_user_delete_by_id(app->storage, app->current_user->uid);
   if (r == STORAGE_OK) {
-    printf("Deleted user %llu\n", (unsigned long long)app->current_user->uid);
+    app_printf(app, "Deleted user %llu\n",
+               (unsigned long long)app->current_user->uid);
     app->logged_in = false;
     free(app->current_user);
     app->current_user = NULL;
   } else if (r == STORAGE_NOT_FOUND) {
-    printf("[!] User not found\n");
+    app_fail(app, "[!] User not found\n");
   } else {
-    printf("[!] Delete failed\n");
+    app_fail(app, "[!] Delete failed\n");
   }
 }
 
 static void cmd_delete_flag(AppContext *app, const char *args) {
-  Flag *flag = malloc(sizeof(Flag));
-  if (!flag)
-    oom();
-
   if (!app->logged_in) {
     require_login(app);
     return;
   }
 
+  Flag *flag = &scratch_of(app)->flag;
+  flag->id = 0;
   sscanf(args, "%llu", (unsigned long long *)&flag->id);
 
   if (storage_flag_get_by_id(app->storage, flag->id, flag) != STORAGE_OK ||
       flag->uid != app->current_user->uid) {
-    printf("[!] Flag not owned by you\n");
-    goto cleanup;
+    app_fail(app, "[!] Flag not owned by you\n");
+    return;
   }
 
   bool used = false;
@@ -408,20 +631,17 @@ static void cmd_delete_flag(AppContext *app, const char *args) {
   storage_iter_listings_for_user(app->storage, app->current_user->uid, cb,
                                  NULL);
   if (used) {
-    printf("[!] Cannot delete flag used by a listing\n");
-    goto cleanup;
+    app_fail(app, "[!] Cannot delete flag used by a listing\n");
+    return;
   }
   StorageResult r = storage_flag_delete_by_id(app->storage, flag->id);
   if (r == STORAGE_OK) {
-    printf("Deleted flag %llu\n", (unsigned long long)flag->id);
+    app_printf(app, "Deleted flag %llu\n", (unsigned long long)flag->id);
   } else if (r == STORAGE_NOT_FOUND) {
-    printf("[!] Flag not found\n");
+    app_fail(app, "[!] Flag not found\n");
   } else {
-    printf("[!] Delete failed\n");
+    app_fail(app, "[!] Delete failed\n");
   }
-cleanup:
-  free(flag);
-  return;
 }
 
 static void cmd_delete_listing(AppContext *app, const char *args) {
@@ -433,128 +653,1550 @@ static void cmd_delete_listing(AppContext *app, const char *args) {
   sscanf(args, "%llu", (unsigned long long *)&id);
   Listing l;
   if (storage_listing_get_by_id(app->storage, id, &l) != STORAGE_OK) {
-    printf("[!] Listing not found\n");
+    app_fail(app, "[!] Listing not found\n");
     return;
   }
   Flag f;
   if (storage_flag_get_by_id(app->storage, l.fid, &f) != STORAGE_OK ||
       f.uid != app->current_user->uid) {
-    printf("[!] Listing not owned by you\n");
+    app_fail(app, "[!] Listing not owned by you\n");
     return;
   }
   StorageResult r = storage_listing_delete_by_id(app->storage, id);
   if (r == STORAGE_OK) {
-    printf("Deleted listing %llu\n", (unsigned long long)id);
+    app_printf(app, "Deleted listing %llu\n", (unsigned long long)id);
   } else if (r == STORAGE_NOT_FOUND) {
-    printf("[!] Listing not found\n");
+    app_fail(app, "[!] Listing not found\n");
   } else {
-    printf("[!] Delete failed\n");
+    app_fail(app, "[!] Delete failed\n");
   }
 }
 
 static void cmd_logout(AppContext *app) {
   if (!app->logged_in) {
-    printf("[!] Login first\n");
+    app_fail(app, "[!] Login first\n");
     return;
   }
 
   app->logged_in = false;
   free(app->current_user);
   app->current_user = NULL;
-  printf("Logged out\n");
+  app_printf(app, "Logged out\n");
 }
 
-int main(int argc, char **argv) {
-  setbuf(stdin, NULL);
-  setbuf(stdout, NULL);
+// Switches the session to pipelined replies: clients may send many commands
+// at once and split the replies on blank lines instead of waiting for each
+// prompt.
+static void cmd_pipeline(AppContext *app) {
+  app->pipelined = true;
+  app_printf(app, "Pipeline mode on\n");
+}
 
-  const char *db_path = argc > 1 ? argv[1] : "academy_bank.db";
-  AppContext app = {0};
-  if (storage_open(db_path, &app.storage) != STORAGE_OK) {
-    fprintf(stderr, "Failed to open storage at %s\n", db_path);
-    return 1;
+static double us(uint64_t ns) { return (double)ns / 1e3; }
+
+#ifdef ACADEMY_BANK_COUNT_ALLOCS
+static void print_command_allocs(AppContext *app);
+#endif
+
+// Operator view of this process's metrics: storage counters, then one line
+// per storage call, command and binary frame that has run at least once.
+static void cmd_admin_stats(AppContext *app) {
+  StorageStats st;
+  storage_get_stats(app->storage, &st);
+  app_printf(app, "backend=%s cache_hits=%llu cache_misses=%llu "
+                  "busy_retries=%llu reader_reads=%llu\n",
+             storage_backend_name(app->storage),
+             (unsigned long long)st.cache_hits,
+             (unsigned long long)st.cache_misses,
+             (unsigned long long)st.busy_retries,
+             (unsigned long long)st.reader_reads);
+  app_printf(app, "%-8s %-24s %9s %7s %9s %9s %9s %9s\n", "kind", "op",
+             "count", "errors", "p50_us", "p99_us", "p999_us", "max_us");
+  for (size_t i = 0; i < metrics_count(); i++) {
+    const OpMetric *m = metrics_at(i);
+    if (!m->count)
+      continue;
+    app_printf(app, "%-8s %-24s %9llu %7llu %9.1f %9.1f %9.1f %9.1f\n",
+               m->kind, m->name, (unsigned long long)m->count,
+               (unsigned long long)m->errors,
+               us(metrics_percentile_ns(m, 0.5)),
+               us(metrics_percentile_ns(m, 0.99)),
+               us(metrics_percentile_ns(m, 0.999)), us(m->max_ns));
   }
+#ifdef ACADEMY_BANK_COUNT_ALLOCS
+  print_command_allocs(app);
+#endif
+}
 
-  print_banner();
-  print_help();
+// The same numbers in the Prometheus text format, served on the admin
+// socket. Latencies are summaries with precomputed quantiles.
+static void print_prometheus(AppContext *app) {
+  static const double QUANTILES[] = {0.5, 0.99, 0.999};
+  app_puts(app, "# HELP academy_bank_op_latency_seconds Latency of storage "
+                "calls, commands and binary frames.\n"
+                "# TYPE academy_bank_op_latency_seconds summary\n");
+  for (size_t i = 0; i < metrics_count(); i++) {
+    const OpMetric *m = metrics_at(i);
+    if (!m->count)
+      continue;
+    for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++)
+      app_printf(app,
+                 "academy_bank_op_latency_seconds{kind=\"%s\",op=\"%s\","
+                 "quantile=\"%g\"} %.9f\n",
+                 m->kind, m->name, QUANTILES[q],
+                 (double)metrics_percentile_ns(m, QUANTILES[q]) / 1e9);
+    app_printf(app,
+               "academy_bank_op_latency_seconds_sum{kind=\"%s\",op=\"%s\"} "
+               "%.9f\n"
+               "academy_bank_op_latency_seconds_count{kind=\"%s\","
+               "op=\"%s\"} %llu\n",
+               m->kind, m->name, (double)m->sum_ns / 1e9, m->kind, m->name,
+               (unsigned long long)m->count);
+  }
+  app_puts(app, "# HELP academy_bank_op_errors_total Calls that failed.\n"
+                "# TYPE academy_bank_op_errors_total counter\n");
+  for (size_t i = 0; i < metrics_count(); i++) {
+    const OpMetric *m = metrics_at(i);
+    if (m->count)
+      app_printf(app,
+                 "academy_bank_op_errors_total{kind=\"%s\",op=\"%s\"} "
+                 "%llu\n",
+                 m->kind, m->name, (unsigned long long)m->errors);
+  }
+  StorageStats st;
+  storage_get_stats(app->storage, &st);
+  app_printf(app,
+             "# TYPE academy_bank_cache_hits_total counter\n"
+             "academy_bank_cache_hits_total %llu\n"
+             "# TYPE academy_bank_cache_misses_total counter\n"
+             "academy_bank_cache_misses_total %llu\n"
+             "# TYPE academy_bank_busy_retries_total counter\n"
+             "academy_bank_busy_retries_total %llu\n"
+             "# TYPE academy_bank_reader_reads_total counter\n"
+             "academy_bank_reader_reads_total %llu\n",
+             (unsigned long long)st.cache_hits,
+             (unsigned long long)st.cache_misses,
+             (unsigned long long)st.busy_retries,
+             (unsigned long long)st.reader_reads);
+}
 
-  char line[1024];
-  while (1) {
-    printf("\n> ");
-    fflush(stdout);
-    if (!fgets(line, sizeof(line), stdin))
+// Command table. Commands with run_args take the rest of the line after a
+// single space; commands with run take none. An entry with neither ends the
+// session. admin-stats is left out of HELP_TEXT on purpose.
+typedef struct {
+  const char *name;
+  void (*run)(AppContext *app);
+  void (*run_args)(AppContext *app, const char *args);
+} Command;
+
+static const Command COMMANDS[] = {
+    {"help", print_help, NULL},
+    {"exit", NULL, NULL},
+    {"register", NULL, cmd_register},
+    {"login", NULL, cmd_login},
+    {"whoami", cmd_whoami, NULL},
+    {"balance", cmd_balance, NULL},
+    {"deposit-flag", NULL, cmd_deposit_flag},
+    {"my-flags", cmd_my_flags, cmd_my_flags_page},
+    {"list-flag", NULL, cmd_list_flag},
+    {"my-listings", cmd_my_listings, cmd_my_listings_page},
+    {"view-listing", NULL, cmd_view_listing},
+    {"buy", NULL, cmd_buy},
+    {"delete-user", cmd_delete_user, NULL},
+    {"delete-flag", NULL, cmd_delete_flag},
+    {"delete-listing", NULL, cmd_delete_listing},
+    {"logout", cmd_logout, NULL},
+    {"pipeline", cmd_pipeline, NULL},
+    {"admin-stats", cmd_admin_stats, NULL},
+};
+
+#define N_COMMANDS (sizeof(COMMANDS) / sizeof(COMMANDS[0]))
+#define COMMAND_SLOTS 64
+
+// Open-addressed index from FNV-1a of the command name to COMMANDS index + 1,
+// filled once by command_index_init. Dispatch hashes the first token of a
+// line and compares a single candidate in the common case.
+static uint8_t command_slots[COMMAND_SLOTS];
+static OpMetric *command_metrics[N_COMMANDS];
+#ifdef ACADEMY_BANK_COUNT_ALLOCS
+static uint64_t command_allocs[N_COMMANDS];
+static uint64_t allocs_at_start;
+#endif
+
+static uint32_t command_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void command_index_init(void) {
+  for (size_t i = 0; i < N_COMMANDS; i++) {
+    const char *name = COMMANDS[i].name;
+    uint32_t slot = command_hash(name, strlen(name)) % COMMAND_SLOTS;
+    while (command_slots[slot])
+      slot = (slot + 1) % COMMAND_SLOTS;
+    command_slots[slot] = (uint8_t)(i + 1);
+    command_metrics[i] = metrics_op("command", name);
+  }
+}
+
+static const Command *command_lookup(const char *token, size_t len) {
+  uint32_t slot = command_hash(token, len) % COMMAND_SLOTS;
+  while (command_slots[slot]) {
+    const Command *cmd = &COMMANDS[command_slots[slot] - 1];
+    if (strncmp(cmd->name, token, len) == 0 && cmd->name[len] == '\0')
+      return cmd;
+    slot = (slot + 1) % COMMAND_SLOTS;
+  }
+  return NULL;
+}
+
+// Records a command or frame whose reply starts at out_at. Text commands
+// fail when a handler replied through app_fail, frames with any status but
+// OK. One parked on a password job is recorded when it resumes.
+static void op_done(AppContext *app, OpMetric *m, uint64_t start,
+                    size_t out_at) {
+  if (app->job) {
+    app->job_metric = m;
+    app->job_start = start;
+    app->job_out_at = out_at;
+    return;
+  }
+  bool failed;
+  if (app->binary) {
+    BankFrameHeader hdr;
+    memcpy(&hdr, app->out.data + out_at, sizeof(hdr));
+    failed = hdr.status != BANK_STATUS_OK;
+  } else {
+    failed = app->failed;
+  }
+  app->failed = false;
+  metrics_record(m, start, failed);
+}
+
+static void command_done(AppContext *app, const Command *cmd, uint64_t start,
+                         size_t out_at) {
+  op_done(app, command_metrics[cmd - COMMANDS], start, out_at);
+#ifdef ACADEMY_BANK_COUNT_ALLOCS
+  command_allocs[cmd - COMMANDS] += alloc_count() - allocs_at_start;
+#endif
+}
+
+// Finishes the command parked on app->job now that the job has run.
+static void app_resume(AppContext *app) {
+  PasswordJob *job = app->job;
+  app->job = NULL;
+  app->job_done(app, job);
+  op_done(app, app->job_metric, app->job_start, app->job_out_at);
+  if (!app->binary)
+    app_puts(app, app->pipelined ? "\n" : PROMPT_TEXT);
+}
+
+#ifdef ACADEMY_BANK_COUNT_ALLOCS
+static void print_command_allocs(AppContext *app) {
+  app_printf(app, "heap allocations=%llu\n%-24s %9s %9s\n",
+             (unsigned long long)alloc_count(), "command", "count", "allocs");
+  for (size_t i = 0; i < N_COMMANDS; i++) {
+    if (command_metrics[i]->count)
+      app_printf(app, "%-24s %9llu %9llu\n", COMMANDS[i].name,
+                 (unsigned long long)command_metrics[i]->count,
+                 (unsigned long long)command_allocs[i]);
+  }
+}
+#endif
+
+// Runs one input line. Returns false when the session should end.
+static bool dispatch_line(AppContext *app, char *line) {
+  size_t len = strlen(line);
+  if (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    line[len - 1] = '\0';
+
+  size_t tok_len = strcspn(line, " \r");
+  const Command *cmd = tok_len ? command_lookup(line, tok_len) : NULL;
+  uint64_t start = metrics_now_ns();
+  size_t out_at = app->out.len;
+#ifdef ACADEMY_BANK_COUNT_ALLOCS
+  allocs_at_start = alloc_count();
+#endif
+  if (cmd && cmd->run_args && line[tok_len] == ' ') {
+    cmd->run_args(app, line + tok_len + 1);
+    command_done(app, cmd, start, out_at);
+    return true;
+  }
+  if (cmd && cmd->run) {
+    cmd->run(app);
+    command_done(app, cmd, start, out_at);
+    return true;
+  }
+  if (cmd && !cmd->run_args)
+    return false;
+
+  app_printf(app, "Unknown command. Type 'help' for list of commands.\n");
+  return true;
+}
+
+static void app_release(AppContext *app) {
+  free(app->current_user);
+  app->current_user = NULL;
+  app->logged_in = false;
+  free(app->scratch);
+  app->scratch = NULL;
+  free(app->out.data);
+  app->out = (OutBuf){0};
+}
+
+// Binary protocol (see protocol.h). Each handler gets the request payload
+// and appends exactly one response frame. The rules match the text
+// commands; only the encoding differs.
+static size_t bin_begin(AppContext *app, uint8_t op, uint8_t status) {
+  BankFrameHeader hdr = {.op = op, .status = status};
+  size_t at = app->out.len;
+  app_write(app, (const char *)&hdr, sizeof(hdr));
+  return at;
+}
+
+static void bin_end(AppContext *app, size_t at) {
+  BankFrameHeader *hdr = (BankFrameHeader *)(app->out.data + at);
+  hdr->len = (uint32_t)(app->out.len - at - sizeof(*hdr));
+}
+
+static void bin_reply(AppContext *app, uint8_t op, uint8_t status,
+                      const void *payload, size_t len) {
+  size_t at = bin_begin(app, op, status);
+  if (payload)
+    app_write(app, payload, len);
+  bin_end(app, at);
+}
+
+static void bin_reply_user(AppContext *app, uint8_t op, const User *user) {
+  User u = *user;
+  memset(u.password, 0, sizeof(u.password));
+  bin_reply(app, op, BANK_STATUS_OK, &u, sizeof(u));
+}
+
+static uint8_t bin_status(StorageResult r) {
+  switch (r) {
+  case STORAGE_OK:
+    return BANK_STATUS_OK;
+  case STORAGE_NOT_FOUND:
+    return BANK_STATUS_NOT_FOUND;
+  case STORAGE_CONFLICT:
+    return BANK_STATUS_CONFLICT;
+  case STORAGE_INVALID:
+    return BANK_STATUS_INVALID;
+  case STORAGE_INSUFFICIENT_FUNDS:
+    return BANK_STATUS_INSUFFICIENT_FUNDS;
+  default:
+    return BANK_STATUS_ERROR;
+  }
+}
+
+// Fixed-size request strings are not trusted to be terminated.
+#define BIN_TERMINATE(field) ((field)[sizeof(field) - 1] = '\0')
+
+static int bin_append_flag_cb(const Flag *flag, void *ctx) {
+  app_write(ctx, (const char *)flag, sizeof(*flag));
+  return 0;
+}
+
+static int bin_append_listing_cb(const Listing *l, void *ctx) {
+  app_write(ctx, (const char *)l, sizeof(*l));
+  return 0;
+}
+
+static int bin_any_flag_cb(const Flag *flag, void *ctx) {
+  (void)flag;
+  *(bool *)ctx = true;
+  return 1;
+}
+
+static int bin_any_listing_cb(const Listing *l, void *ctx) {
+  (void)l;
+  *(bool *)ctx = true;
+  return 1;
+}
+
+typedef struct {
+  uint64_t fid;
+  bool used;
+} FlagUse;
+
+static int bin_flag_used_cb(const Listing *l, void *ctx) {
+  FlagUse *use = ctx;
+  if (l->fid != use->fid)
+    return 0;
+  use->used = true;
+  return 1;
+}
+
+static void bin_register_hashed(AppContext *app, PasswordJob *job) {
+  User *u = &app->scratch->user;
+  if (!job->ok) {
+    bin_reply(app, BANK_OP_REGISTER, BANK_STATUS_ERROR, NULL, 0);
+    return;
+  }
+  memcpy(u->password, job->hash, sizeof(u->password));
+  StorageResult r = storage_user_insert(app->storage, u, u);
+  if (r != STORAGE_OK) {
+    bin_reply(app, BANK_OP_REGISTER, bin_status(r), NULL, 0);
+    return;
+  }
+  bin_reply_user(app, BANK_OP_REGISTER, u);
+}
+
+static void bin_register(AppContext *app, uint8_t op, BankCredentials *req) {
+  BIN_TERMINATE(req->name);
+  BIN_TERMINATE(req->password);
+  if (!req->name[0] || !req->password[0]) {
+    bin_reply(app, op, BANK_STATUS_INVALID, NULL, 0);
+    return;
+  }
+  User *u = &scratch_of(app)->user;
+  *u = (User){0};
+  memcpy(u->name, req->name, sizeof(u->name));
+  u->balance = 100;
+  User existing;
+  if (storage_user_get_by_name(app->storage, u->name, &existing) ==
+      STORAGE_OK) {
+    bin_reply(app, op, BANK_STATUS_CONFLICT, NULL, 0);
+    return;
+  }
+  PasswordJob *job = &app->scratch->job;
+  job->op = PASSWORD_HASH;
+  memcpy(job->password, req->password, sizeof(req->password));
+  run_password_job(app, bin_register_hashed);
+}
+
+static void bin_login_checked(AppContext *app, PasswordJob *job) {
+  if (!job->ok) {
+    bin_reply(app, BANK_OP_LOGIN, BANK_STATUS_FORBIDDEN, NULL, 0);
+    return;
+  }
+  login_as(app, job);
+  bin_reply_user(app, BANK_OP_LOGIN, app->current_user);
+}
+
+static void bin_login(AppContext *app, uint8_t op, BankCredentials *req) {
+  BIN_TERMINATE(req->name);
+  BIN_TERMINATE(req->password);
+  if (app->current_user) {
+    bin_reply(app, op, BANK_STATUS_CONFLICT, NULL, 0);
+    return;
+  }
+  User *user = &scratch_of(app)->user;
+  StorageResult r = storage_user_get_by_name(app->storage, req->name, user);
+  if (r != STORAGE_OK) {
+    bin_reply(app, op, bin_status(r), NULL, 0);
+    return;
+  }
+  verify_password(app, req->password, bin_login_checked);
+}
+
+static void bin_buy(AppContext *app, uint8_t op, uint64_t id) {
+  Listing listing;
+  Flag flag;
+  StorageResult r = storage_listing_get_by_id(app->storage, id, &listing);
+  if (r == STORAGE_OK)
+    r = storage_purchase_listing(app->storage, id, app->current_user->uid,
+                                 listing.price, platform_fee(listing.price),
+                                 &flag);
+  if (r != STORAGE_OK) {
+    bin_reply(app, op, bin_status(r), NULL, 0);
+    return;
+  }
+  (void)storage_user_get_by_id(app->storage, app->current_user->uid,
+                               app->current_user);
+  bin_reply(app, op, BANK_STATUS_OK, &flag, sizeof(flag));
+}
+
+static void bin_delete_user(AppContext *app, uint8_t op) {
+  bool busy = false;
+  storage_iter_flags_for_user(app->storage, app->current_user->uid,
+                              bin_any_flag_cb, &busy);
+  if (!busy)
+    storage_iter_listings_for_user(app->storage, app->current_user->uid,
+                                   bin_any_listing_cb, &busy);
+  if (busy) {
+    bin_reply(app, op, BANK_STATUS_CONFLICT, NULL, 0);
+    return;
+  }
+  StorageResult r =
+      storage_user_delete_by_id(app->storage, app->current_user->uid);
+  if (r == STORAGE_OK) {
+    app->logged_in = false;
+    free(app->current_user);
+    app->current_user = NULL;
+  }
+  bin_reply(app, op, bin_status(r), NULL, 0);
+}
+
+static void bin_delete_flag(AppContext *app, uint8_t op, uint64_t id) {
+  Flag flag;
+  if (storage_flag_get_by_id(app->storage, id, &flag) != STORAGE_OK ||
+      flag.uid != app->current_user->uid) {
+    bin_reply(app, op, BANK_STATUS_FORBIDDEN, NULL, 0);
+    return;
+  }
+  FlagUse use = {.fid = id};
+  storage_iter_listings_for_user(app->storage, app->current_user->uid,
+                                 bin_flag_used_cb, &use);
+  if (use.used) {
+    bin_reply(app, op, BANK_STATUS_CONFLICT, NULL, 0);
+    return;
+  }
+  bin_reply(app, op, bin_status(storage_flag_delete_by_id(app->storage, id)),
+            NULL, 0);
+}
+
+static void bin_delete_listing(AppContext *app, uint8_t op, uint64_t id) {
+  Listing l;
+  Flag f;
+  StorageResult r = storage_listing_get_by_id(app->storage, id, &l);
+  if (r != STORAGE_OK) {
+    bin_reply(app, op, bin_status(r), NULL, 0);
+    return;
+  }
+  if (storage_flag_get_by_id(app->storage, l.fid, &f) != STORAGE_OK ||
+      f.uid != app->current_user->uid) {
+    bin_reply(app, op, BANK_STATUS_FORBIDDEN, NULL, 0);
+    return;
+  }
+  bin_reply(app, op,
+            bin_status(storage_listing_delete_by_id(app->storage, id)), NULL,
+            0);
+}
+
+static void bin_list_flag(AppContext *app, uint8_t op, BankListRequest *req) {
+  BIN_TERMINATE(req->note);
+  Flag flag;
+  if (storage_flag_get_by_id(app->storage, req->fid, &flag) != STORAGE_OK ||
+      flag.uid != app->current_user->uid) {
+    bin_reply(app, op, BANK_STATUS_FORBIDDEN, NULL, 0);
+    return;
+  }
+  Listing l = {0};
+  l.fid = req->fid;
+  l.price = req->price;
+  memcpy(l.note, req->note, sizeof(l.note));
+  StorageResult r = storage_listing_insert(app->storage, &l, &l);
+  if (r != STORAGE_OK) {
+    bin_reply(app, op, bin_status(r), NULL, 0);
+    return;
+  }
+  bin_reply(app, op, BANK_STATUS_OK, &l, sizeof(l));
+}
+
+// Expected request payload size per op; -1 for unknown ops.
+static long bin_request_size(uint8_t op) {
+  switch (op) {
+  case BANK_OP_REGISTER:
+  case BANK_OP_LOGIN:
+    return sizeof(BankCredentials);
+  case BANK_OP_DEPOSIT_FLAG:
+    return sizeof(BankDepositRequest);
+  case BANK_OP_LIST_FLAG:
+    return sizeof(BankListRequest);
+  case BANK_OP_VIEW_LISTING:
+  case BANK_OP_BUY:
+  case BANK_OP_DELETE_FLAG:
+  case BANK_OP_DELETE_LISTING:
+    return sizeof(BankIdRequest);
+  case BANK_OP_LOGOUT:
+  case BANK_OP_WHOAMI:
+  case BANK_OP_BALANCE:
+  case BANK_OP_MY_FLAGS:
+  case BANK_OP_MY_LISTINGS:
+  case BANK_OP_DELETE_USER:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+static bool bin_is_page_request(uint8_t op, uint32_t len) {
+  return (op == BANK_OP_MY_FLAGS || op == BANK_OP_MY_LISTINGS) &&
+         len == sizeof(BankPageRequest);
+}
+
+static void handle_frame(AppContext *app, uint8_t op, void *payload,
+                         uint32_t len) {
+  if (bin_request_size(op) != (long)len && !bin_is_page_request(op, len)) {
+    bin_reply(app, op, BANK_STATUS_INVALID, NULL, 0);
+    return;
+  }
+  if (op == BANK_OP_REGISTER) {
+    bin_register(app, op, payload);
+    return;
+  }
+  if (op == BANK_OP_LOGIN) {
+    bin_login(app, op, payload);
+    return;
+  }
+  if (op == BANK_OP_VIEW_LISTING) {
+    Listing l;
+    StorageResult r = storage_listing_get_by_id(
+        app->storage, ((BankIdRequest *)payload)->id, &l);
+    bin_reply(app, op, bin_status(r), r == STORAGE_OK ? &l : NULL,
+              r == STORAGE_OK ? sizeof(l) : 0);
+    return;
+  }
+  if (!app->logged_in) {
+    bin_reply(app, op, BANK_STATUS_NOT_LOGGED_IN, NULL, 0);
+    return;
+  }
+
+  uint64_t id = len == sizeof(BankIdRequest) ? ((BankIdRequest *)payload)->id
+                                             : 0;
+  BankPageRequest page = {0};
+  if (bin_is_page_request(op, len))
+    page = *(BankPageRequest *)payload;
+  size_t at;
+  switch (op) {
+  case BANK_OP_LOGOUT:
+    app->logged_in = false;
+    free(app->current_user);
+    app->current_user = NULL;
+    bin_reply(app, op, BANK_STATUS_OK, NULL, 0);
+    break;
+  case BANK_OP_WHOAMI:
+    bin_reply_user(app, op, app->current_user);
+    break;
+  case BANK_OP_BALANCE:
+    if (storage_user_get_by_id(app->storage, app->current_user->uid,
+                               app->current_user) != STORAGE_OK) {
+      bin_reply(app, op, BANK_STATUS_NOT_FOUND, NULL, 0);
       break;
-    size_t len = strlen(line);
-    if (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
-      line[len - 1] = '\0';
+    }
+    bin_reply_user(app, op, app->current_user);
+    break;
+  case BANK_OP_DEPOSIT_FLAG: {
+    BankDepositRequest *req = payload;
+    BIN_TERMINATE(req->secret);
+    Flag f = {0};
+    f.uid = app->current_user->uid;
+    memcpy(f.secret, req->secret, sizeof(f.secret));
+    StorageResult r = f.secret[0] ? storage_flag_insert(app->storage, &f, &f)
+                                  : STORAGE_INVALID;
+    bin_reply(app, op, bin_status(r), r == STORAGE_OK ? &f : NULL,
+              r == STORAGE_OK ? sizeof(f) : 0);
+    break;
+  }
+  case BANK_OP_MY_FLAGS:
+    at = bin_begin(app, op, BANK_STATUS_OK);
+    storage_page_flags_for_user(app->storage, app->current_user->uid,
+                                page.after_id, page.limit,
+                                bin_append_flag_cb, app);
+    bin_end(app, at);
+    break;
+  case BANK_OP_LIST_FLAG:
+    bin_list_flag(app, op, payload);
+    break;
+  case BANK_OP_MY_LISTINGS:
+    at = bin_begin(app, op, BANK_STATUS_OK);
+    storage_page_listings_for_user(app->storage, app->current_user->uid,
+                                   page.after_id, page.limit,
+                                   bin_append_listing_cb, app);
+    bin_end(app, at);
+    break;
+  case BANK_OP_BUY:
+    bin_buy(app, op, id);
+    break;
+  case BANK_OP_DELETE_USER:
+    bin_delete_user(app, op);
+    break;
+  case BANK_OP_DELETE_FLAG:
+    bin_delete_flag(app, op, id);
+    break;
+  case BANK_OP_DELETE_LISTING:
+    bin_delete_listing(app, op, id);
+    break;
+  }
+}
 
-    if (strncmp(line, "help", 4) == 0) {
-      print_help();
-      continue;
+static const char *const FRAME_NAMES[] = {
+    [BANK_OP_REGISTER] = "register",
+    [BANK_OP_LOGIN] = "login",
+    [BANK_OP_LOGOUT] = "logout",
+    [BANK_OP_WHOAMI] = "whoami",
+    [BANK_OP_BALANCE] = "balance",
+    [BANK_OP_DEPOSIT_FLAG] = "deposit_flag",
+    [BANK_OP_MY_FLAGS] = "my_flags",
+    [BANK_OP_LIST_FLAG] = "list_flag",
+    [BANK_OP_MY_LISTINGS] = "my_listings",
+    [BANK_OP_VIEW_LISTING] = "view_listing",
+    [BANK_OP_BUY] = "buy",
+    [BANK_OP_DELETE_USER] = "delete_user",
+    [BANK_OP_DELETE_FLAG] = "delete_flag",
+    [BANK_OP_DELETE_LISTING] = "delete_listing",
+};
+
+#define N_FRAME_NAMES (sizeof(FRAME_NAMES) / sizeof(FRAME_NAMES[0]))
+
+// Times one frame into a "frame" metric for its op.
+static void dispatch_frame(AppContext *app, uint8_t op, void *payload,
+                           uint32_t len) {
+  static OpMetric *metrics[N_FRAME_NAMES];
+  size_t slot = op < N_FRAME_NAMES && FRAME_NAMES[op] ? op : 0;
+  if (!metrics[slot])
+    metrics[slot] =
+        metrics_op("frame", slot ? FRAME_NAMES[slot] : "unknown");
+  uint64_t start = metrics_now_ns();
+  size_t at = app->out.len;
+  handle_frame(app, op, payload, len);
+  op_done(app, metrics[slot], start, at);
+}
+
+// Input read from the client. It holds up to INPUT_SZ bytes so a whole
+// pipelined batch arrives in one read, but lines are still cut exactly like
+// the old fgets(line, LINE_SZ) loop: a line without a newline in its first
+// LINE_SZ - 1 bytes is split there.
+typedef struct {
+  char data[INPUT_SZ];
+  size_t len;
+} LineBuf;
+
+static size_t linebuf_space(const LineBuf *in) {
+  return sizeof(in->data) - 1 - in->len;
+}
+
+// Runs every complete line in the buffer, appending a prompt (or, in pipeline
+// mode, a blank line) after each reply. With at_eof a trailing partial line
+// is run too, as fgets returns it. Stops early while a command is parked on
+// a password job. Returns false once a command ends the session; later
+// input is discarded.
+static bool run_buffered_lines(AppContext *app, LineBuf *in, bool at_eof) {
+  while (in->len > 0 && !app->job) {
+    size_t scan = in->len < LINE_SZ - 1 ? in->len : LINE_SZ - 1;
+    char *nl = memchr(in->data, '\n', scan);
+    size_t take;
+    if (nl)
+      take = (size_t)(nl - in->data) + 1;
+    else if (in->len >= LINE_SZ - 1 || at_eof)
+      take = scan;
+    else
+      break;
+
+    char line[LINE_SZ];
+    memcpy(line, in->data, take);
+    line[take] = '\0';
+    memmove(in->data, in->data + take, in->len - take);
+    in->len -= take;
+
+    if (!dispatch_line(app, line)) {
+      in->len = 0;
+      return false;
     }
-    if (strncmp(line, "exit", 4) == 0) {
+    if (!app->job)
+      app_puts(app, app->pipelined ? "\n" : PROMPT_TEXT);
+  }
+  return true;
+}
+
+// Runs every complete frame in the buffer. Returns false on a malformed
+// frame, which ends the session.
+static bool run_buffered_frames(AppContext *app, LineBuf *in) {
+  size_t off = 0;
+  bool ok = true;
+  while (!app->job && in->len - off >= sizeof(BankFrameHeader)) {
+    BankFrameHeader hdr;
+    memcpy(&hdr, in->data + off, sizeof(hdr));
+    if (hdr.len > BANK_PROTO_MAX_PAYLOAD) {
+      ok = false;
       break;
     }
-    if (strncmp(line, "register ", 9) == 0) {
-      cmd_register(&app, line + 9);
-      continue;
+    if (in->len - off - sizeof(hdr) < hdr.len)
+      break;
+    // Copy out so handlers get an aligned, writable payload.
+    uint64_t payload[BANK_PROTO_MAX_PAYLOAD / sizeof(uint64_t)];
+    memcpy(payload, in->data + off + sizeof(hdr), hdr.len);
+    off += sizeof(hdr) + hdr.len;
+    dispatch_frame(app, hdr.op, payload, hdr.len);
+  }
+  memmove(in->data, in->data + off, in->len - off);
+  in->len -= off;
+  if (!ok)
+    in->len = 0;
+  return ok;
+}
+
+// Feeds buffered input to the session. The first byte decides the protocol:
+// BANK_PROTO_MAGIC selects binary frames, anything else the text REPL.
+static bool run_session_input(AppContext *app, LineBuf *in, bool at_eof) {
+  if (!app->negotiated && in->len > 0) {
+    app->negotiated = true;
+    if ((uint8_t)in->data[0] == BANK_PROTO_MAGIC) {
+      app->binary = true;
+      memmove(in->data, in->data + 1, --in->len);
     }
-    if (strncmp(line, "login ", 6) == 0) {
-      cmd_login(&app, line + 6);
+  }
+  return app->binary ? run_buffered_frames(app, in)
+                     : run_buffered_lines(app, in, at_eof);
+}
+
+// Writes out and empties it. Returns false if the peer went away.
+static bool write_all(int fd, OutBuf *out) {
+  size_t off = 0;
+  while (off < out->len) {
+    ssize_t n = write(fd, out->data + off, out->len - off);
+    if (n < 0 && errno == EINTR)
       continue;
-    }
-    if (strncmp(line, "whoami", 6) == 0) {
-      cmd_whoami(&app);
+    if (n <= 0)
+      return false;
+    off += (size_t)n;
+  }
+  out->len = 0;
+  return true;
+}
+
+static void print_greeting(AppContext *app) {
+  print_banner(app);
+  print_help(app);
+  app_puts(app, PROMPT_TEXT);
+}
+
+// Interactive mode on stdin/stdout, as run under ynetd. Input is read in
+// chunks and every complete line in a chunk is answered with a single write.
+static int run_repl(Storage *storage) {
+  AppContext app = {0};
+  app.storage = storage;
+  LineBuf in = {0};
+
+  print_greeting(&app);
+  bool open = true;
+  while (write_all(STDOUT_FILENO, &app.out) && open) {
+    ssize_t n = read(STDIN_FILENO, in.data + in.len, linebuf_space(&in));
+    if (n < 0 && errno == EINTR)
       continue;
+    if (n <= 0) {
+      run_session_input(&app, &in, true);
+      write_all(STDOUT_FILENO, &app.out);
+      break;
     }
-    if (strncmp(line, "balance", 7) == 0) {
-      cmd_balance(&app);
+    in.len += (size_t)n;
+    open = run_session_input(&app, &in, false);
+  }
+
+  app_release(&app);
+  return 0;
+}
+
+// Server mode: one process, one epoll loop and one shared Storage serving
+// every connection. Each connection carries its own AppContext plus input
+// and output buffers.
+//
+// Writes are group-committed: the first write opens a batch that every
+// session's writes join until ACADEMY_BANK_GROUP_COMMIT_MS have passed or
+// ACADEMY_BANK_GROUP_COMMIT_OPS writes are in it. Replies produced while a
+// batch is open may depend on its writes, so they are held back and only
+// sent once the batch has committed.
+//
+// Password hashes run on a pool of ACADEMY_BANK_HASH_THREADS threads. A
+// session waiting on one stops reading until the pool's eventfd hands the
+// job back.
+typedef struct Conn {
+  int fd;
+  AppContext app;
+  LineBuf in;
+  size_t out_off;
+  bool closing;
+  bool held; // reply waits for the open batch to commit
+  uint64_t batch_parts; // storage parts its replies read from the batch
+  time_t deadline;
+  struct Conn *prev;
+  struct Conn *next;
+} Conn;
+
+typedef struct {
+  int listen_fd;
+  int admin_fd;
+  int hash_fd;
+  int epoll_fd;
+  Storage *storage;
+  PasswordPool *hash_pool;
+  Conn *conns;
+  Conn *closed; // closed, not yet freed; linked through next
+  int session_timeout;
+  int group_commit_ms;
+  size_t group_commit_ops;
+  int64_t batch_deadline; // monotonic ms; 0 while no batch is open
+} Server;
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Closes the socket and moves the session to srv->closed. It is not freed
+// here: events for it may still be waiting in the batch epoll_wait returned,
+// and conn_close is reached from other sessions' events, such as a batch
+// commit flushing every held reply.
+static void conn_close(Server *srv, Conn *c) {
+  if (c->fd < 0)
+    return;
+  epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    srv->conns = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  c->prev = NULL;
+  c->next = srv->closed;
+  srv->closed = c;
+}
+
+// Frees the closed sessions once a round of events is done. A session whose
+// password job is still with a pool thread waits for server_password_done.
+static void server_free_closed(Server *srv) {
+  Conn **link = &srv->closed;
+  while (*link) {
+    Conn *c = *link;
+    if (c->app.job) {
+      link = &c->next;
       continue;
     }
-    if (strncmp(line, "deposit-flag ", 13) == 0) {
-      cmd_deposit_flag(&app, line + 13);
+    *link = c->next;
+    app_release(&c->app);
+    free(c);
+  }
+}
+
+static void conn_watch(Server *srv, Conn *c, uint32_t events) {
+  struct epoll_event ev = {.events = events, .data.ptr = c};
+  epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Writes as much pending output as the socket takes. Returns false if the
+// connection was closed.
+static bool conn_flush(Server *srv, Conn *c) {
+  OutBuf *out = &c->app.out;
+  while (c->out_off < out->len) {
+    ssize_t n = send(c->fd, out->data + c->out_off, out->len - c->out_off,
+                     MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
       continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      conn_watch(srv, c, EPOLLOUT);
+      return true;
     }
-    if (strncmp(line, "my-flags", 8) == 0) {
-      cmd_my_flags(&app);
-      continue;
+    if (n <= 0) {
+      conn_close(srv, c);
+      return false;
     }
-    if (strncmp(line, "list-flag ", 10) == 0) {
-      cmd_list_flag(&app, line + 10);
-      continue;
+    c->out_off += (size_t)n;
+  }
+  out->len = 0;
+  c->out_off = 0;
+  if (c->closing) {
+    conn_close(srv, c);
+    return false;
+  }
+  conn_watch(srv, c, EPOLLIN);
+  return true;
+}
+
+// Commits the open batch and sends the replies that waited on it. Sessions
+// whose replies depend on a part of the storage whose writes were lost
+// (with shards, only the failed ones) are dropped instead, whether held or
+// parked on a password job.
+static void server_commit(Server *srv) {
+  uint64_t lost = 0;
+  (void)storage_batch_commit_parts(srv->storage, &lost);
+  srv->batch_deadline = 0;
+  Conn *c = srv->conns;
+  while (c) {
+    Conn *n = c->next;
+    bool drop = (c->batch_parts & lost) != 0;
+    c->batch_parts = 0;
+    if (drop) {
+      c->held = false;
+      conn_close(srv, c);
+    } else if (c->held) {
+      c->held = false;
+      conn_flush(srv, c);
     }
-    if (strncmp(line, "my-listings", 11) == 0) {
-      cmd_my_listings(&app);
+    c = n;
+  }
+}
+
+// Sends what the session has produced, unless it is parked on a password
+// job or its reply has to wait for the open batch.
+static void conn_reply(Server *srv, Conn *c) {
+  c->batch_parts |= storage_batch_take_parts(srv->storage);
+  size_t pending = storage_batch_pending(srv->storage);
+  if (c->app.job) {
+    // Writes made before the job still need the batch closed on time.
+    conn_watch(srv, c, 0);
+    if (pending && !srv->batch_deadline)
+      srv->batch_deadline = now_ms() + srv->group_commit_ms;
+    return;
+  }
+  if (pending == 0) {
+    conn_flush(srv, c);
+    return;
+  }
+  // Park the session, input included, until its reply can go out.
+  c->held = true;
+  conn_watch(srv, c, 0);
+  if (!srv->batch_deadline)
+    srv->batch_deadline = now_ms() + srv->group_commit_ms;
+  if (pending >= srv->group_commit_ops)
+    server_commit(srv);
+}
+
+static void conn_readable(Server *srv, Conn *c) {
+  for (;;) {
+    ssize_t n = recv(c->fd, c->in.data + c->in.len, linebuf_space(&c->in), 0);
+    if (n < 0 && errno == EINTR)
       continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      conn_close(srv, c);
+      return;
     }
-    if (strncmp(line, "view-listing ", 13) == 0) {
-      cmd_view_listing(&app, line + 13);
+    c->in.len += (size_t)n;
+    if (!run_session_input(&c->app, &c->in, false))
+      c->closing = true;
+    if (c->closing || c->app.out.len > 0 || c->app.job)
+      break;
+  }
+  conn_reply(srv, c);
+}
+
+// Resumes the sessions whose password jobs are done, then runs whatever
+// input they had buffered behind them.
+static void server_password_done(Server *srv) {
+  PasswordJob *job;
+  while ((job = password_pool_take(srv->hash_pool))) {
+    Conn *c = (Conn *)((char *)job->owner - offsetof(Conn, app));
+    if (c->fd < 0) {
+      c->app.job = NULL;
       continue;
     }
-    if (strncmp(line, "buy ", 4) == 0) {
-      cmd_buy(&app, line + 4);
-      continue;
+    app_resume(&c->app);
+    if (!run_session_input(&c->app, &c->in, false))
+      c->closing = true;
+    conn_reply(srv, c);
+  }
+}
+
+static void server_accept(Server *srv) {
+  for (;;) {
+    int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
     }
-    if (strncmp(line, "delete-user", 11) == 0) {
-      cmd_delete_user(&app);
+    Conn *c = calloc(1, sizeof(Conn));
+    if (!c) {
+      close(fd);
       continue;
     }
-    if (strncmp(line, "delete-flag ", 12) == 0) {
-      cmd_delete_flag(&app, line + 12);
+    c->fd = fd;
+    c->app.storage = srv->storage;
+    c->app.hash_pool = srv->hash_pool;
+    c->deadline = time(NULL) + srv->session_timeout;
+    c->next = srv->conns;
+    if (srv->conns)
+      srv->conns->prev = c;
+    srv->conns = c;
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      conn_close(srv, c);
       continue;
     }
-    if (strncmp(line, "delete-listing ", 15) == 0) {
-      cmd_delete_listing(&app, line + 15);
-      continue;
+    print_greeting(&c->app);
+    conn_flush(srv, c);
+  }
+}
+
+// Drops sessions past their deadline and returns the epoll timeout until the
+// next one expires, mirroring the per-process "timeout 60" under ynetd.
+static int server_reap_expired(Server *srv) {
+  time_t now = time(NULL);
+  time_t next = 0;
+  Conn *c = srv->conns;
+  while (c) {
+    Conn *n = c->next;
+    if (c->deadline <= now)
+      conn_close(srv, c);
+    else if (!next || c->deadline < next)
+      next = c->deadline;
+    c = n;
+  }
+  return next ? (int)(next - now) * 1000 : -1;
+}
+
+// Both server modes listen with SO_REUSEPORT so a replacement server can
+// bind the same port before the old one is told to drain.
+static int open_listener(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons((uint16_t)port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Local admin socket at ACADEMY_BANK_ADMIN_SOCKET, server mode only. Each
+// connection gets one Prometheus text dump of this process's metrics and is
+// closed.
+static int open_admin_socket(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void server_admin(Server *srv) {
+  for (;;) {
+    int fd = accept4(srv->admin_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    AppContext app = {0};
+    app.storage = srv->storage;
+    print_prometheus(&app);
+    for (size_t off = 0; off < app.out.len;) {
+      ssize_t n =
+          send(fd, app.out.data + off, app.out.len - off, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      off += (size_t)n;
+    }
+    app_release(&app);
+    close(fd);
+  }
+}
+
+static int env_int(const char *name, int fallback) {
+  const char *v = getenv(name);
+  return v && atoi(v) > 0 ? atoi(v) : fallback;
+}
+
+static int session_timeout(void) {
+  return env_int("ACADEMY_BANK_SESSION_TIMEOUT", 60);
+}
+
+static int run_server(Storage *storage, int port) {
+  Server srv = {0};
+  srv.storage = storage;
+  srv.session_timeout = session_timeout();
+  srv.group_commit_ms = env_int("ACADEMY_BANK_GROUP_COMMIT_MS", 2);
+  srv.group_commit_ops = (size_t)env_int("ACADEMY_BANK_GROUP_COMMIT_OPS", 64);
+  storage_set_group_commit(storage, true);
+
+  srv.listen_fd = open_listener(port);
+  if (srv.listen_fd < 0) {
+    fprintf(stderr, "Failed to listen on port %d\n", port);
+    return 1;
+  }
+  srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (srv.epoll_fd < 0 ||
+      epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.listen_fd, &ev) != 0) {
+    fprintf(stderr, "Failed to set up epoll\n");
+    close(srv.listen_fd);
+    return 1;
+  }
+  const char *admin_path = getenv("ACADEMY_BANK_ADMIN_SOCKET");
+  srv.admin_fd = -1;
+  if (admin_path && *admin_path) {
+    srv.admin_fd = open_admin_socket(admin_path);
+    struct epoll_event aev = {.events = EPOLLIN, .data.ptr = &srv.admin_fd};
+    if (srv.admin_fd < 0 ||
+        epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.admin_fd, &aev) != 0)
+      fprintf(stderr, "Failed to open admin socket at %s\n", admin_path);
+  }
+  srv.hash_fd = -1;
+  srv.hash_pool = password_pool_new(env_int("ACADEMY_BANK_HASH_THREADS", 2));
+  if (srv.hash_pool) {
+    srv.hash_fd = password_pool_fd(srv.hash_pool);
+    struct epoll_event hev = {.events = EPOLLIN, .data.ptr = &srv.hash_fd};
+    if (epoll_ctl(srv.epoll_fd, EPOLL_CTL_ADD, srv.hash_fd, &hev) != 0) {
+      password_pool_free(srv.hash_pool);
+      srv.hash_pool = NULL;
+    }
+  }
+  if (!srv.hash_pool)
+    fprintf(stderr, "Failed to start hash threads; hashing inline\n");
+
+  struct epoll_event events[64];
+  while (1) {
+    int timeout = server_reap_expired(&srv);
+    if (srv.batch_deadline) {
+      int64_t left = srv.batch_deadline - now_ms();
+      if (left < 0)
+        left = 0;
+      if (timeout < 0 || left < timeout)
+        timeout = (int)left;
+    }
+    int n = epoll_wait(srv.epoll_fd, events, 64, timeout);
+    if (n < 0 && errno != EINTR)
+      break;
+    for (int i = 0; i < n; i++) {
+      Conn *c = events[i].data.ptr;
+      if (!c) {
+        server_accept(&srv);
+      } else if ((void *)c == &srv.admin_fd) {
+        server_admin(&srv);
+      } else if ((void *)c == &srv.hash_fd) {
+        server_password_done(&srv);
+      } else if (c->fd < 0) {
+        continue;
+      } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(&srv, c);
+      } else if (events[i].events & EPOLLOUT) {
+        conn_flush(&srv, c);
+      } else if (events[i].events & EPOLLIN) {
+        conn_readable(&srv, c);
+      }
     }
-    if (strncmp(line, "logout", 6) == 0) {
-      cmd_logout(&app);
+    if (srv.batch_deadline && now_ms() >= srv.batch_deadline)
+      server_commit(&srv);
+    server_free_closed(&srv);
+  }
+
+  server_commit(&srv);
+  storage_set_group_commit(storage, false);
+  password_pool_free(srv.hash_pool);
+  while (srv.conns)
+    conn_close(&srv, srv.conns);
+  for (Conn *c = srv.closed; c; c = c->next)
+    c->app.job = NULL;
+  server_free_closed(&srv);
+  close(srv.epoll_fd);
+  close(srv.listen_fd);
+  if (srv.admin_fd >= 0) {
+    close(srv.admin_fd);
+    unlink(admin_path);
+  }
+  return 1;
+}
+
+// Pre-fork mode: a master process owns the listening socket and keeps
+// ACADEMY_BANK_WORKERS workers alive. Each worker opens Storage once and then
+// serves connections one at a time on blocking sockets. SIGHUP replaces the
+// whole pool: the new generation starts accepting on the shared socket
+// before the old one is asked to finish its current session and exit, so no
+// connection is dropped. SIGTERM drains the pool and stops.
+#define MAX_WORKERS 64
+
+typedef struct {
+  pid_t pid;
+  unsigned generation;
+} Worker;
+
+static volatile sig_atomic_t stop_requested;
+static volatile sig_atomic_t reload_requested;
+
+static void on_stop_signal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+static void on_reload_signal(int sig) {
+  (void)sig;
+  reload_requested = 1;
+}
+
+static void install_handler(int sig, void (*handler)(int)) {
+  struct sigaction sa = {0};
+  sa.sa_handler = handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(sig, &sa, NULL);
+}
+
+// Bounds the blocking writes in write_all by the time left in the session,
+// so a client that never reads its replies cannot hold the worker once the
+// socket buffer fills. False once the session is out of time.
+static bool send_deadline(int fd, time_t deadline) {
+  time_t left = deadline - time(NULL);
+  if (left <= 0)
+    return false;
+  struct timeval tv = {.tv_sec = left};
+  return setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+static void serve_connection(Storage *storage, int fd, int timeout) {
+  AppContext app = {0};
+  app.storage = storage;
+  LineBuf in = {0};
+  time_t deadline = time(NULL) + timeout;
+  bool open = true;
+
+  print_greeting(&app);
+  while (send_deadline(fd, deadline) && write_all(fd, &app.out) && open) {
+    int left_ms = (int)(deadline - time(NULL)) * 1000;
+    if (left_ms <= 0)
+      break;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int r = poll(&pfd, 1, left_ms);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    ssize_t n = recv(fd, in.data + in.len, linebuf_space(&in), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    in.len += (size_t)n;
+    open = run_session_input(&app, &in, false);
+  }
+  app_release(&app);
+}
+
+static int worker_main(int listen_fd, const char *db_path,
+                       const StorageOptions *opts) {
+  install_handler(SIGTERM, on_stop_signal);
+  install_handler(SIGHUP, SIG_DFL);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  Storage *storage = NULL;
+  if (storage_open_with_options(db_path, opts, &storage) != STORAGE_OK) {
+    fprintf(stderr, "Failed to open storage at %s\n", db_path);
+    return 1;
+  }
+  int timeout = session_timeout();
+
+  // Once asked to stop, keep accepting until the queue is empty so that
+  // connections already handed to this worker are still served.
+  while (1) {
+    struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+    if (!stop_requested && poll(&pfd, 1, 1000) <= 0)
+      continue;
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (stop_requested && errno != EINTR)
+        break;
       continue;
     }
+    serve_connection(storage, fd, timeout);
+    close(fd);
+  }
+
+  storage_close(storage);
+  return 0;
+}
+
+static pid_t spawn_worker(int listen_fd, const char *db_path,
+                          const StorageOptions *opts) {
+  pid_t pid = fork();
+  if (pid == 0)
+    _exit(worker_main(listen_fd, db_path, opts));
+  return pid;
+}
+
+static int worker_count(void) {
+  int n = env_int("ACADEMY_BANK_WORKERS", 4);
+  return n > MAX_WORKERS ? MAX_WORKERS : n;
+}
 
-    printf("Unknown command. Type 'help' for list of commands.\n");
+static int run_prefork(const char *db_path, const StorageOptions *opts,
+                       int port) {
+  int listen_fd = open_listener(port);
+  if (listen_fd < 0) {
+    fprintf(stderr, "Failed to listen on port %d\n", port);
+    return 1;
+  }
+  install_handler(SIGTERM, on_stop_signal);
+  install_handler(SIGINT, on_stop_signal);
+  install_handler(SIGHUP, on_reload_signal);
+
+  Worker workers[MAX_WORKERS * 2] = {0};
+  unsigned generation = 1;
+  int wanted = worker_count();
+  for (int i = 0; i < wanted; i++) {
+    workers[i].pid = spawn_worker(listen_fd, db_path, opts);
+    workers[i].generation = generation;
+  }
+
+  bool stopping = false;
+  while (1) {
+    if (stop_requested && !stopping) {
+      stopping = true;
+      for (int i = 0; i < MAX_WORKERS * 2; i++) {
+        if (workers[i].pid > 0)
+          kill(workers[i].pid, SIGTERM);
+      }
+    }
+    if (reload_requested && !stopping) {
+      reload_requested = 0;
+      generation++;
+      wanted = worker_count();
+      for (int i = 0, started = 0;
+           i < MAX_WORKERS * 2 && started < wanted; i++) {
+        if (workers[i].pid > 0)
+          continue;
+        workers[i].pid = spawn_worker(listen_fd, db_path, opts);
+        workers[i].generation = generation;
+        started++;
+      }
+      for (int i = 0; i < MAX_WORKERS * 2; i++) {
+        if (workers[i].pid > 0 && workers[i].generation != generation)
+          kill(workers[i].pid, SIGTERM);
+      }
+    }
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == ECHILD && stopping)
+        break;
+      continue;
+    }
+    for (int i = 0; i < MAX_WORKERS * 2; i++) {
+      if (workers[i].pid != pid)
+        continue;
+      workers[i].pid = 0;
+      // Replace workers of the live generation that died on their own,
+      // backing off briefly if one could not even start.
+      if (!stopping && workers[i].generation == generation) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+          sleep(1);
+        workers[i].pid = spawn_worker(listen_fd, db_path, opts);
+      }
+      break;
+    }
   }
 
-  storage_close(app.storage);
+  close(listen_fd);
   return 0;
 }
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [db_path]\n"
+          "       %s --listen <port> [db_path]\n"
+          "       %s --prefork <port> [db_path]\n"
+          "       %s --backup <dest_path> [db_path]\n"
+          "       %s --snapshot [db_path] > dest\n",
+          argv0, argv0, argv0, argv0, argv0);
+}
+
+// Online backup while the service keeps running: --backup replaces
+// dest_path with a fresh copy, --snapshot streams one to stdout. A sharded
+// database is one file per shard, so it can only be backed up to files.
+static int run_backup(Storage *storage, const char *dest_path) {
+  if (!dest_path && strcmp(storage_backend_name(storage), "shard") == 0) {
+    fprintf(stderr, "--snapshot cannot stream a sharded database; use "
+                    "--backup <dest_path>, which writes <dest_path>.0 ...\n");
+    return 1;
+  }
+  StorageBackupOptions opts;
+  storage_backup_options_default(&opts);
+  storage_backup_options_from_env(&opts);
+  StorageResult r = dest_path
+                        ? storage_backup_to_file(storage, dest_path, &opts)
+                        : storage_snapshot_to_fd(storage, STDOUT_FILENO, &opts);
+  if (r != STORAGE_OK) {
+    fprintf(stderr, "Backup failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  command_index_init();
+
+  int port = 0;
+  bool prefork = false;
+  bool backup = false;
+  const char *backup_dest = NULL;
+  int argi = 1;
+  if (argc > 2 && (strcmp(argv[1], "--listen") == 0 ||
+                   strcmp(argv[1], "--prefork") == 0)) {
+    prefork = strcmp(argv[1], "--prefork") == 0;
+    port = atoi(argv[2]);
+    if (port <= 0 || port > 65535) {
+      usage(argv[0]);
+      return 1;
+    }
+    argi = 3;
+  } else if (argc > 1 && strcmp(argv[1], "--backup") == 0) {
+    if (argc < 3) {
+      usage(argv[0]);
+      return 1;
+    }
+    backup = true;
+    backup_dest = argv[2];
+    argi = 3;
+  } else if (argc > 1 && strcmp(argv[1], "--snapshot") == 0) {
+    backup = true;
+    argi = 2;
+  }
+
+  PasswordOptions pw_opts;
+  password_options_default(&pw_opts);
+  // One REPL process per connection never reuses its login cache.
+  if (!port && !backup)
+    pw_opts.scrypt_log2_n = PASSWORD_REPL_LOG2_N;
+  password_options_from_env(&pw_opts);
+  if (!password_init(&pw_opts)) {
+    fprintf(stderr, "Invalid password hashing options\n");
+    return 1;
+  }
+
+  const char *db_path = argc > argi ? argv[argi] : "academy_bank.db";
+  Storage *storage = NULL;
+  StorageOptions opts;
+  storage_options_default(&opts);
+  storage_options_from_env(&opts);
+  if (storage_open_with_options(db_path, &opts, &storage) != STORAGE_OK) {
+    fprintf(stderr, "Failed to open storage at %s\n", db_path);
+    return 1;
+  }
+
+  if (backup) {
+    int rc = run_backup(storage, backup_dest);
+    storage_close(storage);
+    return rc;
+  }
+
+  // The pre-fork master only opens storage to run migrations before the
+  // workers start; each worker then opens its own connection.
+  if (prefork) {
+    storage_close(storage);
+    return run_prefork(db_path, &opts, port);
+  }
+
+  int rc = port ? run_server(storage, port) : run_repl(storage);
+
+  storage_close(storage);
+  return rc;
+}
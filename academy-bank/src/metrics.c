@@ -0,0 +1,86 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+
+#include <string.h>
+#include <time.h>
+
+#define METRICS_MAX_OPS 96
+#define SUB_COUNT (1u << METRICS_SUB_BITS)
+
+static OpMetric registry[METRICS_MAX_OPS];
+static size_t registered;
+static OpMetric overflow = {.kind = "overflow", .name = "overflow"};
+
+OpMetric *metrics_op(const char *kind, const char *name) {
+  for (size_t i = 0; i < registered; i++) {
+    if (strcmp(registry[i].kind, kind) == 0 &&
+        strcmp(registry[i].name, name) == 0)
+      return &registry[i];
+  }
+  if (registered == METRICS_MAX_OPS)
+    return &overflow;
+  OpMetric *m = &registry[registered++];
+  m->kind = kind;
+  m->name = name;
+  return m;
+}
+
+uint64_t metrics_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Values below SUB_COUNT get a bucket each. Above that, the top
+// METRICS_SUB_BITS bits after the leading one pick one of SUB_COUNT buckets
+// within the value's power of two.
+static size_t bucket_of(uint64_t ns) {
+  if (ns < SUB_COUNT)
+    return (size_t)ns;
+  if (ns >> METRICS_MAX_BITS)
+    ns = (1ULL << METRICS_MAX_BITS) - 1;
+  unsigned shift = 63 - (unsigned)__builtin_clzll(ns) - METRICS_SUB_BITS;
+  return ((shift + 1) << METRICS_SUB_BITS) + ((ns >> shift) & (SUB_COUNT - 1));
+}
+
+static uint64_t bucket_upper(size_t b) {
+  if (b < SUB_COUNT)
+    return b;
+  unsigned shift = (unsigned)(b >> METRICS_SUB_BITS) - 1;
+  uint64_t low = (uint64_t)(SUB_COUNT + (b & (SUB_COUNT - 1))) << shift;
+  return low + (1ULL << shift) - 1;
+}
+
+void metrics_record(OpMetric *m, uint64_t start_ns, bool error) {
+  uint64_t ns = metrics_now_ns() - start_ns;
+  m->count++;
+  m->errors += error;
+  m->sum_ns += ns;
+  if (ns > m->max_ns)
+    m->max_ns = ns;
+  m->buckets[bucket_of(ns)]++;
+}
+
+uint64_t metrics_percentile_ns(const OpMetric *m, double q) {
+  if (m->count == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(q * (double)m->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+    seen += m->buckets[b];
+    if (seen >= rank) {
+      uint64_t upper = bucket_upper(b);
+      return upper < m->max_ns ? upper : m->max_ns;
+    }
+  }
+  return m->max_ns;
+}
+
+size_t metrics_count(void) { return registered; }
+
+const OpMetric *metrics_at(size_t i) {
+  return i < registered ? &registry[i] : NULL;
+}
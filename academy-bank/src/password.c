@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+
+#include "password.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+_Static_assert(PASSWORD_HASH_SZ == sizeof(((User *)0)->password),
+               "hashes are stored in User.password");
+
+#define SALT_LEN 16
+#define KEY_LEN 32
+#define PREFIX "$scrypt$"
+#define MAX_LOG2_N 24
+#define MAX_RP 64
+
+static PasswordOptions options;
+
+// Login cache: direct-mapped by user name, so a busy slot is simply
+// overwritten. Shared with the pool's workers, hence the lock.
+typedef struct {
+  char name[NAME_SZ];
+  uint8_t mac[KEY_LEN];
+} CacheEntry;
+
+static CacheEntry *cache;
+static uint32_t cache_mask;
+static uint8_t cache_key[KEY_LEN];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void password_options_default(PasswordOptions *opts) {
+  if (!opts)
+    return;
+  opts->scrypt_log2_n = 14;
+  opts->scrypt_r = 8;
+  opts->scrypt_p = 1;
+  opts->login_cache_entries = 4096;
+}
+
+void password_options_from_env(PasswordOptions *opts) {
+  if (!opts)
+    return;
+  const char *v;
+  if ((v = getenv("ACADEMY_BANK_SCRYPT_LOG2_N")) && *v)
+    opts->scrypt_log2_n = (int)strtol(v, NULL, 10);
+  if ((v = getenv("ACADEMY_BANK_SCRYPT_R")) && *v)
+    opts->scrypt_r = (int)strtol(v, NULL, 10);
+  if ((v = getenv("ACADEMY_BANK_SCRYPT_P")) && *v)
+    opts->scrypt_p = (int)strtol(v, NULL, 10);
+  if ((v = getenv("ACADEMY_BANK_LOGIN_CACHE")) && *v)
+    opts->login_cache_entries = (int)strtol(v, NULL, 10);
+}
+
+static bool cost_ok(int log2_n, int r, int p) {
+  return log2_n >= 1 && log2_n <= MAX_LOG2_N && r >= 1 && r <= MAX_RP &&
+         p >= 1 && p <= MAX_RP;
+}
+
+bool password_init(const PasswordOptions *opts) {
+  if (!opts || !cost_ok(opts->scrypt_log2_n, opts->scrypt_r, opts->scrypt_p) ||
+      opts->login_cache_entries < 0)
+    return false;
+  options = *opts;
+  if (RAND_bytes(cache_key, sizeof(cache_key)) != 1)
+    return false;
+  if (opts->login_cache_entries > 0) {
+    uint32_t slots = 1;
+    while (slots < (uint32_t)opts->login_cache_entries)
+      slots <<= 1;
+    if (!(cache = calloc(slots, sizeof(CacheEntry))))
+      return false;
+    cache_mask = slots - 1;
+  }
+  return true;
+}
+
+static uint32_t name_slot(const char *name) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < NAME_SZ && name[i]; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h & cache_mask;
+}
+
+static void cache_mac(const char *password, const char *stored,
+                      uint8_t out[KEY_LEN]) {
+  uint8_t msg[PASSWORD_HASH_SZ + PASSWORD_MAX + 1];
+  size_t stored_len = strnlen(stored, PASSWORD_HASH_SZ);
+  size_t password_len = strnlen(password, PASSWORD_MAX);
+  memcpy(msg, stored, stored_len);
+  msg[stored_len] = '\0';
+  memcpy(msg + stored_len + 1, password, password_len);
+  unsigned int len = KEY_LEN;
+  HMAC(EVP_sha256(), cache_key, sizeof(cache_key), msg,
+       stored_len + 1 + password_len, out, &len);
+  OPENSSL_cleanse(msg, sizeof(msg));
+}
+
+bool password_check_cached(const char *name, const char *password,
+                           const char *stored) {
+  if (!cache)
+    return false;
+  uint8_t mac[KEY_LEN];
+  cache_mac(password, stored, mac);
+  CacheEntry *e = &cache[name_slot(name)];
+  pthread_mutex_lock(&cache_lock);
+  bool hit = strncmp(e->name, name, NAME_SZ) == 0 &&
+             CRYPTO_memcmp(e->mac, mac, KEY_LEN) == 0;
+  pthread_mutex_unlock(&cache_lock);
+  return hit;
+}
+
+static void cache_put(const char *name, const char *password,
+                      const char *stored) {
+  if (!cache)
+    return;
+  CacheEntry fresh = {0};
+  snprintf(fresh.name, sizeof(fresh.name), "%s", name);
+  cache_mac(password, stored, fresh.mac);
+  pthread_mutex_lock(&cache_lock);
+  cache[name_slot(name)] = fresh;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static bool scrypt_key(const char *password, const uint8_t *salt, int log2_n,
+                       int r, int p, uint8_t out[KEY_LEN]) {
+  uint64_t n = 1ULL << log2_n;
+  // scrypt needs about 128 * r * (N + p) bytes; leave headroom.
+  uint64_t maxmem = 128ULL * (uint64_t)r * (n + (uint64_t)p) + (1u << 20);
+  return EVP_PBE_scrypt(password, strnlen(password, PASSWORD_MAX), salt,
+                        SALT_LEN, n, (uint64_t)r, (uint64_t)p, maxmem, out,
+                        KEY_LEN) == 1;
+}
+
+static void to_hex(const uint8_t *in, size_t len, char *out) {
+  static const char DIGITS[] = "0123456789abcdef";
+  for (size_t i = 0; i < len; i++) {
+    out[2 * i] = DIGITS[in[i] >> 4];
+    out[2 * i + 1] = DIGITS[in[i] & 15];
+  }
+  out[2 * len] = '\0';
+}
+
+static bool from_hex(const char *in, size_t len, uint8_t *out) {
+  for (size_t i = 0; i < len; i++) {
+    unsigned v;
+    if (sscanf(in + 2 * i, "%2x", &v) != 1)
+      return false;
+    out[i] = (uint8_t)v;
+  }
+  return true;
+}
+
+static bool hash_password(const char *password, char out[PASSWORD_HASH_SZ]) {
+  uint8_t salt[SALT_LEN], key[KEY_LEN];
+  char salt_hex[2 * SALT_LEN + 1], key_hex[2 * KEY_LEN + 1];
+  if (RAND_bytes(salt, sizeof(salt)) != 1 ||
+      !scrypt_key(password, salt, options.scrypt_log2_n, options.scrypt_r,
+                  options.scrypt_p, key))
+    return false;
+  to_hex(salt, SALT_LEN, salt_hex);
+  to_hex(key, KEY_LEN, key_hex);
+  OPENSSL_cleanse(key, sizeof(key));
+  snprintf(out, PASSWORD_HASH_SZ, PREFIX "%d$%d$%d$%s$%s",
+           options.scrypt_log2_n, options.scrypt_r, options.scrypt_p,
+           salt_hex, key_hex);
+  return true;
+}
+
+static bool verify_hash(const char *password, const char *stored) {
+  int log2_n, r, p, used = 0;
+  char salt_hex[2 * SALT_LEN + 1], key_hex[2 * KEY_LEN + 1];
+  if (sscanf(stored, PREFIX "%d$%d$%d$%32[0-9a-f]$%64[0-9a-f]%n", &log2_n,
+             &r, &p, salt_hex, key_hex, &used) != 5 ||
+      stored[used] != '\0' || strlen(salt_hex) != 2 * SALT_LEN ||
+      strlen(key_hex) != 2 * KEY_LEN || !cost_ok(log2_n, r, p))
+    return false;
+  uint8_t salt[SALT_LEN], want[KEY_LEN], got[KEY_LEN];
+  if (!from_hex(salt_hex, SALT_LEN, salt) ||
+      !from_hex(key_hex, KEY_LEN, want) ||
+      !scrypt_key(password, salt, log2_n, r, p, got))
+    return false;
+  bool ok = CRYPTO_memcmp(want, got, KEY_LEN) == 0;
+  OPENSSL_cleanse(got, sizeof(got));
+  return ok;
+}
+
+void password_job_run(PasswordJob *job) {
+  job->hash[0] = '\0';
+  if (job->op == PASSWORD_HASH) {
+    job->ok = hash_password(job->password, job->hash);
+  } else if (strncmp(job->stored, PREFIX, strlen(PREFIX)) == 0) {
+    job->ok = verify_hash(job->password, job->stored);
+  } else {
+    // A row from before hashing: compare as login always did, then hash it.
+    job->ok = strncmp(job->password, job->stored, PASSWORD_HASH_SZ) == 0;
+    if (job->ok && !hash_password(job->password, job->hash))
+      job->hash[0] = '\0';
+  }
+  if (job->op == PASSWORD_VERIFY && job->ok)
+    cache_put(job->name, job->password,
+              job->hash[0] ? job->hash : job->stored);
+  OPENSSL_cleanse(job->password, sizeof(job->password));
+}
+
+// Jobs queue on todo and move to done once run; the eventfd counts done
+// jobs not yet taken.
+struct PasswordPool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  PasswordJob *todo_head;
+  PasswordJob *todo_tail;
+  PasswordJob *done_head;
+  PasswordJob *done_tail;
+  bool stopping;
+  int event_fd;
+  int threads;
+  pthread_t workers[];
+};
+
+static void push(PasswordJob **head, PasswordJob **tail, PasswordJob *job) {
+  job->next = NULL;
+  if (*tail)
+    (*tail)->next = job;
+  else
+    *head = job;
+  *tail = job;
+}
+
+static PasswordJob *pop(PasswordJob **head, PasswordJob **tail) {
+  PasswordJob *job = *head;
+  if (job && !(*head = job->next))
+    *tail = NULL;
+  return job;
+}
+
+static void *pool_worker(void *arg) {
+  PasswordPool *pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stopping && !pool->todo_head)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    if (pool->stopping)
+      break;
+    PasswordJob *job = pop(&pool->todo_head, &pool->todo_tail);
+    pthread_mutex_unlock(&pool->lock);
+    password_job_run(job);
+    pthread_mutex_lock(&pool->lock);
+    push(&pool->done_head, &pool->done_tail, job);
+    uint64_t one = 1;
+    (void)!write(pool->event_fd, &one, sizeof(one));
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+PasswordPool *password_pool_new(int threads) {
+  if (threads < 1)
+    return NULL;
+  PasswordPool *pool =
+      calloc(1, sizeof(PasswordPool) + (size_t)threads * sizeof(pthread_t));
+  if (!pool)
+    return NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (pool->event_fd < 0) {
+    free(pool);
+    return NULL;
+  }
+  for (; pool->threads < threads; pool->threads++) {
+    if (pthread_create(&pool->workers[pool->threads], NULL, pool_worker,
+                       pool) != 0) {
+      password_pool_free(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void password_pool_free(PasswordPool *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->threads; i++)
+    pthread_join(pool->workers[i], NULL);
+  close(pool->event_fd);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+int password_pool_fd(const PasswordPool *pool) { return pool->event_fd; }
+
+void password_pool_submit(PasswordPool *pool, PasswordJob *job) {
+  pthread_mutex_lock(&pool->lock);
+  push(&pool->todo_head, &pool->todo_tail, job);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+PasswordJob *password_pool_take(PasswordPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  PasswordJob *job = pop(&pool->done_head, &pool->done_tail);
+  if (!pool->done_head) {
+    uint64_t count;
+    (void)!read(pool->event_fd, &count, sizeof(count));
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return job;
+}
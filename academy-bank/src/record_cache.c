@@ -0,0 +1,354 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "record_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NIL UINT32_MAX
+
+typedef union {
+  User user;
+  Flag flag;
+  Listing listing;
+} Record;
+
+// Entries live in one array per table. In-use entries sit on a doubly linked
+// LRU list (head is most recent) and on their id bucket chain; free entries
+// are chained through next.
+typedef struct {
+  uint64_t key;
+  uint32_t prev;
+  uint32_t next;
+  uint32_t id_next;
+  uint32_t name_next;
+  uint32_t name_hash;
+  Record rec;
+} Entry;
+
+typedef struct {
+  Entry *entries;
+  uint32_t *id_buckets;
+  uint32_t *name_buckets; // users only
+  uint32_t capacity;
+  uint32_t mask;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t free_head;
+} Table;
+
+struct RecordCache {
+  Table users;
+  Table flags;
+  Table listings;
+  RecordCacheStats stats;
+};
+
+static uint32_t hash_id(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (uint32_t)key;
+}
+
+static uint32_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < NAME_SZ && name[i]; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void table_clear(Table *t) {
+  for (uint32_t i = 0; i <= t->mask; i++) {
+    t->id_buckets[i] = NIL;
+    if (t->name_buckets)
+      t->name_buckets[i] = NIL;
+  }
+  for (uint32_t i = 0; i < t->capacity; i++)
+    t->entries[i].next = i + 1 < t->capacity ? i + 1 : NIL;
+  t->free_head = 0;
+  t->head = t->tail = NIL;
+}
+
+static bool table_init(Table *t, uint32_t capacity, bool by_name) {
+  uint32_t nbuckets = 1;
+  while (nbuckets < capacity * 2)
+    nbuckets <<= 1;
+  t->capacity = capacity;
+  t->mask = nbuckets - 1;
+  t->entries = calloc(capacity, sizeof(Entry));
+  t->id_buckets = calloc(nbuckets, sizeof(uint32_t));
+  t->name_buckets = by_name ? calloc(nbuckets, sizeof(uint32_t)) : NULL;
+  if (!t->entries || !t->id_buckets || (by_name && !t->name_buckets))
+    return false;
+  table_clear(t);
+  return true;
+}
+
+static void table_free(Table *t) {
+  free(t->entries);
+  free(t->id_buckets);
+  free(t->name_buckets);
+}
+
+static void lru_unlink(Table *t, uint32_t i) {
+  Entry *e = &t->entries[i];
+  if (e->prev != NIL)
+    t->entries[e->prev].next = e->next;
+  else
+    t->head = e->next;
+  if (e->next != NIL)
+    t->entries[e->next].prev = e->prev;
+  else
+    t->tail = e->prev;
+}
+
+static void lru_push_front(Table *t, uint32_t i) {
+  Entry *e = &t->entries[i];
+  e->prev = NIL;
+  e->next = t->head;
+  if (t->head != NIL)
+    t->entries[t->head].prev = i;
+  t->head = i;
+  if (t->tail == NIL)
+    t->tail = i;
+}
+
+static uint32_t table_find(Table *t, uint64_t key) {
+  uint32_t i = t->id_buckets[hash_id(key) & t->mask];
+  while (i != NIL && t->entries[i].key != key)
+    i = t->entries[i].id_next;
+  return i;
+}
+
+// Unlinks i from a bucket chain threaded through the field at offset.
+static void chain_remove(Table *t, uint32_t *slot, uint32_t i, size_t offset) {
+  while (*slot != NIL && *slot != i)
+    slot = (uint32_t *)((char *)&t->entries[*slot] + offset);
+  if (*slot == i)
+    *slot = *(uint32_t *)((char *)&t->entries[i] + offset);
+}
+
+static void table_remove(Table *t, uint32_t i) {
+  Entry *e = &t->entries[i];
+  chain_remove(t, &t->id_buckets[hash_id(e->key) & t->mask], i,
+               offsetof(Entry, id_next));
+  if (t->name_buckets)
+    chain_remove(t, &t->name_buckets[e->name_hash & t->mask], i,
+                 offsetof(Entry, name_next));
+  lru_unlink(t, i);
+  e->next = t->free_head;
+  t->free_head = i;
+}
+
+// Returns a fresh most-recent entry for key, replacing any existing one and
+// evicting the least recently used entry when the table is full.
+static Entry *table_insert(Table *t, uint64_t key) {
+  uint32_t i = table_find(t, key);
+  if (i != NIL)
+    table_remove(t, i);
+  if (t->free_head == NIL)
+    table_remove(t, t->tail);
+  i = t->free_head;
+  Entry *e = &t->entries[i];
+  t->free_head = e->next;
+  e->key = key;
+  uint32_t *bucket = &t->id_buckets[hash_id(key) & t->mask];
+  e->id_next = *bucket;
+  *bucket = i;
+  lru_push_front(t, i);
+  return e;
+}
+
+static Entry *table_lookup(RecordCache *c, Table *t, uint64_t key) {
+  uint32_t i = table_find(t, key);
+  if (i == NIL) {
+    c->stats.misses++;
+    return NULL;
+  }
+  c->stats.hits++;
+  lru_unlink(t, i);
+  lru_push_front(t, i);
+  return &t->entries[i];
+}
+
+RecordCache *record_cache_new(size_t capacity) {
+  if (capacity == 0 || capacity > NIL / 4)
+    return NULL;
+  RecordCache *c = calloc(1, sizeof(RecordCache));
+  if (!c)
+    return NULL;
+  if (!table_init(&c->users, (uint32_t)capacity, true) ||
+      !table_init(&c->flags, (uint32_t)capacity, false) ||
+      !table_init(&c->listings, (uint32_t)capacity, false)) {
+    record_cache_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+void record_cache_free(RecordCache *cache) {
+  if (!cache)
+    return;
+  table_free(&cache->users);
+  table_free(&cache->flags);
+  table_free(&cache->listings);
+  free(cache);
+}
+
+void record_cache_clear(RecordCache *cache) {
+  table_clear(&cache->users);
+  table_clear(&cache->flags);
+  table_clear(&cache->listings);
+}
+
+void record_cache_stats(const RecordCache *cache, RecordCacheStats *out) {
+  *out = cache->stats;
+}
+
+bool record_cache_get_user(RecordCache *cache, uint64_t uid, User *out) {
+  Entry *e = table_lookup(cache, &cache->users, uid);
+  if (!e)
+    return false;
+  *out = e->rec.user;
+  return true;
+}
+
+bool record_cache_get_user_by_name(RecordCache *cache, const char *name,
+                                   User *out) {
+  Table *t = &cache->users;
+  uint32_t h = hash_name(name);
+  uint32_t i = t->name_buckets[h & t->mask];
+  while (i != NIL && (t->entries[i].name_hash != h ||
+                      strncmp(t->entries[i].rec.user.name, name, NAME_SZ)))
+    i = t->entries[i].name_next;
+  // Only a full-length match counts; longer names are never stored.
+  if (i == NIL || strnlen(name, NAME_SZ) == NAME_SZ) {
+    cache->stats.misses++;
+    return false;
+  }
+  cache->stats.hits++;
+  lru_unlink(t, i);
+  lru_push_front(t, i);
+  *out = t->entries[i].rec.user;
+  return true;
+}
+
+static void copy_text(char *dst, const char *src, size_t size) {
+  size_t n = strnlen(src, size - 1);
+  memcpy(dst, src, n);
+  memset(dst + n, 0, size - n);
+}
+
+// Stored records are built the way a database read builds them: zeroed,
+// then each text field copied up to its terminator. Callers reuse their
+// records between commands, so whatever follows the terminator in theirs
+// is left behind, and a hit is indistinguishable from a miss followed by a
+// read.
+void record_cache_put_user(RecordCache *cache, const User *user) {
+  Table *t = &cache->users;
+  Entry *e = table_insert(t, user->uid);
+  User *u = &e->rec.user;
+  memset(&e->rec, 0, sizeof(e->rec));
+  u->uid = user->uid;
+  copy_text(u->name, user->name, sizeof(u->name));
+  u->balance = user->balance;
+  copy_text(u->password, user->password, sizeof(u->password));
+  e->name_hash = hash_name(e->rec.user.name);
+  uint32_t *bucket = &t->name_buckets[e->name_hash & t->mask];
+  e->name_next = *bucket;
+  *bucket = (uint32_t)(e - t->entries);
+}
+
+void record_cache_drop_user(RecordCache *cache, uint64_t uid) {
+  uint32_t i = table_find(&cache->users, uid);
+  if (i != NIL)
+    table_remove(&cache->users, i);
+}
+
+void record_cache_adjust_balance(RecordCache *cache, uint64_t uid,
+                                 uint64_t delta) {
+  uint32_t i = table_find(&cache->users, uid);
+  if (i != NIL)
+    cache->users.entries[i].rec.user.balance += delta;
+}
+
+bool record_cache_get_flag(RecordCache *cache, uint64_t id, Flag *out) {
+  Entry *e = table_lookup(cache, &cache->flags, id);
+  if (!e)
+    return false;
+  *out = e->rec.flag;
+  return true;
+}
+
+void record_cache_put_flag(RecordCache *cache, const Flag *flag) {
+  Entry *e = table_insert(&cache->flags, flag->id);
+  Flag *f = &e->rec.flag;
+  memset(&e->rec, 0, sizeof(e->rec));
+  f->id = flag->id;
+  f->uid = flag->uid;
+  copy_text(f->secret, flag->secret, sizeof(f->secret));
+}
+
+void record_cache_drop_flag(RecordCache *cache, uint64_t id) {
+  uint32_t i = table_find(&cache->flags, id);
+  if (i != NIL)
+    table_remove(&cache->flags, i);
+}
+
+void record_cache_drop_flags_for_user(RecordCache *cache, uint64_t uid) {
+  Table *t = &cache->flags;
+  for (uint32_t i = t->head; i != NIL;) {
+    uint32_t next = t->entries[i].next;
+    if (t->entries[i].rec.flag.uid == uid)
+      table_remove(t, i);
+    i = next;
+  }
+}
+
+bool record_cache_get_listing(RecordCache *cache, uint64_t id, Listing *out) {
+  Entry *e = table_lookup(cache, &cache->listings, id);
+  if (!e)
+    return false;
+  *out = e->rec.listing;
+  return true;
+}
+
+void record_cache_put_listing(RecordCache *cache, const Listing *listing) {
+  Entry *e = table_insert(&cache->listings, listing->id);
+  Listing *l = &e->rec.listing;
+  memset(&e->rec, 0, sizeof(e->rec));
+  l->id = listing->id;
+  l->fid = listing->fid;
+  copy_text(l->note, listing->note, sizeof(l->note));
+  l->sale_count = listing->sale_count;
+  l->price = listing->price;
+}
+
+void record_cache_drop_listing(RecordCache *cache, uint64_t id) {
+  uint32_t i = table_find(&cache->listings, id);
+  if (i != NIL)
+    table_remove(&cache->listings, i);
+}
+
+void record_cache_drop_listings_for_flag(RecordCache *cache, uint64_t fid) {
+  Table *t = &cache->listings;
+  for (uint32_t i = t->head; i != NIL;) {
+    uint32_t next = t->entries[i].next;
+    if (t->entries[i].rec.listing.fid == fid)
+      table_remove(t, i);
+    i = next;
+  }
+}
+
+void record_cache_drop_all_listings(RecordCache *cache) {
+  table_clear(&cache->listings);
+}
+
+void record_cache_record_sale(RecordCache *cache, uint64_t id) {
+  uint32_t i = table_find(&cache->listings, id);
+  if (i != NIL)
+    cache->listings.entries[i].rec.listing.sale_count++;
+}
@@ -0,0 +1,549 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "storage.h"
+
+#include "metrics.h"
+#include "storage_backend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  const char *scheme;
+  StorageResult (*open)(const char *path, const StorageOptions *opts,
+                        Storage **out_storage);
+} BackendScheme;
+
+// Paths without a known scheme go to SQLite unchanged, so plain file names
+// and ":memory:" keep working.
+static const BackendScheme BACKENDS[] = {
+    {"sqlite:", storage_sqlite_open},
+    {"log:", storage_log_open},
+    {"shard:", storage_shard_open},
+};
+
+// Every data call is timed into a "storage" metric named after it.
+typedef enum {
+  OP_USER_GET_BY_ID,
+  OP_USER_GET_BY_NAME,
+  OP_USER_INSERT,
+  OP_USER_UPDATE,
+  OP_USER_DELETE_BY_ID,
+  OP_FLAG_GET_BY_ID,
+  OP_ITER_FLAGS_FOR_USER,
+  OP_PAGE_FLAGS_FOR_USER,
+  OP_FLAG_INSERT,
+  OP_FLAG_UPDATE,
+  OP_FLAG_DELETE_BY_ID,
+  OP_LISTING_GET_BY_ID,
+  OP_ITER_LISTINGS_FOR_USER,
+  OP_PAGE_LISTINGS_FOR_USER,
+  OP_LISTING_INSERT,
+  OP_LISTING_UPDATE,
+  OP_LISTING_DELETE_BY_ID,
+  OP_PURCHASE_LISTING,
+  OP_CURSOR_NEXT_FLAGS,
+  OP_CURSOR_NEXT_LISTINGS,
+  OP_BATCH_COMMIT,
+  OP_SNAPSHOT,
+  OP_COUNT
+} StorageOp;
+
+static const char *const OP_NAMES[OP_COUNT] = {
+    [OP_USER_GET_BY_ID] = "user_get_by_id",
+    [OP_USER_GET_BY_NAME] = "user_get_by_name",
+    [OP_USER_INSERT] = "user_insert",
+    [OP_USER_UPDATE] = "user_update",
+    [OP_USER_DELETE_BY_ID] = "user_delete_by_id",
+    [OP_FLAG_GET_BY_ID] = "flag_get_by_id",
+    [OP_ITER_FLAGS_FOR_USER] = "iter_flags_for_user",
+    [OP_PAGE_FLAGS_FOR_USER] = "page_flags_for_user",
+    [OP_FLAG_INSERT] = "flag_insert",
+    [OP_FLAG_UPDATE] = "flag_update",
+    [OP_FLAG_DELETE_BY_ID] = "flag_delete_by_id",
+    [OP_LISTING_GET_BY_ID] = "listing_get_by_id",
+    [OP_ITER_LISTINGS_FOR_USER] = "iter_listings_for_user",
+    [OP_PAGE_LISTINGS_FOR_USER] = "page_listings_for_user",
+    [OP_LISTING_INSERT] = "listing_insert",
+    [OP_LISTING_UPDATE] = "listing_update",
+    [OP_LISTING_DELETE_BY_ID] = "listing_delete_by_id",
+    [OP_PURCHASE_LISTING] = "purchase_listing",
+    [OP_CURSOR_NEXT_FLAGS] = "cursor_next_flags",
+    [OP_CURSOR_NEXT_LISTINGS] = "cursor_next_listings",
+    [OP_BATCH_COMMIT] = "batch_commit",
+    [OP_SNAPSHOT] = "snapshot",
+};
+
+// Only STORAGE_ERR counts as an error; the other results are answers.
+static StorageResult timed(StorageOp op, uint64_t start, StorageResult r) {
+  static OpMetric *metrics[OP_COUNT];
+  if (!metrics[op])
+    metrics[op] = metrics_op("storage", OP_NAMES[op]);
+  metrics_record(metrics[op], start, r == STORAGE_ERR);
+  return r;
+}
+
+void storage_options_default(StorageOptions *opts) {
+  if (!opts)
+    return;
+  opts->journal_mode = "WAL";
+  opts->synchronous = "NORMAL";
+  opts->mmap_size = 64LL * 1024 * 1024;
+  opts->cache_size = -8192;
+  opts->busy_timeout_ms = 5000;
+  opts->record_cache_entries = 4096;
+  opts->read_connections = 0;
+}
+
+void storage_options_from_env(StorageOptions *opts) {
+  if (!opts)
+    return;
+  const char *v;
+  if ((v = getenv("ACADEMY_BANK_JOURNAL_MODE")) && *v)
+    opts->journal_mode = v;
+  if ((v = getenv("ACADEMY_BANK_SYNCHRONOUS")) && *v)
+    opts->synchronous = v;
+  if ((v = getenv("ACADEMY_BANK_MMAP_SIZE")) && *v)
+    opts->mmap_size = strtoll(v, NULL, 10);
+  if ((v = getenv("ACADEMY_BANK_CACHE_SIZE")) && *v)
+    opts->cache_size = (int)strtol(v, NULL, 10);
+  if ((v = getenv("ACADEMY_BANK_BUSY_TIMEOUT_MS")) && *v)
+    opts->busy_timeout_ms = (int)strtol(v, NULL, 10);
+  if ((v = getenv("ACADEMY_BANK_RECORD_CACHE")) && *v)
+    opts->record_cache_entries = (int)strtol(v, NULL, 10);
+  if ((v = getenv("ACADEMY_BANK_READ_CONNECTIONS")) && *v)
+    opts->read_connections = (int)strtol(v, NULL, 10);
+}
+
+StorageResult storage_open(const char *db_path, Storage **out_storage) {
+  StorageOptions opts;
+  storage_options_default(&opts);
+  return storage_open_with_options(db_path, &opts, out_storage);
+}
+
+StorageResult storage_open_with_options(const char *db_path,
+                                        const StorageOptions *opts,
+                                        Storage **out_storage) {
+  if (!db_path || !opts || !out_storage)
+    return STORAGE_INVALID;
+  for (size_t i = 0; i < sizeof(BACKENDS) / sizeof(BACKENDS[0]); i++) {
+    size_t n = strlen(BACKENDS[i].scheme);
+    if (strncmp(db_path, BACKENDS[i].scheme, n) == 0)
+      return BACKENDS[i].open(db_path + n, opts, out_storage);
+  }
+  return storage_sqlite_open(db_path, opts, out_storage);
+}
+
+void storage_close(Storage *storage) {
+  if (storage)
+    storage->ops->close(storage);
+}
+
+const char *storage_backend_name(const Storage *storage) {
+  return storage ? storage->ops->name : NULL;
+}
+
+// Opens the group-commit batch on the first write after it was enabled and
+// counts every write made inside it.
+static StorageResult join_batch(Storage *storage) {
+  if (!storage->group_commit)
+    return STORAGE_OK;
+  if (!storage->batch_open) {
+    StorageResult r = storage->ops->batch_begin(storage);
+    if (r != STORAGE_OK)
+      return r;
+    storage->batch_open = true;
+  }
+  storage->batch_writes++;
+  return STORAGE_OK;
+}
+
+StorageResult storage_user_get_by_id(Storage *storage, uint64_t uid,
+                                     User *out_user) {
+  if (!storage || !out_user)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = storage->ops->user_get_by_id(storage, uid, out_user);
+  return timed(OP_USER_GET_BY_ID, start, r);
+}
+
+StorageResult storage_user_get_by_name(Storage *storage, const char *name,
+                                       User *out_user) {
+  if (!storage || !name || !out_user)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = storage->ops->user_get_by_name(storage, name, out_user);
+  return timed(OP_USER_GET_BY_NAME, start, r);
+}
+
+StorageResult storage_user_insert(Storage *storage, const User *user,
+                                  User *out_user) {
+  if (!storage || !user)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->user_insert(storage, user, out_user);
+  return timed(OP_USER_INSERT, start, r);
+}
+
+StorageResult storage_user_update(Storage *storage, const User *user) {
+  if (!storage || !user)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->user_update(storage, user);
+  return timed(OP_USER_UPDATE, start, r);
+}
+
+StorageResult storage_user_delete_by_id(Storage *storage, uint64_t uid) {
+  if (!storage)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->user_delete_by_id(storage, uid);
+  return timed(OP_USER_DELETE_BY_ID, start, r);
+}
+
+StorageResult storage_flag_get_by_id(Storage *storage, uint64_t id,
+                                     Flag *out_flag) {
+  if (!storage || !out_flag)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = storage->ops->flag_get_by_id(storage, id, out_flag);
+  return timed(OP_FLAG_GET_BY_ID, start, r);
+}
+
+StorageResult storage_iter_flags_for_user(Storage *storage, uint64_t uid,
+                                          flag_iter_cb cb, void *ctx) {
+  if (!storage || !cb)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r =
+      storage->ops->page_flags_for_user(storage, uid, 0, 0, cb, ctx);
+  return timed(OP_ITER_FLAGS_FOR_USER, start, r);
+}
+
+StorageResult storage_page_flags_for_user(Storage *storage, uint64_t uid,
+                                          uint64_t after_id, size_t limit,
+                                          flag_iter_cb cb, void *ctx) {
+  if (!storage || !cb)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = storage->ops->page_flags_for_user(storage, uid, after_id,
+                                                      limit, cb, ctx);
+  return timed(OP_PAGE_FLAGS_FOR_USER, start, r);
+}
+
+StorageResult storage_flag_insert(Storage *storage, const Flag *flag,
+                                  Flag *out_flag) {
+  if (!storage || !flag)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->flag_insert(storage, flag, out_flag);
+  return timed(OP_FLAG_INSERT, start, r);
+}
+
+StorageResult storage_flag_update(Storage *storage, const Flag *flag) {
+  if (!storage || !flag)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->flag_update(storage, flag);
+  return timed(OP_FLAG_UPDATE, start, r);
+}
+
+StorageResult storage_flag_delete_by_id(Storage *storage, uint64_t id) {
+  if (!storage)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->flag_delete_by_id(storage, id);
+  return timed(OP_FLAG_DELETE_BY_ID, start, r);
+}
+
+StorageResult storage_listing_get_by_id(Storage *storage, uint64_t id,
+                                        Listing *out_listing) {
+  if (!storage || !out_listing)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = storage->ops->listing_get_by_id(storage, id, out_listing);
+  return timed(OP_LISTING_GET_BY_ID, start, r);
+}
+
+StorageResult storage_iter_listings_for_user(Storage *storage, uint64_t uid,
+                                             listing_iter_cb cb, void *ctx) {
+  if (!storage || !cb)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r =
+      storage->ops->page_listings_for_user(storage, uid, 0, 0, cb, ctx);
+  return timed(OP_ITER_LISTINGS_FOR_USER, start, r);
+}
+
+StorageResult storage_page_listings_for_user(Storage *storage, uint64_t uid,
+                                             uint64_t after_id, size_t limit,
+                                             listing_iter_cb cb, void *ctx) {
+  if (!storage || !cb)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = storage->ops->page_listings_for_user(
+      storage, uid, after_id, limit, cb, ctx);
+  return timed(OP_PAGE_LISTINGS_FOR_USER, start, r);
+}
+
+StorageResult storage_listing_insert(Storage *storage, const Listing *listing,
+                                     Listing *out_listing) {
+  if (!storage || !listing)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->listing_insert(storage, listing, out_listing);
+  return timed(OP_LISTING_INSERT, start, r);
+}
+
+StorageResult storage_listing_update(Storage *storage, const Listing *listing) {
+  if (!storage || !listing)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->listing_update(storage, listing);
+  return timed(OP_LISTING_UPDATE, start, r);
+}
+
+StorageResult storage_listing_delete_by_id(Storage *storage, uint64_t id) {
+  if (!storage)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->listing_delete_by_id(storage, id);
+  return timed(OP_LISTING_DELETE_BY_ID, start, r);
+}
+
+StorageResult storage_purchase_listing(Storage *storage, uint64_t listing_id,
+                                       uint64_t buyer_uid, uint64_t price,
+                                       uint64_t fee, Flag *out_flag) {
+  if (!storage)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = join_batch(storage);
+  if (r == STORAGE_OK)
+    r = storage->ops->purchase_listing(storage, listing_id, buyer_uid, price,
+                                       fee, out_flag);
+  return timed(OP_PURCHASE_LISTING, start, r);
+}
+
+void storage_cursor_init(StorageCursor *cursor, uint64_t uid,
+                         uint64_t after_id, size_t page_size) {
+  cursor->uid = uid;
+  cursor->after_id = after_id;
+  cursor->page_size = page_size;
+  cursor->done = false;
+}
+
+// Sits between a page query and the caller's callback to move the cursor
+// past every record handed out.
+typedef struct {
+  StorageCursor *cursor;
+  flag_iter_cb flag_cb;
+  listing_iter_cb listing_cb;
+  void *ctx;
+  size_t seen;
+  bool stopped;
+} CursorStep;
+
+static int cursor_flag_cb(const Flag *flag, void *arg) {
+  CursorStep *step = arg;
+  step->cursor->after_id = flag->id;
+  step->seen++;
+  step->stopped = step->flag_cb(flag, step->ctx) != 0;
+  return step->stopped;
+}
+
+static int cursor_listing_cb(const Listing *listing, void *arg) {
+  CursorStep *step = arg;
+  step->cursor->after_id = listing->id;
+  step->seen++;
+  step->stopped = step->listing_cb(listing, step->ctx) != 0;
+  return step->stopped;
+}
+
+static void cursor_finish(CursorStep *step) {
+  if (!step->stopped && step->seen < step->cursor->page_size)
+    step->cursor->done = true;
+}
+
+StorageResult storage_cursor_next_flags(Storage *storage, StorageCursor *cursor,
+                                        flag_iter_cb cb, void *ctx) {
+  if (!storage || !cursor || !cb || !cursor->page_size)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  CursorStep step = {.cursor = cursor, .flag_cb = cb, .ctx = ctx};
+  StorageResult r =
+      storage->ops->page_flags_for_user(storage, cursor->uid, cursor->after_id,
+                                        cursor->page_size, cursor_flag_cb,
+                                        &step);
+  if (r == STORAGE_OK)
+    cursor_finish(&step);
+  return timed(OP_CURSOR_NEXT_FLAGS, start, r);
+}
+
+StorageResult storage_cursor_next_listings(Storage *storage,
+                                           StorageCursor *cursor,
+                                           listing_iter_cb cb, void *ctx) {
+  if (!storage || !cursor || !cb || !cursor->page_size)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  CursorStep step = {.cursor = cursor, .listing_cb = cb, .ctx = ctx};
+  StorageResult r = storage->ops->page_listings_for_user(
+      storage, cursor->uid, cursor->after_id, cursor->page_size,
+      cursor_listing_cb, &step);
+  if (r == STORAGE_OK)
+    cursor_finish(&step);
+  return timed(OP_CURSOR_NEXT_LISTINGS, start, r);
+}
+
+StorageResult storage_set_group_commit(Storage *storage, bool enable) {
+  if (!storage)
+    return STORAGE_INVALID;
+  StorageResult r = enable ? STORAGE_OK : storage_batch_commit(storage);
+  storage->group_commit = enable;
+  return r;
+}
+
+size_t storage_batch_pending(const Storage *storage) {
+  return storage && storage->batch_open ? storage->batch_writes : 0;
+}
+
+StorageResult storage_batch_commit(Storage *storage) {
+  if (!storage)
+    return STORAGE_INVALID;
+  if (!storage->batch_open)
+    return STORAGE_OK;
+  storage->batch_open = false;
+  storage->batch_writes = 0;
+  uint64_t start = metrics_now_ns();
+  StorageResult r = storage->ops->batch_commit(storage);
+  return timed(OP_BATCH_COMMIT, start, r);
+}
+
+uint64_t storage_batch_take_parts(Storage *storage) {
+  if (!storage)
+    return 0;
+  if (storage->ops->batch_take_parts)
+    return storage->ops->batch_take_parts(storage);
+  return storage->batch_open ? 1 : 0;
+}
+
+StorageResult storage_batch_commit_parts(Storage *storage, uint64_t *lost) {
+  StorageResult r = storage_batch_commit(storage);
+  if (r == STORAGE_OK)
+    *lost = 0;
+  else if (storage && storage->ops->batch_lost_parts)
+    *lost = storage->ops->batch_lost_parts(storage);
+  else
+    *lost = ~0ULL;
+  return r;
+}
+
+void storage_get_stats(Storage *storage, StorageStats *out) {
+  *out = (StorageStats){0};
+  if (storage)
+    storage->ops->stats(storage, out);
+}
+
+void storage_backup_options_default(StorageBackupOptions *opts) {
+  if (!opts)
+    return;
+  opts->pages_per_step = 256;
+  opts->pause_ms = 10;
+}
+
+void storage_backup_options_from_env(StorageBackupOptions *opts) {
+  if (!opts)
+    return;
+  const char *v;
+  if ((v = getenv("ACADEMY_BANK_BACKUP_PAGES")) && *v)
+    opts->pages_per_step = (int)strtol(v, NULL, 10);
+  if ((v = getenv("ACADEMY_BANK_BACKUP_PAUSE_MS")) && *v)
+    opts->pause_ms = (int)strtol(v, NULL, 10);
+}
+
+bool storage_write_all(int fd, const void *data, size_t len) {
+  const char *p = data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+void storage_pause(int ms) {
+  if (ms <= 0)
+    return;
+  struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000L};
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+}
+
+StorageResult storage_snapshot_to_fd(Storage *storage, int fd,
+                                     const StorageBackupOptions *opts) {
+  if (!storage || fd < 0 || !opts || opts->pages_per_step <= 0 ||
+      opts->pause_ms < 0)
+    return STORAGE_INVALID;
+  StorageResult r = storage_batch_commit(storage);
+  if (r != STORAGE_OK)
+    return r;
+  if (!storage->ops->snapshot)
+    return STORAGE_INVALID;
+  uint64_t start = metrics_now_ns();
+  r = storage->ops->snapshot(storage, fd, opts);
+  return timed(OP_SNAPSHOT, start, r);
+}
+
+StorageResult storage_backup_to_file(Storage *storage, const char *dest_path,
+                                     const StorageBackupOptions *opts) {
+  if (!storage || !dest_path || !*dest_path)
+    return STORAGE_INVALID;
+  if (storage->ops->backup_to_file) {
+    StorageResult r = storage_batch_commit(storage);
+    return r == STORAGE_OK ? storage->ops->backup_to_file(storage, dest_path,
+                                                           opts)
+                           : r;
+  }
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.backup", dest_path) >= (int)sizeof(tmp))
+    return STORAGE_INVALID;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return STORAGE_ERR;
+  StorageResult r = storage_snapshot_to_fd(storage, fd, opts);
+  if (r == STORAGE_OK && fsync(fd) != 0)
+    r = STORAGE_ERR;
+  if (close(fd) != 0 && r == STORAGE_OK)
+    r = STORAGE_ERR;
+  if (r == STORAGE_OK && rename(tmp, dest_path) != 0)
+    r = STORAGE_ERR;
+  if (r != STORAGE_OK)
+    unlink(tmp);
+  return r;
+}
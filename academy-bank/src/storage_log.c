@@ -0,0 +1,1211 @@
+#define _DEFAULT_SOURCE
+
+#include "storage.h"
+
+#include "storage_backend.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Append-only record log. The file is a LogHeader followed by fixed-size
+// LogRecords; a record is a full new version of a User, Flag or Listing, or a
+// tombstone for one. Everything up to header.tail is committed, so writers
+// append past the tail and publish a transaction by moving it. Readers keep
+// in-memory hash indexes over the mapping and replay whatever was appended
+// since they last looked, which is also how other processes' writes show up.
+//
+// Processes sharing a file serialize on flock: shared for reads, exclusive
+// for writes. Once more than half the records are dead, the writer rewrites
+// the live ones into a fresh file, renames it over the old one and marks the
+// old header retired so other processes reopen the path.
+
+#define LOG_MAGIC "ABLOG001"
+#define LOG_INITIAL_SIZE (1u << 20)
+#define LOG_COMPACT_MIN_RECORDS 4096
+#define NAME_EMPTY 0
+#define NAME_TOMBSTONE UINT64_MAX
+
+typedef enum { LOG_USER, LOG_FLAG, LOG_LISTING, LOG_KINDS } LogKind;
+
+enum { LOG_PUT = 1, LOG_DELETE = 2 };
+
+typedef struct {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t retired;
+  uint64_t tail;
+  uint64_t last_id[LOG_KINDS];
+  uint8_t reserved[16];
+} LogHeader;
+
+// The id is the first member of every record type, so body.id names the
+// record whatever its kind.
+typedef struct {
+  uint8_t kind;
+  uint8_t op;
+  uint16_t reserved;
+  uint32_t check;
+  union {
+    uint64_t id;
+    User user;
+    Flag flag;
+    Listing listing;
+  } body;
+} LogRecord;
+
+_Static_assert(sizeof(LogHeader) == 64, "log header layout");
+_Static_assert(offsetof(User, uid) == 0 && offsetof(Flag, id) == 0 &&
+                   offsetof(Listing, id) == 0,
+               "record ids lead their structs");
+
+// Open-addressed uint64 -> uint64 map. Key 0 marks an empty slot and
+// UINT64_MAX a deleted one; ids start at 1 and never reach it.
+typedef struct {
+  uint64_t *keys;
+  uint64_t *vals;
+  size_t cap;
+  size_t used;
+} IdMap;
+
+// Sorted ids of the children of one parent (flags of a user, listings of a
+// flag), kept in an IdMap keyed by the parent id.
+typedef struct {
+  uint64_t *ids;
+  size_t len;
+  size_t cap;
+} IdVec;
+
+typedef struct {
+  Storage base;
+  char *path; // NULL for an anonymous in-memory log
+  int fd;
+  bool sync;
+  uint8_t *map;
+  size_t map_len;
+  uint64_t applied; // bytes of records replayed into the indexes
+  uint64_t pending; // end of records appended by the open transaction
+  bool in_batch;    // group commit: write lock held, tail not yet moved
+  uint64_t staged;  // end of records committed inside the batch
+  uint64_t live;    // records currently referenced by an index
+  IdMap offsets[LOG_KINDS];
+  IdMap flags_by_uid;
+  IdMap listings_by_fid;
+  uint64_t *names; // open-addressed uids, probed by user name
+  size_t names_cap;
+  size_t names_used;
+  // Page snapshots, kept between calls so iterating does not allocate once
+  // they have grown to the largest page seen.
+  Flag *page_flags;
+  size_t page_flags_cap;
+  Listing *page_listings;
+  size_t page_listings_cap;
+} LogStorage;
+
+static uint64_t hash_u64(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static uint64_t hash_name(const char *name) {
+  uint64_t h = 1469598103934665603ULL;
+  for (size_t i = 0; i < NAME_SZ && name[i]; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static uint32_t record_check(const LogRecord *rec) {
+  uint32_t h = 2166136261u;
+  const uint8_t *p = (const uint8_t *)rec;
+  for (size_t i = 0; i < sizeof(*rec); i++) {
+    if (i >= offsetof(LogRecord, check) &&
+        i < offsetof(LogRecord, check) + sizeof(rec->check))
+      continue;
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool idmap_reserve(IdMap *m, size_t want) {
+  if ((m->used + want) * 10 < m->cap * 7)
+    return true;
+  size_t live = 0;
+  for (size_t i = 0; i < m->cap; i++)
+    live += m->keys[i] && m->keys[i] != UINT64_MAX;
+  size_t cap = m->cap ? m->cap : 64;
+  while ((live + want) * 10 >= cap * 5)
+    cap *= 2;
+  uint64_t *keys = calloc(cap, sizeof(uint64_t));
+  uint64_t *vals = calloc(cap, sizeof(uint64_t));
+  if (!keys || !vals) {
+    free(keys);
+    free(vals);
+    return false;
+  }
+  for (size_t i = 0; i < m->cap; i++) {
+    uint64_t k = m->keys[i];
+    if (!k || k == UINT64_MAX)
+      continue;
+    size_t j = hash_u64(k) & (cap - 1);
+    while (keys[j])
+      j = (j + 1) & (cap - 1);
+    keys[j] = k;
+    vals[j] = m->vals[i];
+  }
+  free(m->keys);
+  free(m->vals);
+  m->keys = keys;
+  m->vals = vals;
+  m->cap = cap;
+  m->used = live;
+  return true;
+}
+
+static uint64_t *idmap_find(const IdMap *m, uint64_t key) {
+  if (!m->cap)
+    return NULL;
+  for (size_t i = hash_u64(key) & (m->cap - 1);; i = (i + 1) & (m->cap - 1)) {
+    if (m->keys[i] == key)
+      return &m->vals[i];
+    if (!m->keys[i])
+      return NULL;
+  }
+}
+
+static bool idmap_put(IdMap *m, uint64_t key, uint64_t val) {
+  uint64_t *slot = idmap_find(m, key);
+  if (slot) {
+    *slot = val;
+    return true;
+  }
+  if (!idmap_reserve(m, 1))
+    return false;
+  size_t i = hash_u64(key) & (m->cap - 1);
+  while (m->keys[i] && m->keys[i] != UINT64_MAX)
+    i = (i + 1) & (m->cap - 1);
+  m->used += !m->keys[i];
+  m->keys[i] = key;
+  m->vals[i] = val;
+  return true;
+}
+
+static void idmap_del(IdMap *m, uint64_t key) {
+  uint64_t *slot = idmap_find(m, key);
+  if (slot)
+    m->keys[slot - m->vals] = UINT64_MAX;
+}
+
+static void idmap_free(IdMap *m) {
+  free(m->keys);
+  free(m->vals);
+  memset(m, 0, sizeof(*m));
+}
+
+static bool children_add(IdMap *m, uint64_t parent, uint64_t id) {
+  uint64_t *slot = idmap_find(m, parent);
+  IdVec *v = slot ? (IdVec *)(uintptr_t)*slot : NULL;
+  if (!v) {
+    if (!(v = calloc(1, sizeof(IdVec))) ||
+        !idmap_put(m, parent, (uint64_t)(uintptr_t)v)) {
+      free(v);
+      return false;
+    }
+  }
+  if (v->len == v->cap) {
+    size_t cap = v->cap ? v->cap * 2 : 4;
+    uint64_t *ids = realloc(v->ids, cap * sizeof(uint64_t));
+    if (!ids)
+      return false;
+    v->ids = ids;
+    v->cap = cap;
+  }
+  size_t at = v->len;
+  while (at > 0 && v->ids[at - 1] > id)
+    at--;
+  memmove(&v->ids[at + 1], &v->ids[at], (v->len - at) * sizeof(uint64_t));
+  v->ids[at] = id;
+  v->len++;
+  return true;
+}
+
+static void children_remove(IdMap *m, uint64_t parent, uint64_t id) {
+  uint64_t *slot = idmap_find(m, parent);
+  if (!slot)
+    return;
+  IdVec *v = (IdVec *)(uintptr_t)*slot;
+  for (size_t i = 0; i < v->len; i++) {
+    if (v->ids[i] == id) {
+      memmove(&v->ids[i], &v->ids[i + 1], (v->len - i - 1) * sizeof(uint64_t));
+      v->len--;
+      break;
+    }
+  }
+  if (v->len == 0) {
+    free(v->ids);
+    free(v);
+    idmap_del(m, parent);
+  }
+}
+
+static const IdVec *children_of(const IdMap *m, uint64_t parent) {
+  uint64_t *slot = idmap_find(m, parent);
+  return slot ? (const IdVec *)(uintptr_t)*slot : NULL;
+}
+
+static void children_free(IdMap *m) {
+  for (size_t i = 0; i < m->cap; i++) {
+    if (m->keys[i] && m->keys[i] != UINT64_MAX) {
+      IdVec *v = (IdVec *)(uintptr_t)m->vals[i];
+      free(v->ids);
+      free(v);
+    }
+  }
+  idmap_free(m);
+}
+
+static LogHeader *log_header(LogStorage *s) { return (LogHeader *)s->map; }
+
+static LogRecord *record_at(LogStorage *s, uint64_t off) {
+  return (LogRecord *)(s->map + sizeof(LogHeader) + off);
+}
+
+// Latest version of a live record, or NULL.
+static const LogRecord *lookup(LogStorage *s, LogKind kind, uint64_t id) {
+  uint64_t *off = idmap_find(&s->offsets[kind], id);
+  return off ? record_at(s, *off) : NULL;
+}
+
+static uint64_t *name_find(LogStorage *s, const char *name) {
+  if (!s->names_cap)
+    return NULL;
+  size_t mask = s->names_cap - 1;
+  for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+    uint64_t uid = s->names[i];
+    if (uid == NAME_EMPTY)
+      return NULL;
+    if (uid == NAME_TOMBSTONE)
+      continue;
+    const LogRecord *rec = lookup(s, LOG_USER, uid);
+    if (rec && strncmp(rec->body.user.name, name, NAME_SZ) == 0)
+      return &s->names[i];
+  }
+}
+
+static void name_place(uint64_t *names, size_t cap, const char *name,
+                       uint64_t uid) {
+  size_t i = hash_name(name) & (cap - 1);
+  while (names[i] != NAME_EMPTY && names[i] != NAME_TOMBSTONE)
+    i = (i + 1) & (cap - 1);
+  names[i] = uid;
+}
+
+static bool name_insert(LogStorage *s, const char *name, uint64_t uid) {
+  if ((s->names_used + 1) * 10 >= s->names_cap * 7) {
+    size_t cap = s->names_cap ? s->names_cap : 64;
+    while ((s->offsets[LOG_USER].used + 1) * 10 >= cap * 5)
+      cap *= 2;
+    uint64_t *names = calloc(cap, sizeof(uint64_t));
+    if (!names)
+      return false;
+    size_t used = 0;
+    for (size_t i = 0; i < s->names_cap; i++) {
+      uint64_t old = s->names[i];
+      const LogRecord *rec = old != NAME_EMPTY && old != NAME_TOMBSTONE
+                                 ? lookup(s, LOG_USER, old)
+                                 : NULL;
+      if (rec) {
+        name_place(names, cap, rec->body.user.name, old);
+        used++;
+      }
+    }
+    free(s->names);
+    s->names = names;
+    s->names_cap = cap;
+    s->names_used = used;
+  }
+  size_t i = hash_name(name) & (s->names_cap - 1);
+  while (s->names[i] != NAME_EMPTY && s->names[i] != NAME_TOMBSTONE)
+    i = (i + 1) & (s->names_cap - 1);
+  s->names_used += s->names[i] == NAME_EMPTY;
+  s->names[i] = uid;
+  return true;
+}
+
+static void name_remove(LogStorage *s, const char *name) {
+  uint64_t *slot = name_find(s, name);
+  if (slot)
+    *slot = NAME_TOMBSTONE;
+}
+
+// Folds the record at off into the indexes. Cascades are written out as
+// explicit tombstones, so this never has to chase children.
+static bool apply_record(LogStorage *s, uint64_t off) {
+  const LogRecord *rec = record_at(s, off);
+  if (rec->kind >= LOG_KINDS || record_check(rec) != rec->check)
+    return false;
+  LogKind kind = (LogKind)rec->kind;
+  uint64_t id = rec->body.id;
+  const LogRecord *old = lookup(s, kind, id);
+
+  if (kind == LOG_USER && old)
+    name_remove(s, old->body.user.name);
+  if (kind == LOG_FLAG && old)
+    children_remove(&s->flags_by_uid, old->body.flag.uid, id);
+  if (kind == LOG_LISTING && old)
+    children_remove(&s->listings_by_fid, old->body.listing.fid, id);
+
+  if (rec->op == LOG_DELETE) {
+    if (old) {
+      idmap_del(&s->offsets[kind], id);
+      s->live--;
+    }
+    return true;
+  }
+  if (!idmap_put(&s->offsets[kind], id, off))
+    return false;
+  s->live += !old;
+  switch (kind) {
+  case LOG_USER:
+    return name_insert(s, rec->body.user.name, id);
+  case LOG_FLAG:
+    return children_add(&s->flags_by_uid, rec->body.flag.uid, id);
+  case LOG_LISTING:
+    return children_add(&s->listings_by_fid, rec->body.listing.fid, id);
+  default:
+    return false;
+  }
+}
+
+static void reset_indexes(LogStorage *s) {
+  for (int k = 0; k < LOG_KINDS; k++)
+    idmap_free(&s->offsets[k]);
+  children_free(&s->flags_by_uid);
+  children_free(&s->listings_by_fid);
+  free(s->names);
+  s->names = NULL;
+  s->names_cap = s->names_used = 0;
+  s->applied = s->live = 0;
+}
+
+// Everything up to here is committed. Inside a batch that includes records
+// not yet published through the header.
+static uint64_t committed_tail(LogStorage *s) {
+  return s->in_batch ? s->staged : log_header(s)->tail;
+}
+
+static StorageResult replay(LogStorage *s) {
+  uint64_t tail = committed_tail(s);
+  for (; s->applied < tail; s->applied += sizeof(LogRecord)) {
+    if (!apply_record(s, s->applied))
+      return STORAGE_ERR;
+  }
+  return STORAGE_OK;
+}
+
+static StorageResult map_file(LogStorage *s) {
+  struct stat st;
+  if (fstat(s->fd, &st) != 0 || (size_t)st.st_size < sizeof(LogHeader))
+    return STORAGE_ERR;
+  if (s->map)
+    munmap(s->map, s->map_len);
+  s->map_len = (size_t)st.st_size;
+  s->map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+  if (s->map == MAP_FAILED) {
+    s->map = NULL;
+    return STORAGE_ERR;
+  }
+  return STORAGE_OK;
+}
+
+static void init_header(LogHeader *h) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, LOG_MAGIC, sizeof(h->magic));
+  h->record_size = sizeof(LogRecord);
+}
+
+static bool header_ok(const LogHeader *h, size_t map_len) {
+  return memcmp(h->magic, LOG_MAGIC, sizeof(h->magic)) == 0 &&
+         h->record_size == sizeof(LogRecord) &&
+         h->tail % sizeof(LogRecord) == 0 &&
+         sizeof(LogHeader) + h->tail <= map_len;
+}
+
+// Opens (or creates) the file at s->path, takes the lock with op and rebuilds
+// the indexes. Retired files left behind by another process's compaction are
+// skipped by reopening the path.
+static StorageResult open_file(LogStorage *s, int op) {
+  for (;;) {
+    if (s->fd >= 0)
+      close(s->fd);
+    s->fd = open(s->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (s->fd < 0 || flock(s->fd, op) != 0)
+      return STORAGE_ERR;
+    struct stat st;
+    if (fstat(s->fd, &st) != 0)
+      return STORAGE_ERR;
+    if (st.st_size == 0) {
+      // Only the creator sees an empty file; take the write lock to set it up.
+      LogHeader h;
+      init_header(&h);
+      if (flock(s->fd, LOCK_EX) != 0)
+        return STORAGE_ERR;
+      if (fstat(s->fd, &st) == 0 && st.st_size == 0 &&
+          (pwrite(s->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+           ftruncate(s->fd, LOG_INITIAL_SIZE) != 0))
+        return STORAGE_ERR;
+      if (flock(s->fd, op) != 0)
+        return STORAGE_ERR;
+    }
+    if (map_file(s) != STORAGE_OK || !header_ok(log_header(s), s->map_len))
+      return STORAGE_ERR;
+    if (!log_header(s)->retired)
+      break;
+  }
+  reset_indexes(s);
+  return replay(s);
+}
+
+// Takes the file lock and catches the indexes up with the log. A batch holds
+// the write lock throughout, so nothing else can have written meanwhile.
+static StorageResult log_lock(LogStorage *s, int op) {
+  if (!s->path || s->in_batch)
+    return STORAGE_OK;
+  if (flock(s->fd, op) != 0)
+    return STORAGE_ERR;
+  if (log_header(s)->retired)
+    return open_file(s, op);
+  if (sizeof(LogHeader) + log_header(s)->tail > s->map_len &&
+      map_file(s) != STORAGE_OK)
+    return STORAGE_ERR;
+  return replay(s);
+}
+
+static void log_unlock(LogStorage *s) {
+  if (s->path && !s->in_batch)
+    flock(s->fd, LOCK_UN);
+}
+
+static StorageResult grow(LogStorage *s, size_t need) {
+  size_t len = s->map_len;
+  while (len < need)
+    len *= 2;
+  if (s->path) {
+    // Another process may already have grown the file past our mapping.
+    struct stat st;
+    if (fstat(s->fd, &st) != 0)
+      return STORAGE_ERR;
+    if ((size_t)st.st_size < len && ftruncate(s->fd, (off_t)len) != 0)
+      return STORAGE_ERR;
+    return map_file(s);
+  }
+  uint8_t *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return STORAGE_ERR;
+  memcpy(map, s->map, sizeof(LogHeader) + s->pending);
+  munmap(s->map, s->map_len);
+  s->map = map;
+  s->map_len = len;
+  return STORAGE_OK;
+}
+
+static void tx_begin(LogStorage *s) { s->pending = committed_tail(s); }
+
+static StorageResult tx_append(LogStorage *s, LogKind kind, int op,
+                               const void *body, size_t len) {
+  size_t need = sizeof(LogHeader) + s->pending + sizeof(LogRecord);
+  if (need > s->map_len && grow(s, need) != STORAGE_OK)
+    return STORAGE_ERR;
+  LogRecord *rec = record_at(s, s->pending);
+  memset(rec, 0, sizeof(*rec));
+  rec->kind = (uint8_t)kind;
+  rec->op = (uint8_t)op;
+  memcpy(&rec->body, body, len);
+  rec->check = record_check(rec);
+  s->pending += sizeof(LogRecord);
+  return STORAGE_OK;
+}
+
+static StorageResult tx_delete(LogStorage *s, LogKind kind, uint64_t id) {
+  return tx_append(s, kind, LOG_DELETE, &id, sizeof(id));
+}
+
+static void sync_range(LogStorage *s, uint64_t from, uint64_t to) {
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)s->map + from;
+  uintptr_t aligned = start & ~(uintptr_t)(page - 1);
+  msync((void *)aligned, (size_t)(to - (aligned - (uintptr_t)s->map)),
+        MS_SYNC);
+}
+
+static StorageResult compact(LogStorage *s);
+
+// Publishes the records up to end by moving the tail, then applies them.
+static StorageResult publish(LogStorage *s, uint64_t end) {
+  LogHeader *h = log_header(s);
+  if (s->sync && s->path)
+    sync_range(s, sizeof(LogHeader) + h->tail, sizeof(LogHeader) + end);
+  h->tail = end;
+  if (s->sync && s->path)
+    sync_range(s, 0, sizeof(LogHeader));
+  StorageResult r = replay(s);
+  uint64_t records = s->applied / sizeof(LogRecord);
+  if (r == STORAGE_OK && records >= LOG_COMPACT_MIN_RECORDS &&
+      records - s->live > s->live)
+    r = compact(s);
+  return r;
+}
+
+// Inside a batch the records only become visible to this handle; the batch
+// commit publishes them all with one sync.
+static StorageResult tx_commit(LogStorage *s) {
+  if (!s->in_batch)
+    return publish(s, s->pending);
+  s->staged = s->pending;
+  return replay(s);
+}
+
+static StorageResult copy_live(LogStorage *s, uint8_t *map) {
+  LogRecord *out = (LogRecord *)(map + sizeof(LogHeader));
+  for (int k = 0; k < LOG_KINDS; k++) {
+    const IdMap *m = &s->offsets[k];
+    for (size_t i = 0; i < m->cap; i++) {
+      if (m->keys[i] && m->keys[i] != UINT64_MAX)
+        *out++ = *record_at(s, m->vals[i]);
+    }
+  }
+  init_header((LogHeader *)map);
+  memcpy(((LogHeader *)map)->last_id, log_header(s)->last_id,
+         sizeof(log_header(s)->last_id));
+  ((LogHeader *)map)->tail = s->live * sizeof(LogRecord);
+  return STORAGE_OK;
+}
+
+// Rewrites the live records into a fresh log. Called with the write lock
+// held; for files the new log replaces the old one by rename.
+static StorageResult compact(LogStorage *s) {
+  size_t len = LOG_INITIAL_SIZE;
+  while (len < sizeof(LogHeader) + s->live * sizeof(LogRecord) * 2)
+    len *= 2;
+  if (!s->path) {
+    uint8_t *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+      return STORAGE_ERR;
+    copy_live(s, map);
+    munmap(s->map, s->map_len);
+    s->map = map;
+    s->map_len = len;
+    reset_indexes(s);
+    return replay(s);
+  }
+
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.compact", s->path) >= (int)sizeof(tmp))
+    return STORAGE_OK;
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return STORAGE_OK;
+  // Hold the new log's write lock from before it becomes visible at path
+  // until the caller's log_unlock.
+  uint8_t *map = MAP_FAILED;
+  if (flock(fd, LOCK_EX) == 0 && ftruncate(fd, (off_t)len) == 0)
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    unlink(tmp);
+    return STORAGE_OK;
+  }
+  copy_live(s, map);
+  // Losing the new log after the rename would lose everything, so it is
+  // synced whatever the synchronous setting.
+  if (msync(map, len, MS_SYNC) != 0 || rename(tmp, s->path) != 0) {
+    munmap(map, len);
+    close(fd);
+    unlink(tmp);
+    return STORAGE_OK;
+  }
+  log_header(s)->retired = 1;
+  munmap(s->map, s->map_len);
+  close(s->fd);
+  s->map = map;
+  s->map_len = len;
+  s->fd = fd;
+  reset_indexes(s);
+  return replay(s);
+}
+
+static void copy_text(char *dst, const char *src, size_t size) {
+  size_t n = strnlen(src, size - 1);
+  memcpy(dst, src, n);
+  memset(dst + n, 0, size - n);
+}
+
+// Records are stored the way the SQLite backend reads them back: text
+// fields truncated to their buffer and zero padded.
+static User normalize_user(const User *u) {
+  User out = *u;
+  copy_text(out.name, u->name, sizeof(out.name));
+  copy_text(out.password, u->password, sizeof(out.password));
+  return out;
+}
+
+static Flag normalize_flag(const Flag *f) {
+  Flag out = *f;
+  copy_text(out.secret, f->secret, sizeof(out.secret));
+  return out;
+}
+
+static Listing normalize_listing(const Listing *l) {
+  Listing out = *l;
+  copy_text(out.note, l->note, sizeof(out.note));
+  return out;
+}
+
+static LogStorage *log_of(Storage *base) { return (LogStorage *)base; }
+
+static StorageResult finish_write(LogStorage *s, StorageResult r) {
+  if (r == STORAGE_OK)
+    r = tx_commit(s);
+  log_unlock(s);
+  return r;
+}
+
+static void log_close(Storage *base) {
+  LogStorage *s = log_of(base);
+  reset_indexes(s);
+  if (s->map)
+    munmap(s->map, s->map_len);
+  if (s->fd >= 0)
+    close(s->fd);
+  free(s->page_flags);
+  free(s->page_listings);
+  free(s->path);
+  free(s);
+}
+
+static StorageResult log_user_get_by_id(Storage *base, uint64_t uid,
+                                        User *out_user) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_SH);
+  if (r == STORAGE_OK) {
+    const LogRecord *rec = lookup(s, LOG_USER, uid);
+    if (rec)
+      *out_user = rec->body.user;
+    r = rec ? STORAGE_OK : STORAGE_NOT_FOUND;
+  }
+  log_unlock(s);
+  return r;
+}
+
+static StorageResult log_user_get_by_name(Storage *base, const char *name,
+                                          User *out_user) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_SH);
+  if (r == STORAGE_OK) {
+    uint64_t *slot = strnlen(name, NAME_SZ) < NAME_SZ ? name_find(s, name)
+                                                      : NULL;
+    if (slot)
+      *out_user = lookup(s, LOG_USER, *slot)->body.user;
+    r = slot ? STORAGE_OK : STORAGE_NOT_FOUND;
+  }
+  log_unlock(s);
+  return r;
+}
+
+static StorageResult log_user_insert(Storage *base, const User *user,
+                                     User *out_user) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK) {
+    log_unlock(s);
+    return r;
+  }
+  User u = normalize_user(user);
+  if (name_find(s, u.name)) {
+    log_unlock(s);
+    return STORAGE_CONFLICT;
+  }
+  u.uid = ++log_header(s)->last_id[LOG_USER];
+  tx_begin(s);
+  r = finish_write(s, tx_append(s, LOG_USER, LOG_PUT, &u, sizeof(u)));
+  if (r == STORAGE_OK && out_user) {
+    *out_user = *user;
+    out_user->uid = u.uid;
+  }
+  return r;
+}
+
+static StorageResult log_user_update(Storage *base, const User *user) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK) {
+    log_unlock(s);
+    return r;
+  }
+  User u = normalize_user(user);
+  uint64_t *owner = name_find(s, u.name);
+  if (!lookup(s, LOG_USER, u.uid))
+    r = STORAGE_NOT_FOUND;
+  else if (owner && *owner != u.uid)
+    r = STORAGE_CONFLICT;
+  if (r != STORAGE_OK) {
+    log_unlock(s);
+    return r;
+  }
+  tx_begin(s);
+  return finish_write(s, tx_append(s, LOG_USER, LOG_PUT, &u, sizeof(u)));
+}
+
+// Appends tombstones for the listings of flag fid.
+static StorageResult delete_listings_of(LogStorage *s, uint64_t fid) {
+  const IdVec *listings = children_of(&s->listings_by_fid, fid);
+  for (size_t i = 0; listings && i < listings->len; i++) {
+    if (tx_delete(s, LOG_LISTING, listings->ids[i]) != STORAGE_OK)
+      return STORAGE_ERR;
+  }
+  return STORAGE_OK;
+}
+
+static StorageResult log_user_delete_by_id(Storage *base, uint64_t uid) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK || !lookup(s, LOG_USER, uid)) {
+    log_unlock(s);
+    return r != STORAGE_OK ? r : STORAGE_NOT_FOUND;
+  }
+  tx_begin(s);
+  const IdVec *flags = children_of(&s->flags_by_uid, uid);
+  for (size_t i = 0; flags && i < flags->len && r == STORAGE_OK; i++) {
+    r = delete_listings_of(s, flags->ids[i]);
+    if (r == STORAGE_OK)
+      r = tx_delete(s, LOG_FLAG, flags->ids[i]);
+  }
+  if (r == STORAGE_OK)
+    r = tx_delete(s, LOG_USER, uid);
+  return finish_write(s, r);
+}
+
+static StorageResult log_flag_get_by_id(Storage *base, uint64_t id,
+                                        Flag *out_flag) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_SH);
+  if (r == STORAGE_OK) {
+    const LogRecord *rec = lookup(s, LOG_FLAG, id);
+    if (rec)
+      *out_flag = rec->body.flag;
+    r = rec ? STORAGE_OK : STORAGE_NOT_FOUND;
+  }
+  log_unlock(s);
+  return r;
+}
+
+// Index of the first id in v greater than after_id.
+static size_t ids_after(const IdVec *v, uint64_t after_id) {
+  size_t lo = 0, hi = v->len;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (v->ids[mid] <= after_id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Grows a page snapshot to hold n records of size bytes. Returns the buffer,
+// or NULL with buf left as it was.
+static void *page_reserve(void *buf, size_t *cap, size_t n, size_t size) {
+  if (n <= *cap)
+    return buf;
+  size_t grown_cap = *cap ? *cap : 16;
+  while (grown_cap < n)
+    grown_cap *= 2;
+  void *grown = realloc(buf, grown_cap * size);
+  if (grown)
+    *cap = grown_cap;
+  return grown;
+}
+
+// Iterators copy the matching records out and drop the lock before running
+// callbacks, so a callback may call back into storage.
+static StorageResult log_page_flags_for_user(Storage *base, uint64_t uid,
+                                             uint64_t after_id, size_t limit,
+                                             flag_iter_cb cb, void *ctx) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_SH);
+  Flag *flags = s->page_flags;
+  size_t n = 0, first = 0, count = 0;
+  const IdVec *ids = r == STORAGE_OK ? children_of(&s->flags_by_uid, uid)
+                                     : NULL;
+  if (ids) {
+    first = ids_after(ids, after_id);
+    count = ids->len - first;
+    if (limit && count > limit)
+      count = limit;
+  }
+  if (count && !(flags = page_reserve(flags, &s->page_flags_cap, count,
+                                      sizeof(Flag))))
+    r = STORAGE_ERR;
+  else
+    s->page_flags = flags;
+  for (; flags && n < count; n++)
+    flags[n] = lookup(s, LOG_FLAG, ids->ids[first + n])->body.flag;
+  log_unlock(s);
+  for (size_t i = 0; r == STORAGE_OK && i < n; i++) {
+    if (cb(&flags[i], ctx))
+      break;
+  }
+  return r;
+}
+
+static StorageResult log_flag_insert(Storage *base, const Flag *flag,
+                                     Flag *out_flag) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK || !lookup(s, LOG_USER, flag->uid)) {
+    log_unlock(s);
+    return r != STORAGE_OK ? r : STORAGE_CONFLICT;
+  }
+  Flag f = normalize_flag(flag);
+  f.id = ++log_header(s)->last_id[LOG_FLAG];
+  tx_begin(s);
+  r = finish_write(s, tx_append(s, LOG_FLAG, LOG_PUT, &f, sizeof(f)));
+  if (r == STORAGE_OK && out_flag) {
+    *out_flag = *flag;
+    out_flag->id = f.id;
+  }
+  return r;
+}
+
+static StorageResult log_flag_update(Storage *base, const Flag *flag) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r == STORAGE_OK && !lookup(s, LOG_FLAG, flag->id))
+    r = STORAGE_NOT_FOUND;
+  else if (r == STORAGE_OK && !lookup(s, LOG_USER, flag->uid))
+    r = STORAGE_CONFLICT;
+  if (r != STORAGE_OK) {
+    log_unlock(s);
+    return r;
+  }
+  Flag f = normalize_flag(flag);
+  tx_begin(s);
+  return finish_write(s, tx_append(s, LOG_FLAG, LOG_PUT, &f, sizeof(f)));
+}
+
+static StorageResult log_flag_delete_by_id(Storage *base, uint64_t id) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK || !lookup(s, LOG_FLAG, id)) {
+    log_unlock(s);
+    return r != STORAGE_OK ? r : STORAGE_NOT_FOUND;
+  }
+  tx_begin(s);
+  r = delete_listings_of(s, id);
+  if (r == STORAGE_OK)
+    r = tx_delete(s, LOG_FLAG, id);
+  return finish_write(s, r);
+}
+
+static StorageResult log_listing_get_by_id(Storage *base, uint64_t id,
+                                           Listing *out_listing) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_SH);
+  if (r == STORAGE_OK) {
+    const LogRecord *rec = lookup(s, LOG_LISTING, id);
+    if (rec)
+      *out_listing = rec->body.listing;
+    r = rec ? STORAGE_OK : STORAGE_NOT_FOUND;
+  }
+  log_unlock(s);
+  return r;
+}
+
+static int listing_cmp(const void *a, const void *b) {
+  uint64_t x = ((const Listing *)a)->id, y = ((const Listing *)b)->id;
+  return (x > y) - (x < y);
+}
+
+// A user's listings hang off their flags, so a page is cut from the whole
+// set after sorting it; users hold few listings compared to flags.
+static StorageResult log_page_listings_for_user(Storage *base, uint64_t uid,
+                                                uint64_t after_id, size_t limit,
+                                                listing_iter_cb cb,
+                                                void *ctx) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_SH);
+  Listing *listings = s->page_listings;
+  size_t n = 0;
+  const IdVec *flags = r == STORAGE_OK ? children_of(&s->flags_by_uid, uid)
+                                       : NULL;
+  for (size_t i = 0; flags && i < flags->len && r == STORAGE_OK; i++) {
+    const IdVec *ids = children_of(&s->listings_by_fid, flags->ids[i]);
+    for (size_t j = 0; ids && j < ids->len; j++) {
+      if (ids->ids[j] <= after_id)
+        continue;
+      if (n == s->page_listings_cap) {
+        Listing *grown = page_reserve(listings, &s->page_listings_cap, n + 1,
+                                      sizeof(Listing));
+        if (!grown) {
+          r = STORAGE_ERR;
+          break;
+        }
+        listings = s->page_listings = grown;
+      }
+      listings[n++] = lookup(s, LOG_LISTING, ids->ids[j])->body.listing;
+    }
+  }
+  log_unlock(s);
+  if (n > 1)
+    qsort(listings, n, sizeof(Listing), listing_cmp);
+  if (limit && n > limit)
+    n = limit;
+  for (size_t i = 0; r == STORAGE_OK && i < n; i++) {
+    if (cb(&listings[i], ctx))
+      break;
+  }
+  return r;
+}
+
+static StorageResult log_listing_insert(Storage *base, const Listing *listing,
+                                        Listing *out_listing) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK || !lookup(s, LOG_FLAG, listing->fid)) {
+    log_unlock(s);
+    return r != STORAGE_OK ? r : STORAGE_CONFLICT;
+  }
+  Listing l = normalize_listing(listing);
+  l.id = ++log_header(s)->last_id[LOG_LISTING];
+  tx_begin(s);
+  r = finish_write(s, tx_append(s, LOG_LISTING, LOG_PUT, &l, sizeof(l)));
+  if (r == STORAGE_OK && out_listing) {
+    *out_listing = *listing;
+    out_listing->id = l.id;
+  }
+  return r;
+}
+
+static StorageResult log_listing_update(Storage *base,
+                                        const Listing *listing) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r == STORAGE_OK && !lookup(s, LOG_LISTING, listing->id))
+    r = STORAGE_NOT_FOUND;
+  else if (r == STORAGE_OK && !lookup(s, LOG_FLAG, listing->fid))
+    r = STORAGE_CONFLICT;
+  if (r != STORAGE_OK) {
+    log_unlock(s);
+    return r;
+  }
+  Listing l = normalize_listing(listing);
+  tx_begin(s);
+  return finish_write(s, tx_append(s, LOG_LISTING, LOG_PUT, &l, sizeof(l)));
+}
+
+static StorageResult log_listing_delete_by_id(Storage *base, uint64_t id) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK || !lookup(s, LOG_LISTING, id)) {
+    log_unlock(s);
+    return r != STORAGE_OK ? r : STORAGE_NOT_FOUND;
+  }
+  tx_begin(s);
+  return finish_write(s, tx_delete(s, LOG_LISTING, id));
+}
+
+// Same checks and effects as the SQLite purchase transaction; the records
+// are appended together and published by a single tail update.
+static StorageResult log_purchase_listing(Storage *base, uint64_t listing_id,
+                                          uint64_t buyer_uid, uint64_t price,
+                                          uint64_t fee, Flag *out_flag) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK) {
+    log_unlock(s);
+    return r;
+  }
+  const LogRecord *lrec = lookup(s, LOG_LISTING, listing_id);
+  const LogRecord *frec =
+      lrec && lrec->body.listing.price == price
+          ? lookup(s, LOG_FLAG, lrec->body.listing.fid)
+          : NULL;
+  const LogRecord *brec = lookup(s, LOG_USER, buyer_uid);
+  const LogRecord *srec = frec ? lookup(s, LOG_USER, frec->body.flag.uid)
+                               : NULL;
+  if (!frec || !brec || !srec) {
+    log_unlock(s);
+    return STORAGE_NOT_FOUND;
+  }
+  if (brec->body.user.balance < price) {
+    log_unlock(s);
+    return STORAGE_INSUFFICIENT_FUNDS;
+  }
+
+  // Copy everything out first: appending may remap the log.
+  Listing listing = lrec->body.listing;
+  Flag flag = frec->body.flag;
+  User buyer = brec->body.user;
+  User seller = srec->body.user;
+  buyer.balance -= price;
+  if (seller.uid == buyer.uid)
+    buyer.balance += price - fee;
+  else
+    seller.balance += price - fee;
+  flag.id = ++log_header(s)->last_id[LOG_FLAG];
+  flag.uid = buyer_uid;
+  listing.sale_count++;
+
+  tx_begin(s);
+  r = tx_append(s, LOG_USER, LOG_PUT, &buyer, sizeof(buyer));
+  if (r == STORAGE_OK && seller.uid != buyer.uid)
+    r = tx_append(s, LOG_USER, LOG_PUT, &seller, sizeof(seller));
+  if (r == STORAGE_OK)
+    r = tx_append(s, LOG_FLAG, LOG_PUT, &flag, sizeof(flag));
+  if (r == STORAGE_OK)
+    r = tx_append(s, LOG_LISTING, LOG_PUT, &listing, sizeof(listing));
+  r = finish_write(s, r);
+  if (r == STORAGE_OK && out_flag)
+    *out_flag = flag;
+  return r;
+}
+
+static StorageResult log_batch_begin(Storage *base) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_EX);
+  if (r != STORAGE_OK) {
+    log_unlock(s);
+    return r;
+  }
+  s->staged = log_header(s)->tail;
+  s->in_batch = true;
+  return STORAGE_OK;
+}
+
+static StorageResult log_batch_commit(Storage *base) {
+  LogStorage *s = log_of(base);
+  s->in_batch = false;
+  StorageResult r = STORAGE_OK;
+  if (s->staged != log_header(s)->tail)
+    r = publish(s, s->staged);
+  log_unlock(s);
+  return r;
+}
+
+// The batch's records were never published, but the indexes already point
+// at them, so they are rebuilt from the committed log.
+static StorageResult log_batch_rollback(Storage *base) {
+  LogStorage *s = log_of(base);
+  s->in_batch = false;
+  reset_indexes(s);
+  StorageResult r = replay(s);
+  log_unlock(s);
+  return r;
+}
+
+// Reads go straight to the mapping and writers block on flock, so there is
+// no cache or busy retry to count.
+static void log_stats(Storage *base, StorageStats *out) {
+  (void)base;
+  (void)out;
+}
+
+// Records below the published tail never change, and compaction writes a
+// fresh file instead of touching this one, so the lock is only needed to
+// read the header; the records are copied unlocked from the mapping.
+static StorageResult log_snapshot(Storage *base, int fd,
+                                  const StorageBackupOptions *opts) {
+  LogStorage *s = log_of(base);
+  StorageResult r = log_lock(s, LOCK_SH);
+  LogHeader h = *log_header(s);
+  log_unlock(s);
+  if (r != STORAGE_OK)
+    return r;
+  h.retired = 0;
+  if (!storage_write_all(fd, &h, sizeof(h)))
+    return STORAGE_ERR;
+  const uint8_t *records = s->map + sizeof(LogHeader);
+  size_t step = (size_t)opts->pages_per_step * 4096;
+  for (uint64_t off = 0; off < h.tail; off += step) {
+    if (off)
+      storage_pause(opts->pause_ms);
+    size_t n = h.tail - off < step ? (size_t)(h.tail - off) : step;
+    if (!storage_write_all(fd, records + off, n))
+      return STORAGE_ERR;
+  }
+  return STORAGE_OK;
+}
+
+static const StorageOps LOG_OPS = {
+    .name = "log",
+    .close = log_close,
+    .user_get_by_id = log_user_get_by_id,
+    .user_get_by_name = log_user_get_by_name,
+    .user_insert = log_user_insert,
+    .user_update = log_user_update,
+    .user_delete_by_id = log_user_delete_by_id,
+    .flag_get_by_id = log_flag_get_by_id,
+    .page_flags_for_user = log_page_flags_for_user,
+    .flag_insert = log_flag_insert,
+    .flag_update = log_flag_update,
+    .flag_delete_by_id = log_flag_delete_by_id,
+    .listing_get_by_id = log_listing_get_by_id,
+    .page_listings_for_user = log_page_listings_for_user,
+    .listing_insert = log_listing_insert,
+    .listing_update = log_listing_update,
+    .listing_delete_by_id = log_listing_delete_by_id,
+    .purchase_listing = log_purchase_listing,
+    .batch_begin = log_batch_begin,
+    .batch_commit = log_batch_commit,
+    .batch_rollback = log_batch_rollback,
+    .stats = log_stats,
+    .snapshot = log_snapshot,
+};
+
+StorageResult storage_log_open(const char *path, const StorageOptions *opts,
+                               Storage **out_storage) {
+  LogStorage *s = calloc(1, sizeof(LogStorage));
+  if (!s)
+    return STORAGE_ERR;
+  s->base.ops = &LOG_OPS;
+  s->fd = -1;
+  s->sync = opts->synchronous && (strcasecmp(opts->synchronous, "FULL") == 0 ||
+                                  strcasecmp(opts->synchronous, "EXTRA") == 0);
+  StorageResult r = STORAGE_OK;
+  if (*path && strcmp(path, ":memory:") != 0) {
+    if (!(s->path = strdup(path)))
+      r = STORAGE_ERR;
+    if (r == STORAGE_OK)
+      r = open_file(s, LOCK_SH);
+    log_unlock(s);
+  } else {
+    s->map_len = LOG_INITIAL_SIZE;
+    s->map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s->map == MAP_FAILED) {
+      s->map = NULL;
+      r = STORAGE_ERR;
+    } else {
+      init_header(log_header(s));
+    }
+  }
+  if (r != STORAGE_OK) {
+    log_close(&s->base);
+    return r;
+  }
+  *out_storage = &s->base;
+  return STORAGE_OK;
+}
@@ -0,0 +1,644 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "storage.h"
+
+#include "storage_backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sharded storage. "shard:<n>:<path>" spreads the bank over n databases at
+// <path>.0 ... <path>.<n-1>, each opened like any other storage path, so
+// "shard:4:log:bank.log" shards the log backend. A user lives in the shard
+// its name hashes to, which keeps by-name lookups and the unique name check
+// inside one shard; the user's flags and the listings of those flags live
+// with it. Ids carry their shard: local id l in shard s is known outside as
+// (l - 1) * n + s + 1, which keeps each user's records in id order and makes
+// a single shard use the ids it stores.
+//
+// A write touches one shard, except a purchase whose buyer lives in another
+// shard than the listing, which commits in two phases (see
+// purchase_two_phase). Records cannot move between shards, so updates that
+// would need to are rejected.
+
+#define SHARD_MAX 64
+
+// A seller's credit from a two-phase purchase whose buyer side committed
+// but whose seller side did not. The sale stands, so the credit and the
+// sale count are still owed; settle_owed keeps trying to apply them. Ids
+// are local to shard.
+typedef struct Owed {
+  size_t shard;
+  uint64_t seller_uid;
+  uint64_t listing_id;
+  uint64_t credit;
+  struct Owed *next;
+} Owed;
+
+typedef struct {
+  Storage base;
+  size_t n;
+  Storage *shards[SHARD_MAX];
+  // Group commit: each shard opens its own batch on its first write, and
+  // commits or fails on its own. used collects the shards touched under an
+  // open batch until storage_batch_take_parts; lost the shards whose batch,
+  // at the end or committed early for a purchase, failed.
+  bool in_batch;
+  bool batch_open[SHARD_MAX];
+  uint64_t used;
+  uint64_t lost;
+  Owed *owed;
+} ShardStorage;
+
+static ShardStorage *shard_of(Storage *base) { return (ShardStorage *)base; }
+
+static size_t shard_for_id(const ShardStorage *s, uint64_t id) {
+  return id ? (size_t)((id - 1) % s->n) : 0;
+}
+
+static uint64_t to_local(const ShardStorage *s, uint64_t id) {
+  return id ? (id - 1) / s->n + 1 : 0;
+}
+
+static uint64_t to_global(const ShardStorage *s, size_t shard, uint64_t id) {
+  return id ? (id - 1) * s->n + shard + 1 : 0;
+}
+
+// Largest local id in shard whose global id is at most after_id.
+static uint64_t local_after(const ShardStorage *s, size_t shard,
+                            uint64_t after_id) {
+  return after_id > shard ? (after_id - shard - 1) / s->n + 1 : 0;
+}
+
+// Both backends keep at most NAME_SZ - 1 bytes of a name, so only those are
+// hashed.
+static size_t shard_for_name(const ShardStorage *s, const char *name) {
+  uint64_t h = 1469598103934665603ULL;
+  for (size_t i = 0; i < NAME_SZ - 1 && name[i]; i++) {
+    h ^= (uint8_t)name[i];
+    h *= 1099511628211ULL;
+  }
+  return (size_t)(h % s->n);
+}
+
+static void user_out(const ShardStorage *s, size_t shard, User *u) {
+  u->uid = to_global(s, shard, u->uid);
+}
+
+static void flag_out(const ShardStorage *s, size_t shard, Flag *f) {
+  f->id = to_global(s, shard, f->id);
+  f->uid = to_global(s, shard, f->uid);
+}
+
+static void listing_out(const ShardStorage *s, size_t shard, Listing *l) {
+  l->id = to_global(s, shard, l->id);
+  l->fid = to_global(s, shard, l->fid);
+}
+
+// Shard i for a read, which sees the writes of its open batch, if any.
+static Storage *use(ShardStorage *s, size_t i) {
+  if (s->batch_open[i])
+    s->used |= 1ULL << i;
+  return s->shards[i];
+}
+
+// Readies shard i for a write, opening its batch if one is due.
+static StorageResult join(ShardStorage *s, size_t i) {
+  if (!s->in_batch)
+    return STORAGE_OK;
+  s->used |= 1ULL << i;
+  if (s->batch_open[i])
+    return STORAGE_OK;
+  StorageResult r = s->shards[i]->ops->batch_begin(s->shards[i]);
+  if (r == STORAGE_OK)
+    s->batch_open[i] = true;
+  return r;
+}
+
+static void settle_owed(ShardStorage *s);
+
+static void shard_close(Storage *base) {
+  ShardStorage *s = shard_of(base);
+  settle_owed(s);
+  while (s->owed) {
+    Owed *o = s->owed;
+    s->owed = o->next;
+    free(o);
+  }
+  for (size_t i = 0; i < s->n; i++) {
+    if (s->shards[i])
+      s->shards[i]->ops->close(s->shards[i]);
+  }
+  free(s);
+}
+
+static StorageResult shard_user_get_by_id(Storage *base, uint64_t uid,
+                                          User *out_user) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, uid);
+  Storage *sh = use(s, i);
+  StorageResult r = sh->ops->user_get_by_id(sh, to_local(s, uid), out_user);
+  if (r == STORAGE_OK)
+    user_out(s, i, out_user);
+  return r;
+}
+
+static StorageResult shard_user_get_by_name(Storage *base, const char *name,
+                                            User *out_user) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_name(s, name);
+  Storage *sh = use(s, i);
+  StorageResult r = sh->ops->user_get_by_name(sh, name, out_user);
+  if (r == STORAGE_OK)
+    user_out(s, i, out_user);
+  return r;
+}
+
+static StorageResult shard_user_insert(Storage *base, const User *user,
+                                       User *out_user) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_name(s, user->name);
+  Storage *sh = s->shards[i];
+  StorageResult r = join(s, i);
+  if (r == STORAGE_OK)
+    r = sh->ops->user_insert(sh, user, out_user);
+  if (r == STORAGE_OK && out_user)
+    user_out(s, i, out_user);
+  return r;
+}
+
+static StorageResult shard_user_update(Storage *base, const User *user) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, user->uid);
+  if (shard_for_name(s, user->name) != i)
+    return STORAGE_INVALID;
+  Storage *sh = s->shards[i];
+  User local = *user;
+  local.uid = to_local(s, user->uid);
+  StorageResult r = join(s, i);
+  return r == STORAGE_OK ? sh->ops->user_update(sh, &local) : r;
+}
+
+static StorageResult shard_user_delete_by_id(Storage *base, uint64_t uid) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, uid);
+  Storage *sh = s->shards[i];
+  StorageResult r = join(s, i);
+  return r == STORAGE_OK ? sh->ops->user_delete_by_id(sh, to_local(s, uid))
+                         : r;
+}
+
+static StorageResult shard_flag_get_by_id(Storage *base, uint64_t id,
+                                          Flag *out_flag) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, id);
+  Storage *sh = use(s, i);
+  StorageResult r = sh->ops->flag_get_by_id(sh, to_local(s, id), out_flag);
+  if (r == STORAGE_OK)
+    flag_out(s, i, out_flag);
+  return r;
+}
+
+// Hands a shard's records to the caller's callback under their global ids.
+typedef struct {
+  const ShardStorage *s;
+  size_t shard;
+  flag_iter_cb flag_cb;
+  listing_iter_cb listing_cb;
+  void *ctx;
+} PageCtx;
+
+static int page_flag_cb(const Flag *flag, void *arg) {
+  PageCtx *p = arg;
+  Flag f = *flag;
+  flag_out(p->s, p->shard, &f);
+  return p->flag_cb(&f, p->ctx);
+}
+
+static int page_listing_cb(const Listing *listing, void *arg) {
+  PageCtx *p = arg;
+  Listing l = *listing;
+  listing_out(p->s, p->shard, &l);
+  return p->listing_cb(&l, p->ctx);
+}
+
+static StorageResult shard_page_flags_for_user(Storage *base, uint64_t uid,
+                                               uint64_t after_id, size_t limit,
+                                               flag_iter_cb cb, void *ctx) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, uid);
+  Storage *sh = use(s, i);
+  PageCtx p = {.s = s, .shard = i, .flag_cb = cb, .ctx = ctx};
+  return sh->ops->page_flags_for_user(sh, to_local(s, uid),
+                                      local_after(s, i, after_id), limit,
+                                      page_flag_cb, &p);
+}
+
+static StorageResult shard_flag_insert(Storage *base, const Flag *flag,
+                                       Flag *out_flag) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, flag->uid);
+  Storage *sh = s->shards[i];
+  Flag local = *flag;
+  local.uid = to_local(s, flag->uid);
+  StorageResult r = join(s, i);
+  if (r == STORAGE_OK)
+    r = sh->ops->flag_insert(sh, &local, out_flag);
+  if (r == STORAGE_OK && out_flag)
+    flag_out(s, i, out_flag);
+  return r;
+}
+
+static StorageResult shard_flag_update(Storage *base, const Flag *flag) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, flag->id);
+  if (shard_for_id(s, flag->uid) != i)
+    return STORAGE_INVALID;
+  Storage *sh = s->shards[i];
+  Flag local = *flag;
+  local.id = to_local(s, flag->id);
+  local.uid = to_local(s, flag->uid);
+  StorageResult r = join(s, i);
+  return r == STORAGE_OK ? sh->ops->flag_update(sh, &local) : r;
+}
+
+static StorageResult shard_flag_delete_by_id(Storage *base, uint64_t id) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, id);
+  Storage *sh = s->shards[i];
+  StorageResult r = join(s, i);
+  return r == STORAGE_OK ? sh->ops->flag_delete_by_id(sh, to_local(s, id))
+                         : r;
+}
+
+static StorageResult shard_listing_get_by_id(Storage *base, uint64_t id,
+                                             Listing *out_listing) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, id);
+  Storage *sh = use(s, i);
+  StorageResult r =
+      sh->ops->listing_get_by_id(sh, to_local(s, id), out_listing);
+  if (r == STORAGE_OK)
+    listing_out(s, i, out_listing);
+  return r;
+}
+
+static StorageResult shard_page_listings_for_user(Storage *base, uint64_t uid,
+                                                  uint64_t after_id,
+                                                  size_t limit,
+                                                  listing_iter_cb cb,
+                                                  void *ctx) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, uid);
+  Storage *sh = use(s, i);
+  PageCtx p = {.s = s, .shard = i, .listing_cb = cb, .ctx = ctx};
+  return sh->ops->page_listings_for_user(sh, to_local(s, uid),
+                                         local_after(s, i, after_id), limit,
+                                         page_listing_cb, &p);
+}
+
+static StorageResult shard_listing_insert(Storage *base,
+                                          const Listing *listing,
+                                          Listing *out_listing) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, listing->fid);
+  Storage *sh = s->shards[i];
+  Listing local = *listing;
+  local.fid = to_local(s, listing->fid);
+  StorageResult r = join(s, i);
+  if (r == STORAGE_OK)
+    r = sh->ops->listing_insert(sh, &local, out_listing);
+  if (r == STORAGE_OK && out_listing)
+    listing_out(s, i, out_listing);
+  return r;
+}
+
+static StorageResult shard_listing_update(Storage *base,
+                                          const Listing *listing) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, listing->id);
+  if (shard_for_id(s, listing->fid) != i)
+    return STORAGE_INVALID;
+  Storage *sh = s->shards[i];
+  Listing local = *listing;
+  local.id = to_local(s, listing->id);
+  local.fid = to_local(s, listing->fid);
+  StorageResult r = join(s, i);
+  return r == STORAGE_OK ? sh->ops->listing_update(sh, &local) : r;
+}
+
+static StorageResult shard_listing_delete_by_id(Storage *base, uint64_t id) {
+  ShardStorage *s = shard_of(base);
+  size_t i = shard_for_id(s, id);
+  Storage *sh = s->shards[i];
+  StorageResult r = join(s, i);
+  return r == STORAGE_OK ? sh->ops->listing_delete_by_id(sh, to_local(s, id))
+                         : r;
+}
+
+// Commits every open shard batch, noting the shards that fail in lost, so
+// the batch commit fails only the sessions that depended on them. Returns
+// false if any failed.
+static bool commit_open(ShardStorage *s) {
+  for (size_t i = 0; i < s->n; i++) {
+    if (!s->batch_open[i])
+      continue;
+    s->batch_open[i] = false;
+    if (s->shards[i]->ops->batch_commit(s->shards[i]) != STORAGE_OK)
+      s->lost |= 1ULL << i;
+  }
+  return s->lost == 0;
+}
+
+// The seller's half: the listing must still be at price; the seller is
+// credited price - fee and the sale is counted. flag gets the listed flag.
+static StorageResult seller_half(Storage *sh, uint64_t listing_id,
+                                 uint64_t price, uint64_t fee, Flag *flag) {
+  Listing listing;
+  User seller;
+  StorageResult r = sh->ops->listing_get_by_id(sh, listing_id, &listing);
+  if (r == STORAGE_OK && listing.price != price)
+    r = STORAGE_NOT_FOUND;
+  if (r == STORAGE_OK)
+    r = sh->ops->flag_get_by_id(sh, listing.fid, flag);
+  if (r == STORAGE_OK)
+    r = sh->ops->user_get_by_id(sh, flag->uid, &seller);
+  if (r == STORAGE_OK) {
+    seller.balance += price - fee;
+    r = sh->ops->user_update(sh, &seller);
+  }
+  if (r == STORAGE_OK) {
+    listing.sale_count++;
+    r = sh->ops->listing_update(sh, &listing);
+  }
+  return r;
+}
+
+// Applies a seller's half that was owed, in a transaction of its own. The
+// listing may have been repriced or deleted since; the seller is credited
+// regardless.
+static StorageResult settle(Storage *sh, const Owed *o) {
+  User seller;
+  Listing listing;
+  StorageResult r = sh->ops->batch_begin(sh);
+  if (r != STORAGE_OK)
+    return r;
+  r = sh->ops->user_get_by_id(sh, o->seller_uid, &seller);
+  if (r == STORAGE_OK) {
+    seller.balance += o->credit;
+    r = sh->ops->user_update(sh, &seller);
+  }
+  if (r == STORAGE_OK &&
+      sh->ops->listing_get_by_id(sh, o->listing_id, &listing) == STORAGE_OK) {
+    listing.sale_count++;
+    r = sh->ops->listing_update(sh, &listing);
+  }
+  if (r == STORAGE_OK)
+    return sh->ops->batch_commit(sh);
+  (void)sh->ops->batch_rollback(sh);
+  return r;
+}
+
+// Settles what it can of the owed credits. Runs only while no shard batch
+// is open. A credit whose seller no longer exists has nowhere to go and is
+// dropped; any other failure leaves it for next time.
+static void settle_owed(ShardStorage *s) {
+  Owed **link = &s->owed;
+  while (*link) {
+    Owed *o = *link;
+    StorageResult r = settle(s->shards[o->shard], o);
+    if (r == STORAGE_OK || r == STORAGE_NOT_FOUND) {
+      *link = o->next;
+      free(o);
+    } else {
+      link = &o->next;
+    }
+  }
+}
+
+// The buyer's half: debits price and stores the copy of flag.
+static StorageResult buyer_half(Storage *sh, uint64_t buyer_uid,
+                                uint64_t price, Flag *flag) {
+  User buyer;
+  StorageResult r = sh->ops->user_get_by_id(sh, buyer_uid, &buyer);
+  if (r == STORAGE_OK && buyer.balance < price)
+    r = STORAGE_INSUFFICIENT_FUNDS;
+  if (r == STORAGE_OK) {
+    buyer.balance -= price;
+    r = sh->ops->user_update(sh, &buyer);
+  }
+  if (r == STORAGE_OK) {
+    flag->uid = buyer_uid;
+    r = sh->ops->flag_insert(sh, flag, flag);
+  }
+  return r;
+}
+
+// Any batches still open are committed first, since their locks would break
+// the lock order. Phase one then opens a write transaction of the
+// purchase's own on both shards, lower index first so two processes never
+// each hold one while waiting on the other, and runs each side's half in
+// it. If either half fails both are rolled back. Phase two commits the
+// buyer's side and then the seller's, so a crash between the two commits
+// loses the seller's credit rather than minting money. Once the buyer's
+// side has committed the purchase has happened: if the seller's commit
+// then fails, the credit is recorded as owed and the buyer still gets the
+// flag.
+static StorageResult purchase_two_phase(ShardStorage *s, size_t seller,
+                                        size_t buyer, uint64_t listing_id,
+                                        uint64_t buyer_uid, uint64_t price,
+                                        uint64_t fee, Flag *out_flag) {
+  Storage *ss = s->shards[seller];
+  Storage *bs = s->shards[buyer];
+  size_t first = seller < buyer ? seller : buyer;
+  size_t second = seller < buyer ? buyer : seller;
+  (void)commit_open(s);
+  settle_owed(s);
+  StorageResult r = s->shards[first]->ops->batch_begin(s->shards[first]);
+  if (r != STORAGE_OK)
+    return r;
+  r = s->shards[second]->ops->batch_begin(s->shards[second]);
+  if (r != STORAGE_OK) {
+    (void)s->shards[first]->ops->batch_rollback(s->shards[first]);
+    return r;
+  }
+
+  Flag flag = {0};
+  r = seller_half(ss, to_local(s, listing_id), price, fee, &flag);
+  uint64_t seller_uid = flag.uid;
+  if (r == STORAGE_OK)
+    r = buyer_half(bs, to_local(s, buyer_uid), price, &flag);
+  if (r != STORAGE_OK) {
+    (void)ss->ops->batch_rollback(ss);
+    (void)bs->ops->batch_rollback(bs);
+    return r;
+  }
+
+  if (bs->ops->batch_commit(bs) != STORAGE_OK) {
+    (void)ss->ops->batch_rollback(ss);
+    return STORAGE_ERR;
+  }
+  if (ss->ops->batch_commit(ss) != STORAGE_OK) {
+    Owed *o = malloc(sizeof(Owed));
+    if (o) {
+      *o = (Owed){.shard = seller,
+                  .seller_uid = seller_uid,
+                  .listing_id = to_local(s, listing_id),
+                  .credit = price - fee,
+                  .next = s->owed};
+      s->owed = o;
+    }
+  }
+  if (out_flag) {
+    *out_flag = flag;
+    flag_out(s, buyer, out_flag);
+  }
+  return STORAGE_OK;
+}
+
+static StorageResult shard_purchase_listing(Storage *base, uint64_t listing_id,
+                                            uint64_t buyer_uid, uint64_t price,
+                                            uint64_t fee, Flag *out_flag) {
+  ShardStorage *s = shard_of(base);
+  size_t seller = shard_for_id(s, listing_id);
+  size_t buyer = shard_for_id(s, buyer_uid);
+  if (seller != buyer)
+    return purchase_two_phase(s, seller, buyer, listing_id, buyer_uid, price,
+                              fee, out_flag);
+  Storage *sh = s->shards[seller];
+  StorageResult r = join(s, seller);
+  if (r == STORAGE_OK)
+    r = sh->ops->purchase_listing(sh, to_local(s, listing_id),
+                                  to_local(s, buyer_uid), price, fee, out_flag);
+  if (r == STORAGE_OK && out_flag)
+    flag_out(s, seller, out_flag);
+  return r;
+}
+
+static StorageResult shard_batch_begin(Storage *base) {
+  ShardStorage *s = shard_of(base);
+  s->in_batch = true;
+  s->lost = 0;
+  return STORAGE_OK;
+}
+
+static StorageResult shard_batch_commit(Storage *base) {
+  ShardStorage *s = shard_of(base);
+  s->in_batch = false;
+  bool ok = commit_open(s);
+  settle_owed(s);
+  return ok ? STORAGE_OK : STORAGE_ERR;
+}
+
+static StorageResult shard_batch_rollback(Storage *base) {
+  ShardStorage *s = shard_of(base);
+  StorageResult r = STORAGE_OK;
+  s->in_batch = false;
+  for (size_t i = 0; i < s->n; i++) {
+    if (!s->batch_open[i])
+      continue;
+    s->batch_open[i] = false;
+    if (s->shards[i]->ops->batch_rollback(s->shards[i]) != STORAGE_OK)
+      r = STORAGE_ERR;
+  }
+  return r;
+}
+
+static uint64_t shard_batch_take_parts(Storage *base) {
+  ShardStorage *s = shard_of(base);
+  uint64_t used = s->used;
+  s->used = 0;
+  return used;
+}
+
+static uint64_t shard_batch_lost_parts(Storage *base) {
+  return shard_of(base)->lost;
+}
+
+static void shard_stats(Storage *base, StorageStats *out) {
+  ShardStorage *s = shard_of(base);
+  for (size_t i = 0; i < s->n; i++) {
+    StorageStats st = {0};
+    s->shards[i]->ops->stats(s->shards[i], &st);
+    out->cache_hits += st.cache_hits;
+    out->cache_misses += st.cache_misses;
+    out->busy_retries += st.busy_retries;
+    out->reader_reads += st.reader_reads;
+  }
+}
+
+// Each shard is a database of its own, so each is backed up on its own to
+// dest_path.<i>, the name storage_shard_open gives it. The copies are not
+// taken at one instant: a cross-shard purchase made between two of them
+// can show up in one and not the other.
+static StorageResult shard_backup_to_file(Storage *base, const char *dest_path,
+                                          const StorageBackupOptions *opts) {
+  ShardStorage *s = shard_of(base);
+  for (size_t i = 0; i < s->n; i++) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s.%zu", dest_path, i) >=
+        (int)sizeof(path))
+      return STORAGE_INVALID;
+    StorageResult r = storage_backup_to_file(s->shards[i], path, opts);
+    if (r != STORAGE_OK)
+      return r;
+  }
+  return STORAGE_OK;
+}
+
+static const StorageOps SHARD_OPS = {
+    .name = "shard",
+    .close = shard_close,
+    .user_get_by_id = shard_user_get_by_id,
+    .user_get_by_name = shard_user_get_by_name,
+    .user_insert = shard_user_insert,
+    .user_update = shard_user_update,
+    .user_delete_by_id = shard_user_delete_by_id,
+    .flag_get_by_id = shard_flag_get_by_id,
+    .page_flags_for_user = shard_page_flags_for_user,
+    .flag_insert = shard_flag_insert,
+    .flag_update = shard_flag_update,
+    .flag_delete_by_id = shard_flag_delete_by_id,
+    .listing_get_by_id = shard_listing_get_by_id,
+    .page_listings_for_user = shard_page_listings_for_user,
+    .listing_insert = shard_listing_insert,
+    .listing_update = shard_listing_update,
+    .listing_delete_by_id = shard_listing_delete_by_id,
+    .purchase_listing = shard_purchase_listing,
+    .batch_begin = shard_batch_begin,
+    .batch_commit = shard_batch_commit,
+    .batch_rollback = shard_batch_rollback,
+    .batch_take_parts = shard_batch_take_parts,
+    .batch_lost_parts = shard_batch_lost_parts,
+    .stats = shard_stats,
+    .backup_to_file = shard_backup_to_file,
+};
+
+StorageResult storage_shard_open(const char *path, const StorageOptions *opts,
+                                 Storage **out_storage) {
+  char *end = NULL;
+  unsigned long n = strtoul(path, &end, 10);
+  if (end == path || *end != ':' || n == 0 || n > SHARD_MAX || !end[1])
+    return STORAGE_INVALID;
+  ShardStorage *s = calloc(1, sizeof(ShardStorage));
+  if (!s)
+    return STORAGE_ERR;
+  s->base.ops = &SHARD_OPS;
+  s->n = n;
+  StorageResult r = STORAGE_OK;
+  for (size_t i = 0; i < n && r == STORAGE_OK; i++) {
+    char shard_path[4096];
+    if (snprintf(shard_path, sizeof(shard_path), "%s.%zu", end + 1, i) >=
+        (int)sizeof(shard_path))
+      r = STORAGE_INVALID;
+    else
+      r = storage_open_with_options(shard_path, opts, &s->shards[i]);
+  }
+  if (r != STORAGE_OK) {
+    shard_close(&s->base);
+    return r;
+  }
+  *out_storage = &s->base;
+  return STORAGE_OK;
+}
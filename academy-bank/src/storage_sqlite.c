@@ -1,13 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "storage.h"
 
+#include "record_cache.h"
+#include "storage_backend.h"
+
+#include <ctype.h>
+#include <errno.h>
 #include <sqlite3.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every statement the storage layer runs is prepared once in storage_open and
+// kept for the lifetime of the connection. Callers bind, step and then hand
+// the statement back with stmt_release so it is ready for the next use.
+typedef enum {
+  STMT_USER_GET_BY_ID,
+  STMT_USER_GET_BY_NAME,
+  STMT_USER_INSERT,
+  STMT_USER_UPDATE,
+  STMT_USER_DELETE,
+  STMT_FLAG_GET_BY_ID,
+  STMT_FLAG_PAGE_FOR_USER,
+  STMT_FLAG_INSERT,
+  STMT_FLAG_UPDATE,
+  STMT_FLAG_DELETE,
+  STMT_LISTING_GET_BY_ID,
+  STMT_LISTING_PAGE_FOR_USER,
+  STMT_LISTING_INSERT,
+  STMT_LISTING_UPDATE,
+  STMT_LISTING_DELETE,
+  STMT_PURCHASE_LOOKUP,
+  STMT_USER_DEBIT,
+  STMT_USER_CREDIT,
+  STMT_LISTING_RECORD_SALE,
+  STMT_BEGIN,
+  STMT_COMMIT,
+  STMT_ROLLBACK,
+  STMT_SAVEPOINT,
+  STMT_RELEASE,
+  STMT_ROLLBACK_TO,
+  STMT_DATA_VERSION,
+  STMT_COUNT
+} StmtId;
+
+static const char *const STMT_SQL[STMT_COUNT] = {
+    [STMT_USER_GET_BY_ID] =
+        "SELECT uid, name, balance, pass_plain FROM users WHERE uid = ?;",
+    [STMT_USER_GET_BY_NAME] =
+        "SELECT uid, name, balance, pass_plain FROM users WHERE name = ?;",
+    [STMT_USER_INSERT] =
+        "INSERT INTO users(name, balance, pass_plain) VALUES(?, ?, ?);",
+    [STMT_USER_UPDATE] =
+        "UPDATE users SET name=?, balance=?, pass_plain=? WHERE uid=?;",
+    [STMT_USER_DELETE] = "DELETE FROM users WHERE uid=?;",
+    [STMT_FLAG_GET_BY_ID] = "SELECT id, uid, secret FROM flags WHERE id = ?;",
+    [STMT_FLAG_PAGE_FOR_USER] = "SELECT id, uid, secret FROM flags "
+                                "WHERE uid = ?1 AND id > ?2 "
+                                "ORDER BY id LIMIT ?3;",
+    [STMT_FLAG_INSERT] = "INSERT INTO flags(uid, secret) VALUES(?, ?);",
+    [STMT_FLAG_UPDATE] = "UPDATE flags SET uid=?, secret=? WHERE id=?;",
+    [STMT_FLAG_DELETE] = "DELETE FROM flags WHERE id=?;",
+    [STMT_LISTING_GET_BY_ID] =
+        "SELECT id, fid, note, sale_count, price FROM listings WHERE id = ?;",
+    [STMT_LISTING_PAGE_FOR_USER] =
+        "SELECT l.id, l.fid, l.note, l.sale_count, l.price "
+        "FROM listings l JOIN flags f ON l.fid = f.id "
+        "WHERE f.uid = ?1 AND l.id > ?2 ORDER BY l.id LIMIT ?3;",
+    [STMT_LISTING_INSERT] = "INSERT INTO listings(fid, note, sale_count, "
+                            "price) VALUES(?, ?, ?, ?);",
+    [STMT_LISTING_UPDATE] = "UPDATE listings SET fid=?, note=?, sale_count=?, "
+                            "price=? WHERE id=?;",
+    [STMT_LISTING_DELETE] = "DELETE FROM listings WHERE id=?;",
+    [STMT_PURCHASE_LOOKUP] = "SELECT f.id, f.uid, f.secret FROM listings l "
+                             "JOIN flags f ON l.fid = f.id "
+                             "WHERE l.id = ? AND l.price = ?;",
+    // Balances are uint64_t stored in signed columns, so the funds check
+    // compares them as unsigned: a negative column value is a huge balance.
+    [STMT_USER_DEBIT] =
+        "UPDATE users SET balance = balance - ?1 WHERE uid = ?2 AND "
+        "((balance < 0) > (?1 < 0) OR "
+        "((balance < 0) = (?1 < 0) AND balance >= ?1));",
+    [STMT_USER_CREDIT] =
+        "UPDATE users SET balance = balance + ? WHERE uid = ?;",
+    [STMT_LISTING_RECORD_SALE] =
+        "UPDATE listings SET sale_count = sale_count + 1 WHERE id = ?;",
+    [STMT_BEGIN] = "BEGIN IMMEDIATE TRANSACTION;",
+    [STMT_COMMIT] = "COMMIT;",
+    [STMT_ROLLBACK] = "ROLLBACK;",
+    [STMT_SAVEPOINT] = "SAVEPOINT op;",
+    [STMT_RELEASE] = "RELEASE op;",
+    [STMT_ROLLBACK_TO] = "ROLLBACK TO op;",
+    [STMT_DATA_VERSION] = "PRAGMA data_version;",
+};
 
-struct Storage {
+// Read-only connection for read calls; only the read statements are
+// prepared on it.
+typedef struct {
   sqlite3 *db;
+  sqlite3_stmt *stmts[STMT_COUNT];
+  bool busy; // claimed by a call still running, such as a page scan
+} SqliteReader;
+
+static const StmtId READ_STMTS[] = {
+    STMT_USER_GET_BY_ID,    STMT_USER_GET_BY_NAME,
+    STMT_FLAG_GET_BY_ID,    STMT_FLAG_PAGE_FOR_USER,
+    STMT_LISTING_GET_BY_ID, STMT_LISTING_PAGE_FOR_USER,
 };
 
+typedef struct {
+  Storage base;
+  sqlite3 *db;
+  sqlite3_stmt *stmts[STMT_COUNT];
+  int busy_timeout_ms;
+  int busy_waited_ms;
+  uint64_t busy_retries;
+  RecordCache *cache;
+  int64_t data_version;
+  bool in_batch;
+  SqliteReader *readers;
+  int n_readers;
+  uint64_t reader_reads;
+} SqliteStorage;
+
 static const char *SCHEMA_SQL =
     "PRAGMA foreign_keys=ON;"
     "CREATE TABLE IF NOT EXISTS users ("
@@ -31,6 +149,13 @@ static const char *SCHEMA_SQL =
     "  FOREIGN KEY(fid) REFERENCES flags(id) ON DELETE CASCADE"
     ");";
 
+// Schema migrations applied in order on top of SCHEMA_SQL. PRAGMA user_version
+// records how many have run, so append new steps and never edit old ones.
+static const char *const MIGRATIONS[] = {
+    "CREATE INDEX IF NOT EXISTS idx_flags_uid ON flags(uid);"
+    "CREATE INDEX IF NOT EXISTS idx_listings_fid ON listings(fid);",
+};
+
 static StorageResult map_sqlite_rc(int rc) {
   if (rc == SQLITE_OK || rc == SQLITE_DONE || rc == SQLITE_ROW)
     return STORAGE_OK;
@@ -39,91 +164,266 @@ static StorageResult map_sqlite_rc(int rc) {
   return STORAGE_ERR;
 }
 
-static StorageResult begin_tx(sqlite3 *db) {
-  int rc = sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
-  return rc == SQLITE_OK ? STORAGE_OK : STORAGE_ERR;
+static void stmt_release(sqlite3_stmt *stmt) {
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
 }
 
-static StorageResult commit_tx(sqlite3 *db) {
-  int rc = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
-  return rc == SQLITE_OK ? STORAGE_OK : STORAGE_ERR;
+static StorageResult exec_stmt(SqliteStorage *s, StmtId id) {
+  sqlite3_stmt *stmt = s->stmts[id];
+  int rc = sqlite3_step(stmt);
+  stmt_release(stmt);
+  return rc == SQLITE_DONE ? STORAGE_OK : STORAGE_ERR;
 }
 
-static void rollback_tx(sqlite3 *db) {
-  (void)sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+// Inside a group-commit batch a multi-statement write nests as a savepoint,
+// so a failed purchase only undoes itself.
+static StorageResult begin_tx(SqliteStorage *s) {
+  return exec_stmt(s, s->in_batch ? STMT_SAVEPOINT : STMT_BEGIN);
 }
 
-StorageResult storage_open(const char *db_path, Storage **out_storage) {
-  if (!db_path || !out_storage)
-    return STORAGE_INVALID;
-  Storage *s = (Storage *)calloc(1, sizeof(Storage));
-  if (!s)
+static StorageResult commit_tx(SqliteStorage *s) {
+  return exec_stmt(s, s->in_batch ? STMT_RELEASE : STMT_COMMIT);
+}
+
+static void rollback_tx(SqliteStorage *s) {
+  if (!s->in_batch) {
+    (void)exec_stmt(s, STMT_ROLLBACK);
+    return;
+  }
+  (void)exec_stmt(s, STMT_ROLLBACK_TO);
+  (void)exec_stmt(s, STMT_RELEASE);
+}
+
+// Returns the record cache if it may be read. Writes from other connections
+// (prefork workers, other processes) bump PRAGMA data_version; when it moves
+// the whole cache is dropped rather than trusting any entry. Our own writes
+// keep it current through the write-through calls below.
+static RecordCache *cache_for_read(SqliteStorage *s) {
+  if (!s->cache)
+    return NULL;
+  sqlite3_stmt *stmt = s->stmts[STMT_DATA_VERSION];
+  int64_t version =
+      sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+  stmt_release(stmt);
+  if (version < 0 || version != s->data_version) {
+    record_cache_clear(s->cache);
+    s->data_version = version;
+  }
+  return version < 0 ? NULL : s->cache;
+}
+
+// Read calls made outside a transaction run on a free read-only connection,
+// in a WAL read snapshot of its own, so the write connection only carries
+// writes. Inside a transaction or group-commit batch they stay on the write
+// connection, which is the only one that sees its uncommitted writes. A page
+// scan keeps its reader until it returns, so reads made from its callback
+// take another, or the write connection once none is free.
+static SqliteReader *claim_reader(SqliteStorage *s) {
+  if (!s->n_readers || !sqlite3_get_autocommit(s->db))
+    return NULL;
+  for (int i = 0; i < s->n_readers; i++) {
+    if (!s->readers[i].busy) {
+      s->readers[i].busy = true;
+      s->reader_reads++;
+      return &s->readers[i];
+    }
+  }
+  return NULL;
+}
+
+static void release_reader(SqliteReader *reader) {
+  if (reader)
+    reader->busy = false;
+}
+
+static sqlite3_stmt *read_stmt(SqliteStorage *s, SqliteReader *reader,
+                               StmtId id) {
+  return reader ? reader->stmts[id] : s->stmts[id];
+}
+
+// Retries a locked database with exponential backoff (1ms doubling up to
+// 32ms) until busy_timeout_ms has been spent waiting on this lock.
+static int busy_backoff(void *arg, int attempt) {
+  SqliteStorage *s = (SqliteStorage *)arg;
+  if (attempt == 0)
+    s->busy_waited_ms = 0;
+  if (s->busy_waited_ms >= s->busy_timeout_ms)
+    return 0;
+  int delay_ms = attempt < 5 ? 1 << attempt : 32;
+  if (delay_ms > s->busy_timeout_ms - s->busy_waited_ms)
+    delay_ms = s->busy_timeout_ms - s->busy_waited_ms;
+  struct timespec ts = {delay_ms / 1000, (long)(delay_ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+  s->busy_waited_ms += delay_ms;
+  s->busy_retries++;
+  return 1;
+}
+
+static int pragma_word_ok(const char *word) {
+  if (!word || !*word)
+    return 0;
+  for (; *word; word++) {
+    if (!isalpha((unsigned char)*word))
+      return 0;
+  }
+  return 1;
+}
+
+static StorageResult apply_pragmas(SqliteStorage *s,
+                                   const StorageOptions *opts) {
+  char sql[128];
+  if (opts->busy_timeout_ms > 0) {
+    s->busy_timeout_ms = opts->busy_timeout_ms;
+    sqlite3_busy_handler(s->db, busy_backoff, s);
+  }
+  if (opts->journal_mode) {
+    if (!pragma_word_ok(opts->journal_mode))
+      return STORAGE_INVALID;
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;", opts->journal_mode);
+    if (sqlite3_exec(s->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+      return STORAGE_ERR;
+  }
+  if (opts->synchronous) {
+    if (!pragma_word_ok(opts->synchronous))
+      return STORAGE_INVALID;
+    snprintf(sql, sizeof(sql), "PRAGMA synchronous=%s;", opts->synchronous);
+    if (sqlite3_exec(s->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+      return STORAGE_ERR;
+  }
+  if (opts->mmap_size >= 0) {
+    snprintf(sql, sizeof(sql), "PRAGMA mmap_size=%lld;",
+             (long long)opts->mmap_size);
+    if (sqlite3_exec(s->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+      return STORAGE_ERR;
+  }
+  if (opts->cache_size != 0) {
+    snprintf(sql, sizeof(sql), "PRAGMA cache_size=%d;", opts->cache_size);
+    if (sqlite3_exec(s->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+      return STORAGE_ERR;
+  }
+  return STORAGE_OK;
+}
+
+static StorageResult migrate_schema(sqlite3 *db) {
+  const int target = (int)(sizeof(MIGRATIONS) / sizeof(MIGRATIONS[0]));
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) !=
+      SQLITE_OK)
     return STORAGE_ERR;
-  int rc = sqlite3_open(db_path, &s->db);
-  if (rc != SQLITE_OK) {
-    free(s);
+  int version = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0)
+                                                 : -1;
+  sqlite3_finalize(stmt);
+  if (version < 0)
     return STORAGE_ERR;
+
+  for (; version < target; version++) {
+    char bump[64];
+    snprintf(bump, sizeof(bump), "PRAGMA user_version=%d;", version + 1);
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL) !=
+        SQLITE_OK)
+      return STORAGE_ERR;
+    if (sqlite3_exec(db, MIGRATIONS[version], NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_exec(db, bump, NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+      (void)sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      return STORAGE_ERR;
+    }
   }
-  char *errmsg = NULL;
-  rc = sqlite3_exec(s->db, SCHEMA_SQL, NULL, NULL, &errmsg);
-  if (rc != SQLITE_OK) {
-    sqlite3_free(errmsg);
-    sqlite3_close(s->db);
-    free(s);
-    return STORAGE_ERR;
+  return STORAGE_OK;
+}
+
+static StorageResult prepare_statements(SqliteStorage *s) {
+  for (int i = 0; i < STMT_COUNT; i++) {
+    if (sqlite3_prepare_v3(s->db, STMT_SQL[i], -1, SQLITE_PREPARE_PERSISTENT,
+                           &s->stmts[i], NULL) != SQLITE_OK)
+      return STORAGE_ERR;
   }
-  (void)sqlite3_exec(s->db, "ALTER TABLE users ADD COLUMN pass_plain TEXT;",
-                     NULL, NULL, NULL);
-  *out_storage = s;
   return STORAGE_OK;
 }
 
-void storage_close(Storage *storage) {
-  if (!storage)
-    return;
-  sqlite3_close(storage->db);
-  free(storage);
+static void finalize_statements(SqliteStorage *s) {
+  for (int i = 0; i < STMT_COUNT; i++) {
+    sqlite3_finalize(s->stmts[i]);
+    s->stmts[i] = NULL;
+  }
 }
 
-StorageResult storage_user_create(Storage *storage, const char *name,
-                                  User *out_user) {
-  if (!storage || !name || !out_user)
-    return STORAGE_INVALID;
-  const char *sql =
-      "INSERT INTO users(name, balance, pass_plain) VALUES(?, 100, '');";
+static bool is_wal(sqlite3 *db) {
   sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
+  bool wal = false;
+  if (sqlite3_prepare_v2(db, "PRAGMA journal_mode;", -1, &stmt, NULL) ==
+          SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW)
+    wal = sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 0),
+                          "wal") == 0;
+  sqlite3_finalize(stmt);
+  return wal;
+}
+
+// Only a WAL database on disk can be read from other connections without
+// holding up the writer, so anything else keeps every call on s->db.
+static StorageResult open_readers(SqliteStorage *s,
+                                  const StorageOptions *opts) {
+  const char *path = sqlite3_db_filename(s->db, "main");
+  if (opts->read_connections <= 0 || !path || !*path || !is_wal(s->db))
+    return STORAGE_OK;
+  s->readers = calloc((size_t)opts->read_connections, sizeof(SqliteReader));
+  if (!s->readers)
     return STORAGE_ERR;
-  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
-  rc = sqlite3_step(stmt);
-  if (rc != SQLITE_DONE) {
-    StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
-    return r;
+  char sql[64];
+  snprintf(sql, sizeof(sql), "PRAGMA mmap_size=%lld;",
+           (long long)opts->mmap_size);
+  while (s->n_readers < opts->read_connections) {
+    SqliteReader *reader = &s->readers[s->n_readers++];
+    if (sqlite3_open_v2(path, &reader->db, SQLITE_OPEN_READONLY, NULL) !=
+        SQLITE_OK)
+      return STORAGE_ERR;
+    sqlite3_busy_timeout(reader->db, opts->busy_timeout_ms);
+    if (opts->mmap_size >= 0 &&
+        sqlite3_exec(reader->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+      return STORAGE_ERR;
+    for (size_t i = 0; i < sizeof(READ_STMTS) / sizeof(READ_STMTS[0]); i++) {
+      if (sqlite3_prepare_v3(reader->db, STMT_SQL[READ_STMTS[i]], -1,
+                             SQLITE_PREPARE_PERSISTENT,
+                             &reader->stmts[READ_STMTS[i]],
+                             NULL) != SQLITE_OK)
+        return STORAGE_ERR;
+    }
   }
-  uint64_t uid = (uint64_t)sqlite3_last_insert_rowid(storage->db);
-  sqlite3_finalize(stmt);
-  User u = {0};
-  u.uid = uid;
-  strncpy(u.name, name, sizeof(u.name) - 1);
-  u.balance = 100;
-  *out_user = u;
   return STORAGE_OK;
 }
 
-StorageResult storage_user_get_by_id(Storage *storage, uint64_t uid,
-                                     User *out_user) {
-  if (!storage || !out_user)
-    return STORAGE_INVALID;
-  const char *sql =
-      "SELECT uid, name, balance, pass_plain FROM users WHERE uid = ?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static void close_readers(SqliteStorage *s) {
+  for (int r = 0; r < s->n_readers; r++) {
+    for (int i = 0; i < STMT_COUNT; i++)
+      sqlite3_finalize(s->readers[r].stmts[i]);
+    sqlite3_close(s->readers[r].db);
+  }
+  free(s->readers);
+  s->readers = NULL;
+  s->n_readers = 0;
+}
+
+static void sqlite_close(Storage *base) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  close_readers(storage);
+  finalize_statements(storage);
+  record_cache_free(storage->cache);
+  sqlite3_close(storage->db);
+  free(storage);
+}
+
+static StorageResult sqlite_user_get_by_id(Storage *base, uint64_t uid,
+                                           User *out_user) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  RecordCache *cache = cache_for_read(storage);
+  if (cache && record_cache_get_user(cache, uid, out_user))
+    return STORAGE_OK;
+  SqliteReader *reader = claim_reader(storage);
+  sqlite3_stmt *stmt = read_stmt(storage, reader, STMT_USER_GET_BY_ID);
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)uid);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc == SQLITE_ROW) {
     User u = (User){0};
     u.uid = (uint64_t)sqlite3_column_int64(stmt, 0);
@@ -134,26 +434,28 @@ StorageResult storage_user_get_by_id(Storage *storage, uint64_t uid,
     const unsigned char *p = sqlite3_column_text(stmt, 3);
     if (p)
       strncpy(u.password, (const char *)p, sizeof(u.password) - 1);
+    if (cache)
+      record_cache_put_user(cache, &u);
     *out_user = u;
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
+    release_reader(reader);
     return STORAGE_OK;
   }
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  release_reader(reader);
   return STORAGE_NOT_FOUND;
 }
 
-StorageResult storage_user_get_by_name(Storage *storage, const char *name,
-                                       User *out_user) {
-  if (!storage || !name || !out_user)
-    return STORAGE_INVALID;
-  const char *sql =
-      "SELECT uid, name, balance, pass_plain FROM users WHERE name = ?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
-  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
-  rc = sqlite3_step(stmt);
+static StorageResult sqlite_user_get_by_name(Storage *base, const char *name,
+                                             User *out_user) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  RecordCache *cache = cache_for_read(storage);
+  if (cache && record_cache_get_user_by_name(cache, name, out_user))
+    return STORAGE_OK;
+  SqliteReader *reader = claim_reader(storage);
+  sqlite3_stmt *stmt = read_stmt(storage, reader, STMT_USER_GET_BY_NAME);
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  int rc = sqlite3_step(stmt);
   if (rc == SQLITE_ROW) {
     User u = (User){0};
     u.uid = (uint64_t)sqlite3_column_int64(stmt, 0);
@@ -164,25 +466,28 @@ StorageResult storage_user_get_by_name(Storage *storage, const char *name,
     const unsigned char *p = sqlite3_column_text(stmt, 3);
     if (p)
       strncpy(u.password, (const char *)p, sizeof(u.password) - 1);
+    if (cache)
+      record_cache_put_user(cache, &u);
     *out_user = u;
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
+    release_reader(reader);
     return STORAGE_OK;
   }
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  release_reader(reader);
   return STORAGE_NOT_FOUND;
 }
 
-StorageResult storage_flag_get_by_id(Storage *storage, uint64_t id,
-                                     Flag *out_flag) {
-  if (!storage || !out_flag)
-    return STORAGE_INVALID;
-  const char *sql = "SELECT id, uid, secret FROM flags WHERE id = ?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_flag_get_by_id(Storage *base, uint64_t id,
+                                           Flag *out_flag) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  RecordCache *cache = cache_for_read(storage);
+  if (cache && record_cache_get_flag(cache, id, out_flag))
+    return STORAGE_OK;
+  SqliteReader *reader = claim_reader(storage);
+  sqlite3_stmt *stmt = read_stmt(storage, reader, STMT_FLAG_GET_BY_ID);
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)id);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc == SQLITE_ROW) {
     Flag f = {0};
     f.id = (uint64_t)sqlite3_column_int64(stmt, 0);
@@ -190,26 +495,40 @@ StorageResult storage_flag_get_by_id(Storage *storage, uint64_t id,
     const unsigned char *s = sqlite3_column_text(stmt, 2);
     if (s)
       strncpy(f.secret, (const char *)s, sizeof(f.secret) - 1);
+    if (cache)
+      record_cache_put_flag(cache, &f);
     *out_flag = f;
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
+    release_reader(reader);
     return STORAGE_OK;
   }
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  release_reader(reader);
   return STORAGE_NOT_FOUND;
 }
 
-StorageResult storage_iter_flags_for_user(Storage *storage, uint64_t uid,
-                                          flag_iter_cb cb, void *ctx) {
-  if (!storage || !cb)
-    return STORAGE_INVALID;
-  const char *sql =
-      "SELECT id, uid, secret FROM flags WHERE uid = ? ORDER BY id;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+// Binds the uid, after_id and limit parameters shared by the page queries.
+// SQLite reads a negative LIMIT as no limit.
+static sqlite3_stmt *bind_page(SqliteStorage *storage, SqliteReader *reader,
+                               StmtId id, uint64_t uid, uint64_t after_id,
+                               size_t limit) {
+  sqlite3_stmt *stmt = read_stmt(storage, reader, id);
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)uid);
-  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+  sqlite3_bind_int64(stmt, 2, (sqlite3_int64)after_id);
+  sqlite3_bind_int64(stmt, 3,
+                     limit && limit <= INT64_MAX ? (sqlite3_int64)limit : -1);
+  return stmt;
+}
+
+static StorageResult sqlite_page_flags_for_user(Storage *base, uint64_t uid,
+                                                uint64_t after_id, size_t limit,
+                                                flag_iter_cb cb, void *ctx) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  SqliteReader *reader = claim_reader(storage);
+  sqlite3_stmt *stmt =
+      bind_page(storage, reader, STMT_FLAG_PAGE_FOR_USER, uid, after_id,
+                limit);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
     Flag f = {0};
     f.id = (uint64_t)sqlite3_column_int64(stmt, 0);
     f.uid = (uint64_t)sqlite3_column_int64(stmt, 1);
@@ -219,22 +538,21 @@ StorageResult storage_iter_flags_for_user(Storage *storage, uint64_t uid,
     if (cb(&f, ctx))
       break;
   }
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  release_reader(reader);
   return STORAGE_OK;
 }
 
-StorageResult storage_listing_get_by_id(Storage *storage, uint64_t id,
-                                        Listing *out_listing) {
-  if (!storage || !out_listing)
-    return STORAGE_INVALID;
-  const char *sql =
-      "SELECT id, fid, note, sale_count, price FROM listings WHERE id = ?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_listing_get_by_id(Storage *base, uint64_t id,
+                                              Listing *out_listing) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  RecordCache *cache = cache_for_read(storage);
+  if (cache && record_cache_get_listing(cache, id, out_listing))
+    return STORAGE_OK;
+  SqliteReader *reader = claim_reader(storage);
+  sqlite3_stmt *stmt = read_stmt(storage, reader, STMT_LISTING_GET_BY_ID);
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)id);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc == SQLITE_ROW) {
     Listing l = {0};
     l.id = (uint64_t)sqlite3_column_int64(stmt, 0);
@@ -244,27 +562,29 @@ StorageResult storage_listing_get_by_id(Storage *storage, uint64_t id,
       strncpy(l.note, (const char *)n, sizeof(l.note) - 1);
     l.sale_count = (uint64_t)sqlite3_column_int64(stmt, 3);
     l.price = (uint64_t)sqlite3_column_int64(stmt, 4);
+    if (cache)
+      record_cache_put_listing(cache, &l);
     *out_listing = l;
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
+    release_reader(reader);
     return STORAGE_OK;
   }
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  release_reader(reader);
   return STORAGE_NOT_FOUND;
 }
 
-StorageResult storage_iter_listings_for_user(Storage *storage, uint64_t uid,
-                                             listing_iter_cb cb, void *ctx) {
-  if (!storage || !cb)
-    return STORAGE_INVALID;
-  const char *sql = "SELECT l.id, l.fid, l.note, l.sale_count, l.price "
-                    "FROM listings l JOIN flags f ON l.fid = f.id WHERE f.uid "
-                    "= ? ORDER BY l.id;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
-  sqlite3_bind_int64(stmt, 1, (sqlite3_int64)uid);
-  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+static StorageResult sqlite_page_listings_for_user(Storage *base, uint64_t uid,
+                                                   uint64_t after_id,
+                                                   size_t limit,
+                                                   listing_iter_cb cb,
+                                                   void *ctx) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  SqliteReader *reader = claim_reader(storage);
+  sqlite3_stmt *stmt =
+      bind_page(storage, reader, STMT_LISTING_PAGE_FOR_USER, uid, after_id,
+                limit);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
     Listing l = {0};
     l.id = (uint64_t)sqlite3_column_int64(stmt, 0);
     l.fid = (uint64_t)sqlite3_column_int64(stmt, 1);
@@ -276,31 +596,31 @@ StorageResult storage_iter_listings_for_user(Storage *storage, uint64_t uid,
     if (cb(&l, ctx))
       break;
   }
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  release_reader(reader);
   return STORAGE_OK;
 }
 
-StorageResult storage_user_insert(Storage *storage, const User *user,
-                                  User *out_user) {
-  if (!storage || !user)
-    return STORAGE_INVALID;
-  const char *sql =
-      "INSERT INTO users(name, balance, pass_plain) VALUES(?, ?, ?);";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
-  sqlite3_bind_text(stmt, 1, user->name, -1, SQLITE_TRANSIENT);
+static StorageResult sqlite_user_insert(Storage *base, const User *user,
+                                        User *out_user) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_USER_INSERT];
+  sqlite3_bind_text(stmt, 1, user->name, -1, SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 2, (sqlite3_int64)user->balance);
-  sqlite3_bind_text(stmt, 3, user->password, -1, SQLITE_TRANSIENT);
-  rc = sqlite3_step(stmt);
+  sqlite3_bind_text(stmt, 3, user->password, -1, SQLITE_STATIC);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
     return r;
   }
   uint64_t uid = (uint64_t)sqlite3_last_insert_rowid(storage->db);
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  if (storage->cache) {
+    User u = *user;
+    u.uid = uid;
+    record_cache_put_user(storage->cache, &u);
+  }
   if (out_user) {
     *out_user = *user;
     ((User *)out_user)->uid = uid;
@@ -308,67 +628,74 @@ StorageResult storage_user_insert(Storage *storage, const User *user,
   return STORAGE_OK;
 }
 
-StorageResult storage_user_update(Storage *storage, const User *user) {
-  if (!storage || !user)
-    return STORAGE_INVALID;
-  const char *sql =
-      "UPDATE users SET name=?, balance=?, pass_plain=? WHERE uid=?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
-  sqlite3_bind_text(stmt, 1, user->name, -1, SQLITE_TRANSIENT);
+static StorageResult sqlite_user_update(Storage *base, const User *user) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_USER_UPDATE];
+  sqlite3_bind_text(stmt, 1, user->name, -1, SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 2, (sqlite3_int64)user->balance);
-  sqlite3_bind_text(stmt, 3, user->password, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(stmt, 3, user->password, -1, SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 4, (sqlite3_int64)user->uid);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
+    if (storage->cache)
+      record_cache_drop_user(storage->cache, user->uid);
     return r;
   }
-  sqlite3_finalize(stmt);
-  return sqlite3_changes(storage->db) > 0 ? STORAGE_OK : STORAGE_NOT_FOUND;
+  stmt_release(stmt);
+  if (sqlite3_changes(storage->db) == 0) {
+    if (storage->cache)
+      record_cache_drop_user(storage->cache, user->uid);
+    return STORAGE_NOT_FOUND;
+  }
+  if (storage->cache)
+    record_cache_put_user(storage->cache, user);
+  return STORAGE_OK;
 }
 
-StorageResult storage_user_delete_by_id(Storage *storage, uint64_t uid) {
-  if (!storage)
-    return STORAGE_INVALID;
-  const char *sql = "DELETE FROM users WHERE uid=?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_user_delete_by_id(Storage *base, uint64_t uid) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_USER_DELETE];
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)uid);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
     return r;
   }
-  sqlite3_finalize(stmt);
-  return sqlite3_changes(storage->db) > 0 ? STORAGE_OK : STORAGE_NOT_FOUND;
+  stmt_release(stmt);
+  if (sqlite3_changes(storage->db) == 0)
+    return STORAGE_NOT_FOUND;
+  // The delete cascades to the user's flags and their listings. Listings
+  // are not indexed by owner here, so all of them are dropped.
+  if (storage->cache) {
+    record_cache_drop_user(storage->cache, uid);
+    record_cache_drop_flags_for_user(storage->cache, uid);
+    record_cache_drop_all_listings(storage->cache);
+  }
+  return STORAGE_OK;
 }
 
-StorageResult storage_flag_insert(Storage *storage, const Flag *flag,
-                                  Flag *out_flag) {
-  if (!storage || !flag)
-    return STORAGE_INVALID;
-  const char *sql = "INSERT INTO flags(uid, secret) VALUES(?, ?);";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_flag_insert(Storage *base, const Flag *flag,
+                                        Flag *out_flag) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_FLAG_INSERT];
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)flag->uid);
-  sqlite3_bind_text(stmt, 2, flag->secret, -1, SQLITE_TRANSIENT);
-  rc = sqlite3_step(stmt);
+  sqlite3_bind_text(stmt, 2, flag->secret, -1, SQLITE_STATIC);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
     return r;
   }
   uint64_t id = (uint64_t)sqlite3_last_insert_rowid(storage->db);
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  if (storage->cache) {
+    Flag f = *flag;
+    f.id = id;
+    record_cache_put_flag(storage->cache, &f);
+  }
   if (out_flag) {
     *out_flag = *flag;
     ((Flag *)out_flag)->id = id;
@@ -376,68 +703,73 @@ StorageResult storage_flag_insert(Storage *storage, const Flag *flag,
   return STORAGE_OK;
 }
 
-StorageResult storage_flag_update(Storage *storage, const Flag *flag) {
-  if (!storage || !flag)
-    return STORAGE_INVALID;
-  const char *sql = "UPDATE flags SET uid=?, secret=? WHERE id=?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_flag_update(Storage *base, const Flag *flag) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_FLAG_UPDATE];
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)flag->uid);
-  sqlite3_bind_text(stmt, 2, flag->secret, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(stmt, 2, flag->secret, -1, SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 3, (sqlite3_int64)flag->id);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
+    if (storage->cache)
+      record_cache_drop_flag(storage->cache, flag->id);
     return r;
   }
-  sqlite3_finalize(stmt);
-  return sqlite3_changes(storage->db) > 0 ? STORAGE_OK : STORAGE_NOT_FOUND;
+  stmt_release(stmt);
+  if (sqlite3_changes(storage->db) == 0) {
+    if (storage->cache)
+      record_cache_drop_flag(storage->cache, flag->id);
+    return STORAGE_NOT_FOUND;
+  }
+  if (storage->cache)
+    record_cache_put_flag(storage->cache, flag);
+  return STORAGE_OK;
 }
 
-StorageResult storage_flag_delete_by_id(Storage *storage, uint64_t id) {
-  if (!storage)
-    return STORAGE_INVALID;
-  const char *sql = "DELETE FROM flags WHERE id=?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_flag_delete_by_id(Storage *base, uint64_t id) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_FLAG_DELETE];
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)id);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
     return r;
   }
-  sqlite3_finalize(stmt);
-  return sqlite3_changes(storage->db) > 0 ? STORAGE_OK : STORAGE_NOT_FOUND;
+  stmt_release(stmt);
+  if (sqlite3_changes(storage->db) == 0)
+    return STORAGE_NOT_FOUND;
+  if (storage->cache) {
+    record_cache_drop_flag(storage->cache, id);
+    record_cache_drop_listings_for_flag(storage->cache, id);
+  }
+  return STORAGE_OK;
 }
 
-StorageResult storage_listing_insert(Storage *storage, const Listing *listing,
-                                     Listing *out_listing) {
-  if (!storage || !listing)
-    return STORAGE_INVALID;
-  const char *sql =
-      "INSERT INTO listings(fid, note, sale_count, price) VALUES(?, ?, ?, ?);";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_listing_insert(Storage *base,
+                                           const Listing *listing,
+                                           Listing *out_listing) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_LISTING_INSERT];
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)listing->fid);
-  sqlite3_bind_text(stmt, 2, listing->note, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(stmt, 2, listing->note, -1, SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 3, (sqlite3_int64)listing->sale_count);
   sqlite3_bind_int64(stmt, 4, (sqlite3_int64)listing->price);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
     return r;
   }
   uint64_t id = (uint64_t)sqlite3_last_insert_rowid(storage->db);
-  sqlite3_finalize(stmt);
+  stmt_release(stmt);
+  if (storage->cache) {
+    Listing l = *listing;
+    l.id = id;
+    record_cache_put_listing(storage->cache, &l);
+  }
   if (out_listing) {
     *out_listing = *listing;
     ((Listing *)out_listing)->id = id;
@@ -445,45 +777,404 @@ StorageResult storage_listing_insert(Storage *storage, const Listing *listing,
   return STORAGE_OK;
 }
 
-StorageResult storage_listing_update(Storage *storage, const Listing *listing) {
-  if (!storage || !listing)
-    return STORAGE_INVALID;
-  const char *sql =
-      "UPDATE listings SET fid=?, note=?, sale_count=?, price=? WHERE id=?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_listing_update(Storage *base,
+                                           const Listing *listing) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_LISTING_UPDATE];
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)listing->fid);
-  sqlite3_bind_text(stmt, 2, listing->note, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(stmt, 2, listing->note, -1, SQLITE_STATIC);
   sqlite3_bind_int64(stmt, 3, (sqlite3_int64)listing->sale_count);
   sqlite3_bind_int64(stmt, 4, (sqlite3_int64)listing->price);
   sqlite3_bind_int64(stmt, 5, (sqlite3_int64)listing->id);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
+    if (storage->cache)
+      record_cache_drop_listing(storage->cache, listing->id);
     return r;
   }
-  sqlite3_finalize(stmt);
-  return sqlite3_changes(storage->db) > 0 ? STORAGE_OK : STORAGE_NOT_FOUND;
+  stmt_release(stmt);
+  if (sqlite3_changes(storage->db) == 0) {
+    if (storage->cache)
+      record_cache_drop_listing(storage->cache, listing->id);
+    return STORAGE_NOT_FOUND;
+  }
+  if (storage->cache)
+    record_cache_put_listing(storage->cache, listing);
+  return STORAGE_OK;
 }
 
-StorageResult storage_listing_delete_by_id(Storage *storage, uint64_t id) {
-  if (!storage)
-    return STORAGE_INVALID;
-  const char *sql = "DELETE FROM listings WHERE id=?;";
-  sqlite3_stmt *stmt = NULL;
-  int rc = sqlite3_prepare_v2(storage->db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    return STORAGE_ERR;
+static StorageResult sqlite_listing_delete_by_id(Storage *base, uint64_t id) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3_stmt *stmt = storage->stmts[STMT_LISTING_DELETE];
   sqlite3_bind_int64(stmt, 1, (sqlite3_int64)id);
-  rc = sqlite3_step(stmt);
+  int rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     StorageResult r = map_sqlite_rc(rc);
-    sqlite3_finalize(stmt);
+    stmt_release(stmt);
     return r;
   }
-  sqlite3_finalize(stmt);
-  return sqlite3_changes(storage->db) > 0 ? STORAGE_OK : STORAGE_NOT_FOUND;
+  stmt_release(stmt);
+  if (sqlite3_changes(storage->db) == 0)
+    return STORAGE_NOT_FOUND;
+  if (storage->cache)
+    record_cache_drop_listing(storage->cache, id);
+  return STORAGE_OK;
+}
+
+static StorageResult sqlite_purchase_listing(Storage *base, uint64_t listing_id,
+                                             uint64_t buyer_uid, uint64_t price,
+                                             uint64_t fee, Flag *out_flag) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  if (begin_tx(storage) != STORAGE_OK)
+    return STORAGE_ERR;
+
+  StorageResult r = STORAGE_ERR;
+  Flag flag = {0};
+  sqlite3_stmt *stmt = storage->stmts[STMT_PURCHASE_LOOKUP];
+  sqlite3_bind_int64(stmt, 1, (sqlite3_int64)listing_id);
+  sqlite3_bind_int64(stmt, 2, (sqlite3_int64)price);
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    flag.id = (uint64_t)sqlite3_column_int64(stmt, 0);
+    flag.uid = (uint64_t)sqlite3_column_int64(stmt, 1);
+    const unsigned char *sec = sqlite3_column_text(stmt, 2);
+    if (sec)
+      strncpy(flag.secret, (const char *)sec, sizeof(flag.secret) - 1);
+  }
+  stmt_release(stmt);
+  if (rc != SQLITE_ROW) {
+    r = rc == SQLITE_DONE ? STORAGE_NOT_FOUND : STORAGE_ERR;
+    goto rollback;
+  }
+  uint64_t seller_uid = flag.uid;
+
+  stmt = storage->stmts[STMT_USER_DEBIT];
+  sqlite3_bind_int64(stmt, 1, (sqlite3_int64)price);
+  sqlite3_bind_int64(stmt, 2, (sqlite3_int64)buyer_uid);
+  rc = sqlite3_step(stmt);
+  stmt_release(stmt);
+  if (rc != SQLITE_DONE)
+    goto rollback;
+  if (sqlite3_changes(storage->db) == 0) {
+    User buyer;
+    r = sqlite_user_get_by_id(base, buyer_uid, &buyer) == STORAGE_OK
+            ? STORAGE_INSUFFICIENT_FUNDS
+            : STORAGE_NOT_FOUND;
+    goto rollback;
+  }
+
+  stmt = storage->stmts[STMT_USER_CREDIT];
+  sqlite3_bind_int64(stmt, 1, (sqlite3_int64)(price - fee));
+  sqlite3_bind_int64(stmt, 2, (sqlite3_int64)seller_uid);
+  rc = sqlite3_step(stmt);
+  stmt_release(stmt);
+  if (rc != SQLITE_DONE)
+    goto rollback;
+  if (sqlite3_changes(storage->db) == 0) {
+    r = STORAGE_NOT_FOUND;
+    goto rollback;
+  }
+
+  flag.uid = buyer_uid;
+  r = sqlite_flag_insert(base, &flag, &flag);
+  if (r != STORAGE_OK)
+    goto rollback;
+  r = STORAGE_ERR;
+
+  stmt = storage->stmts[STMT_LISTING_RECORD_SALE];
+  sqlite3_bind_int64(stmt, 1, (sqlite3_int64)listing_id);
+  rc = sqlite3_step(stmt);
+  stmt_release(stmt);
+  if (rc != SQLITE_DONE)
+    goto rollback;
+
+  if (commit_tx(storage) != STORAGE_OK)
+    goto rollback;
+  if (storage->cache) {
+    record_cache_adjust_balance(storage->cache, buyer_uid, -price);
+    record_cache_adjust_balance(storage->cache, seller_uid, price - fee);
+    record_cache_record_sale(storage->cache, listing_id);
+  }
+  if (out_flag)
+    *out_flag = flag;
+  return STORAGE_OK;
+
+rollback:
+  rollback_tx(storage);
+  // storage_flag_insert caches the copy before the transaction is final.
+  if (storage->cache && flag.id && flag.uid == buyer_uid)
+    record_cache_drop_flag(storage->cache, flag.id);
+  return r;
+}
+
+static StorageResult sqlite_batch_begin(Storage *base) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  if (exec_stmt(storage, STMT_BEGIN) != STORAGE_OK)
+    return STORAGE_ERR;
+  storage->in_batch = true;
+  return STORAGE_OK;
+}
+
+// Some errors make SQLite roll the whole transaction back on its own, which
+// shows up here as autocommit being back on. Either way the cache may hold
+// writes that never landed, so it is dropped on failure.
+static StorageResult sqlite_batch_commit(Storage *base) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  storage->in_batch = false;
+  StorageResult r = STORAGE_ERR;
+  if (!sqlite3_get_autocommit(storage->db)) {
+    r = exec_stmt(storage, STMT_COMMIT);
+    if (r != STORAGE_OK)
+      rollback_tx(storage);
+  }
+  if (r != STORAGE_OK && storage->cache)
+    record_cache_clear(storage->cache);
+  return r;
+}
+
+static StorageResult sqlite_batch_rollback(Storage *base) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  storage->in_batch = false;
+  StorageResult r = STORAGE_OK;
+  if (!sqlite3_get_autocommit(storage->db))
+    r = exec_stmt(storage, STMT_ROLLBACK);
+  if (storage->cache)
+    record_cache_clear(storage->cache);
+  return r;
+}
+
+static void sqlite_stats(Storage *base, StorageStats *out) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  if (storage->cache) {
+    RecordCacheStats cs;
+    record_cache_stats(storage->cache, &cs);
+    out->cache_hits = cs.hits;
+    out->cache_misses = cs.misses;
+  }
+  out->busy_retries = storage->busy_retries;
+  out->reader_reads = storage->reader_reads;
+}
+
+// Copies the finished image at tmp_fd to fd a chunk at a time.
+static bool copy_to_fd(int tmp_fd, int fd) {
+  char buf[64 * 1024];
+  if (lseek(tmp_fd, 0, SEEK_SET) != 0)
+    return false;
+  for (;;) {
+    ssize_t n = read(tmp_fd, buf, sizeof(buf));
+    if (n == 0)
+      return true;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (!storage_write_all(fd, buf, (size_t)n))
+      return false;
+  }
+}
+
+// A file database is copied from a connection of its own, so the backup
+// never sees this handle's uncommitted writes or disturbs its statements. In
+// WAL mode that connection keeps one read transaction open for the whole
+// copy: the snapshot stays pinned without blocking writers, and their
+// commits do not restart the copy. Other journal modes only hold the read
+// lock during each step, and SQLite starts over whenever another connection
+// commits in between. The pages land in a temporary file next to the
+// database (in the temp directory for an in-memory one), unjournaled since
+// it is thrown away on failure, and are then copied to fd in chunks, so
+// memory use stays flat however large the database is.
+static StorageResult sqlite_snapshot(Storage *base, int fd,
+                                     const StorageBackupOptions *opts) {
+  SqliteStorage *storage = (SqliteStorage *)base;
+  sqlite3 *src = storage->db;
+  sqlite3 *own = NULL;
+  sqlite3 *dest = NULL;
+  sqlite3_backup *backup = NULL;
+  int rc = SQLITE_ERROR;
+  StorageResult r = STORAGE_ERR;
+  char tmp[4096];
+  int tmp_fd = -1;
+  const char *path = sqlite3_db_filename(storage->db, "main");
+  if (path && *path) {
+    if (snprintf(tmp, sizeof(tmp), "%s.snapshot-XXXXXX", path) >=
+        (int)sizeof(tmp))
+      return STORAGE_INVALID;
+  } else {
+    const char *dir = getenv("TMPDIR");
+    snprintf(tmp, sizeof(tmp), "%s/academy-bank-snapshot-XXXXXX",
+             dir && *dir ? dir : "/tmp");
+  }
+  if ((tmp_fd = mkstemp(tmp)) < 0)
+    return STORAGE_ERR;
+  if (path && *path) {
+    if (sqlite3_open_v2(path, &own, SQLITE_OPEN_READWRITE, NULL) !=
+        SQLITE_OK)
+      goto out;
+    sqlite3_busy_timeout(own, storage->busy_timeout_ms);
+    src = own;
+    if (is_wal(own) &&
+        sqlite3_exec(own, "BEGIN; SELECT count(*) FROM sqlite_schema;", NULL,
+                     NULL, NULL) != SQLITE_OK)
+      goto out;
+  }
+  if (sqlite3_open(tmp, &dest) != SQLITE_OK ||
+      sqlite3_exec(dest, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;",
+                   NULL, NULL, NULL) != SQLITE_OK ||
+      !(backup = sqlite3_backup_init(dest, "main", src, "main")))
+    goto out;
+  int busy_ms = 0;
+  while ((rc = sqlite3_backup_step(backup, opts->pages_per_step)) !=
+         SQLITE_DONE) {
+    int pause_ms = opts->pause_ms;
+    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+      // A writer holds a non-WAL database; give up after the busy timeout.
+      if (pause_ms == 0)
+        pause_ms = 1;
+      busy_ms += pause_ms;
+      if (busy_ms > storage->busy_timeout_ms)
+        break;
+    } else if (rc != SQLITE_OK) {
+      break;
+    } else {
+      busy_ms = 0;
+    }
+    storage_pause(pause_ms);
+  }
+  if (sqlite3_backup_finish(backup) == SQLITE_OK && rc == SQLITE_DONE &&
+      sqlite3_close(dest) == SQLITE_OK) {
+    dest = NULL;
+    if (copy_to_fd(tmp_fd, fd))
+      r = STORAGE_OK;
+  }
+
+out:
+  if (own && !sqlite3_get_autocommit(own))
+    (void)sqlite3_exec(own, "COMMIT;", NULL, NULL, NULL);
+  sqlite3_close(own);
+  sqlite3_close(dest);
+  close(tmp_fd);
+  unlink(tmp);
+  return r;
+}
+
+static const StorageOps SQLITE_OPS = {
+    .name = "sqlite",
+    .close = sqlite_close,
+    .user_get_by_id = sqlite_user_get_by_id,
+    .user_get_by_name = sqlite_user_get_by_name,
+    .user_insert = sqlite_user_insert,
+    .user_update = sqlite_user_update,
+    .user_delete_by_id = sqlite_user_delete_by_id,
+    .flag_get_by_id = sqlite_flag_get_by_id,
+    .page_flags_for_user = sqlite_page_flags_for_user,
+    .flag_insert = sqlite_flag_insert,
+    .flag_update = sqlite_flag_update,
+    .flag_delete_by_id = sqlite_flag_delete_by_id,
+    .listing_get_by_id = sqlite_listing_get_by_id,
+    .page_listings_for_user = sqlite_page_listings_for_user,
+    .listing_insert = sqlite_listing_insert,
+    .listing_update = sqlite_listing_update,
+    .listing_delete_by_id = sqlite_listing_delete_by_id,
+    .purchase_listing = sqlite_purchase_listing,
+    .batch_begin = sqlite_batch_begin,
+    .batch_commit = sqlite_batch_commit,
+    .batch_rollback = sqlite_batch_rollback,
+    .stats = sqlite_stats,
+    .snapshot = sqlite_snapshot,
+};
+
+StorageResult storage_sqlite_open(const char *db_path,
+                                  const StorageOptions *opts,
+                                  Storage **out_storage) {
+  SqliteStorage *s = (SqliteStorage *)calloc(1, sizeof(SqliteStorage));
+  if (!s)
+    return STORAGE_ERR;
+  int rc = sqlite3_open(db_path, &s->db);
+  if (rc != SQLITE_OK) {
+    free(s);
+    return STORAGE_ERR;
+  }
+  StorageResult r = apply_pragmas(s, opts);
+  if (r != STORAGE_OK) {
+    sqlite3_close(s->db);
+    free(s);
+    return r;
+  }
+  char *errmsg = NULL;
+  rc = sqlite3_exec(s->db, SCHEMA_SQL, NULL, NULL, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(errmsg);
+    sqlite3_close(s->db);
+    free(s);
+    return STORAGE_ERR;
+  }
+  (void)sqlite3_exec(s->db, "ALTER TABLE users ADD COLUMN pass_plain TEXT;",
+                     NULL, NULL, NULL);
+  if (opts->record_cache_entries > 0 &&
+      !(s->cache = record_cache_new((size_t)opts->record_cache_entries))) {
+    sqlite3_close(s->db);
+    free(s);
+    return STORAGE_ERR;
+  }
+  if (migrate_schema(s->db) != STORAGE_OK ||
+      prepare_statements(s) != STORAGE_OK ||
+      open_readers(s, opts) != STORAGE_OK) {
+    close_readers(s);
+    finalize_statements(s);
+    record_cache_free(s->cache);
+    sqlite3_close(s->db);
+    free(s);
+    return STORAGE_ERR;
+  }
+  s->base.ops = &SQLITE_OPS;
+  *out_storage = &s->base;
+  return STORAGE_OK;
+}
+
+// Each page scan and the index it must search through. Without one the
+// scan reads every flag or listing in the bank.
+static const struct {
+  StmtId stmt;
+  const char *index;
+} PLAN_CHECKS[] = {
+    {STMT_FLAG_PAGE_FOR_USER, "idx_flags_uid"},
+    {STMT_LISTING_PAGE_FOR_USER, "idx_listings_fid"},
+};
+
+bool storage_sqlite_check_plans(Storage *storage, FILE *out) {
+  if (storage->ops != &SQLITE_OPS)
+    return false;
+  SqliteStorage *s = (SqliteStorage *)storage;
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(PLAN_CHECKS) / sizeof(PLAN_CHECKS[0]); i++) {
+    char sql[512];
+    snprintf(sql, sizeof(sql), "EXPLAIN QUERY PLAN %s",
+             STMT_SQL[PLAN_CHECKS[i].stmt]);
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(s->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+      return false;
+    bool searched = false, scanned = false;
+    fprintf(out, "%s\n", STMT_SQL[PLAN_CHECKS[i].stmt]);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+      if (!detail)
+        continue;
+      fprintf(out, "  %s\n", detail);
+      if (strncmp(detail, "SCAN", 4) == 0)
+        scanned = true;
+      if (strncmp(detail, "SEARCH", 6) == 0 &&
+          strstr(detail, PLAN_CHECKS[i].index))
+        searched = true;
+    }
+    sqlite3_finalize(stmt);
+    if (!searched || scanned) {
+      fprintf(out, "  FAIL: expected SEARCH ... USING INDEX %s\n",
+              PLAN_CHECKS[i].index);
+      ok = false;
+    }
+  }
+  return ok;
 }
@@ -113,6 +113,104 @@ def decrypt_data():
         return jsonify({"success": False, "error": f"Decryption failed: {str(e)}"}), 500
 
 
+def batch_items(fields):
+    """Validate a batch request; returns (items, None) or (None, error response)"""
+    if not request.is_json:
+        return None, (jsonify({"success": False, "error": "Request must be JSON"}), 400)
+
+    items = (request.get_json() or {}).get("items")
+    if not isinstance(items, list) or len(items) == 0:
+        return None, (
+            jsonify({"success": False, "error": "items must be a non-empty list"}),
+            400,
+        )
+
+    for item in items:
+        if not isinstance(item, dict) or not all(
+            isinstance(item.get(field), str) for field in fields
+        ):
+            return None, (
+                jsonify(
+                    {
+                        "success": False,
+                        "error": f"Each item needs string fields: {', '.join(fields)}",
+                    }
+                ),
+                400,
+            )
+        if len(item["password"]) == 0:
+            return None, (
+                jsonify({"success": False, "error": "Password cannot be empty"}),
+                400,
+            )
+
+    return items, None
+
+
+@app.route("/encrypt/batch", methods=["POST"])
+def encrypt_batch():
+    try:
+        items, error = batch_items(("data", "password"))
+        if error:
+            return error
+
+        encrypted = VaultCrypto.encrypt_batch(
+            [(item["data"], item["password"]) for item in items]
+        )
+        results = []
+        for encrypted_bytes in encrypted:
+            if encrypted_bytes is None:
+                results.append({"success": False, "error": "Encryption failed"})
+            else:
+                results.append(
+                    {
+                        "success": True,
+                        "encrypted_data": encrypted_bytes.hex(),
+                        "size": len(encrypted_bytes),
+                    }
+                )
+
+        return jsonify({"success": True, "results": results})
+
+    except Exception as e:
+        return jsonify({"success": False, "error": f"Encryption failed: {str(e)}"}), 500
+
+
+@app.route("/decrypt/batch", methods=["POST"])
+def decrypt_batch():
+    try:
+        items, error = batch_items(("encrypted_data", "password"))
+        if error:
+            return error
+
+        try:
+            pairs = [
+                (bytes.fromhex(item["encrypted_data"]), item["password"])
+                for item in items
+            ]
+        except ValueError:
+            return (
+                jsonify(
+                    {"success": False, "error": "Invalid hex data in encrypted_data"}
+                ),
+                400,
+            )
+
+        results = []
+        for decrypted_text in VaultCrypto.decrypt_batch(pairs):
+            if decrypted_text is None:
+                results.append({"success": False, "error": "Decryption failed"})
+            else:
+                results.append(
+                    {"success": True, "data": decrypted_text, "size": len(decrypted_text)}
+                )
+
+        return jsonify({"success": True, "results": results})
+
+    except Exception as e:
+        return jsonify({"success": False, "error": f"Decryption failed: {str(e)}"}), 500
+
+
 @app.route("/test", methods=["GET", "POST"])
 def test_crypto():
     if request.method == "GET":
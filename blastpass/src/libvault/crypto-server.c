@@ -0,0 +1,1372 @@
+// Native front end for the crypto service, a drop-in for crypto-api.py on
+// /health, /encrypt and /decrypt.
+//
+// One thread runs an epoll loop over HTTP/1.1 keep-alive connections and
+// hands every /encrypt and /decrypt request to a pool of worker threads,
+// which parse the body, run libvault and build the response. Each
+// connection has at most one request with the workers; pipelined requests
+// behind it wait in its input buffer, so responses go out in order.
+//
+// Bodies are either the JSON the Flask service takes (ciphertext as hex)
+// or, with Content-Type: application/octet-stream, the raw plaintext or
+// blob with the password in an X-Vault-Password header. Raw requests get
+// raw responses; errors are always JSON.
+//
+// JSON requests get the status and error text crypto-api.py gives, except
+// where Flask trips over a Python exception:
+// - a body that is valid JSON but not an object is answered like an object
+//   with none of the fields, where Flask may fail with a TypeError;
+// - a lone UTF-16 surrogate makes the body invalid JSON, where Flask fails
+//   to encode it;
+// - a password holding NUL fails like a wrong password, where Flask
+//   encrypts under the password cut at the NUL;
+// - decrypted text that is not UTF-8 fails like a wrong password, where
+//   Flask reports the codec's message.
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "vault.h"
+
+#define DEFAULT_PORT 3334
+#define MAX_HEADER 16384
+#define MAX_BODY (64 << 20)
+#define IDLE_TIMEOUT 60 // seconds a keep-alive connection may sit idle
+#define MAX_EVENTS 64
+#define JSON_MAX_DEPTH 64
+
+// crypto-api.py reports a failure as the exception text behind a prefix:
+// VaultCrypto's RuntimeError, or the BadRequest Flask raises for a body
+// that does not parse.
+#define ENCRYPT_FAILED "Encryption failed: Failed to encrypt data: Encryption failed"
+#define DECRYPT_FAILED "Decryption failed: Failed to decrypt data: Decryption failed"
+#define BAD_REQUEST \
+    "400 Bad Request: The browser (or proxy) sent a request that this server could not understand."
+
+struct buf {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+static int buf_reserve(struct buf* b, size_t extra)
+{
+    if (b->cap - b->len >= extra) {
+        return 0;
+    }
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap - b->len < extra) {
+        cap *= 2;
+    }
+    char* data = realloc(b->data, cap);
+    if (!data) {
+        return -1;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_append(struct buf* b, const void* data, size_t len)
+{
+    if (buf_reserve(b, len) != 0) {
+        return -1;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int buf_printf(struct buf* b, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || buf_reserve(b, n + 1) != 0) {
+        return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, n + 1, fmt, ap);
+    va_end(ap);
+    b->len += n;
+    return 0;
+}
+
+static void buf_free(struct buf* b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+// JSON
+
+static const char* json_ws(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static int hex_digit(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static int json_hex4(const char* p, const char* end, unsigned* out)
+{
+    if (end - p < 4) {
+        return -1;
+    }
+    *out = 0;
+    for (int i = 0; i < 4; i++) {
+        int d = hex_digit(p[i]);
+        if (d < 0) {
+            return -1;
+        }
+        *out = *out << 4 | d;
+    }
+    return 0;
+}
+
+static size_t utf8_put(char* out, unsigned cp)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3f);
+    out[2] = 0x80 | (cp >> 6 & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+// Counts the code points in s, or returns -1 if it is not valid UTF-8.
+static long utf8_length(const unsigned char* s, size_t len)
+{
+    long count = 0;
+    size_t i = 0;
+    while (i < len) {
+        unsigned c = s[i];
+        size_t n;
+        unsigned cp, min;
+        if (c < 0x80) {
+            n = 1, cp = c, min = 0;
+        } else if ((c & 0xe0) == 0xc0) {
+            n = 2, cp = c & 0x1f, min = 0x80;
+        } else if ((c & 0xf0) == 0xe0) {
+            n = 3, cp = c & 0x0f, min = 0x800;
+        } else if ((c & 0xf8) == 0xf0) {
+            n = 4, cp = c & 0x07, min = 0x10000;
+        } else {
+            return -1;
+        }
+        if (len - i < n) {
+            return -1;
+        }
+        for (size_t k = 1; k < n; k++) {
+            if ((s[i + k] & 0xc0) != 0x80) {
+                return -1;
+            }
+            cp = cp << 6 | (s[i + k] & 0x3f);
+        }
+        if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return -1;
+        }
+        i += n;
+        count++;
+    }
+    return count;
+}
+
+// Parses the string at *p (which points at the opening quote). When out is
+// set the decoded bytes are stored there in a malloc'd, NUL-terminated
+// buffer. Lone surrogates and invalid UTF-8 are rejected.
+static int json_string(const char** p, const char* end, char** out, size_t* out_len)
+{
+    const char* s = *p + 1;
+    char* dst = NULL;
+    size_t len = 0;
+    if (out) {
+        const char* q = s;
+        while (q < end && *q != '"') {
+            q += *q == '\\' ? 2 : 1;
+        }
+        dst = malloc(q - s + 1);
+        if (!dst) {
+            return -1;
+        }
+    }
+
+    while (s < end && *s != '"') {
+        unsigned char c = *s;
+        if (c < 0x20) {
+            break;
+        }
+        if (c != '\\') {
+            if (dst) {
+                dst[len] = c;
+            }
+            len++;
+            s++;
+            continue;
+        }
+
+        if (++s >= end) {
+            break;
+        }
+        char e = *s++;
+        char one = 0;
+        switch (e) {
+        case '"': one = '"'; break;
+        case '\\': one = '\\'; break;
+        case '/': one = '/'; break;
+        case 'b': one = '\b'; break;
+        case 'f': one = '\f'; break;
+        case 'n': one = '\n'; break;
+        case 'r': one = '\r'; break;
+        case 't': one = '\t'; break;
+        case 'u': {
+            unsigned cp;
+            if (json_hex4(s, end, &cp) != 0) {
+                goto fail;
+            }
+            s += 4;
+            if (cp >= 0xd800 && cp <= 0xdbff) {
+                unsigned lo;
+                if (end - s < 6 || s[0] != '\\' || s[1] != 'u'
+                    || json_hex4(s + 2, end, &lo) != 0 || lo < 0xdc00 || lo > 0xdfff) {
+                    goto fail;
+                }
+                s += 6;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                goto fail;
+            }
+            char tmp[4];
+            size_t n = utf8_put(tmp, cp);
+            if (dst) {
+                memcpy(dst + len, tmp, n);
+            }
+            len += n;
+            continue;
+        }
+        default:
+            goto fail;
+        }
+        if (dst) {
+            dst[len] = one;
+        }
+        len++;
+    }
+
+    if (s >= end || *s != '"') {
+        goto fail;
+    }
+    if (dst) {
+        dst[len] = '\0';
+        if (utf8_length((const unsigned char*)dst, len) < 0) {
+            goto fail;
+        }
+        *out = dst;
+        *out_len = len;
+    }
+    *p = s + 1;
+    return 0;
+
+fail:
+    free(dst);
+    return -1;
+}
+
+static int json_skip(const char** p, const char* end, int depth);
+
+static int json_skip_container(const char** p, const char* end, int depth, char close)
+{
+    const char* s = json_ws(*p + 1, end);
+    if (s < end && *s == close) {
+        *p = s + 1;
+        return 0;
+    }
+    for (;;) {
+        if (close == '}') {
+            if (s >= end || *s != '"' || json_string(&s, end, NULL, NULL) != 0) {
+                return -1;
+            }
+            s = json_ws(s, end);
+            if (s >= end || *s++ != ':') {
+                return -1;
+            }
+        }
+        if (json_skip(&s, end, depth + 1) != 0) {
+            return -1;
+        }
+        s = json_ws(s, end);
+        if (s < end && *s == ',') {
+            s = json_ws(s + 1, end);
+            continue;
+        }
+        if (s < end && *s == close) {
+            *p = s + 1;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+// Steps over one value of any type.
+static int json_skip(const char** p, const char* end, int depth)
+{
+    const char* s = json_ws(*p, end);
+    if (s >= end || depth > JSON_MAX_DEPTH) {
+        return -1;
+    }
+    *p = s;
+    switch (*s) {
+    case '"':
+        return json_string(p, end, NULL, NULL);
+    case '{':
+        return json_skip_container(p, end, depth, '}');
+    case '[':
+        return json_skip_container(p, end, depth, ']');
+    }
+
+    static const char* const literals[] = { "true", "false", "null" };
+    for (size_t i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+        size_t n = strlen(literals[i]);
+        if ((size_t)(end - s) >= n && memcmp(s, literals[i], n) == 0) {
+            *p = s + n;
+            return 0;
+        }
+    }
+
+    const char* q = s;
+    if (q < end && *q == '-') {
+        q++;
+    }
+    if (q >= end || !isdigit((unsigned char)*q)) {
+        return -1;
+    }
+    while (q < end && (isdigit((unsigned char)*q) || *q == '.' || *q == 'e' || *q == 'E'
+               || *q == '+' || *q == '-')) {
+        q++;
+    }
+    *p = q;
+    return 0;
+}
+
+struct json_field {
+    const char* name;
+    int present;
+    int is_string;
+    char* value;
+    size_t len;
+};
+
+// Parses a body holding one JSON value and picks the named members out of
+// it if it is an object; a repeated member keeps its last value. Returns -1
+// if the body is not valid JSON.
+static int json_fields(const char* p, const char* end, struct json_field* fields, int count)
+{
+    p = json_ws(p, end);
+    if (p >= end || *p != '{') {
+        if (json_skip(&p, end, 0) != 0) {
+            return -1;
+        }
+        return json_ws(p, end) == end ? 0 : -1;
+    }
+
+    p = json_ws(p + 1, end);
+    if (p < end && *p == '}') {
+        p++;
+    } else {
+        for (;;) {
+            char* name;
+            size_t name_len;
+            if (p >= end || *p != '"' || json_string(&p, end, &name, &name_len) != 0) {
+                return -1;
+            }
+            struct json_field* field = NULL;
+            for (int i = 0; i < count; i++) {
+                if (strlen(fields[i].name) == name_len && memcmp(fields[i].name, name, name_len) == 0) {
+                    field = &fields[i];
+                }
+            }
+            free(name);
+
+            p = json_ws(p, end);
+            if (p >= end || *p++ != ':') {
+                return -1;
+            }
+            p = json_ws(p, end);
+            if (field) {
+                free(field->value);
+                field->value = NULL;
+                field->present = 1;
+                field->is_string = p < end && *p == '"';
+            }
+            if (field && field->is_string) {
+                if (json_string(&p, end, &field->value, &field->len) != 0) {
+                    return -1;
+                }
+            } else if (json_skip(&p, end, 1) != 0) {
+                return -1;
+            }
+
+            p = json_ws(p, end);
+            if (p < end && *p == ',') {
+                p = json_ws(p + 1, end);
+                continue;
+            }
+            if (p < end && *p == '}') {
+                p++;
+                break;
+            }
+            return -1;
+        }
+    }
+    return json_ws(p, end) == end ? 0 : -1;
+}
+
+static int json_put_string(struct buf* b, const char* s, size_t len)
+{
+    if (buf_reserve(b, len + 2) != 0 || buf_append(b, "\"", 1) != 0) {
+        return -1;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        if (buf_append(b, s + start, i - start) != 0) {
+            return -1;
+        }
+        start = i + 1;
+        int res;
+        switch (c) {
+        case '"': res = buf_append(b, "\\\"", 2); break;
+        case '\\': res = buf_append(b, "\\\\", 2); break;
+        case '\n': res = buf_append(b, "\\n", 2); break;
+        case '\r': res = buf_append(b, "\\r", 2); break;
+        case '\t': res = buf_append(b, "\\t", 2); break;
+        default: res = buf_printf(b, "\\u%04x", c); break;
+        }
+        if (res != 0) {
+            return -1;
+        }
+    }
+    if (buf_append(b, s + start, len - start) != 0) {
+        return -1;
+    }
+    return buf_append(b, "\"", 1);
+}
+
+static int hex_encode(struct buf* b, const unsigned char* data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    if (buf_reserve(b, len * 2) != 0) {
+        return -1;
+    }
+    char* out = b->data + b->len;
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 0xf];
+    }
+    b->len += len * 2;
+    return 0;
+}
+
+// Decodes hex the way bytes.fromhex() does: whitespace may separate bytes.
+static int hex_decode(const char* s, size_t len, unsigned char** out, size_t* out_len)
+{
+    unsigned char* dst = malloc(len / 2 + 1);
+    if (!dst) {
+        return -1;
+    }
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len) {
+        if (isspace((unsigned char)s[i])) {
+            i++;
+            continue;
+        }
+        int hi = hex_digit(s[i]);
+        int lo = i + 1 < len ? hex_digit(s[i + 1]) : -1;
+        if (hi < 0 || lo < 0) {
+            free(dst);
+            return -1;
+        }
+        dst[n++] = hi << 4 | lo;
+        i += 2;
+    }
+    *out = dst;
+    *out_len = n;
+    return 0;
+}
+
+// Requests and jobs
+
+enum route {
+    ROUTE_NONE,
+    ROUTE_HEALTH,
+    ROUTE_ENCRYPT,
+    ROUTE_DECRYPT,
+};
+
+enum content {
+    CONTENT_OTHER,
+    CONTENT_JSON,
+    CONTENT_RAW,
+};
+
+struct request {
+    int parsed;
+    int post;
+    enum route route;
+    enum content content;
+    size_t header_len;
+    size_t body_len;
+    int keep_alive;
+    int expect_continue;
+    int continue_sent;
+    char* password; // X-Vault-Password, raw bodies only
+};
+
+struct conn;
+
+// A request with the workers. The body points into the connection's input
+// buffer, which is left alone until the job comes back.
+struct job {
+    struct conn* conn;
+    enum route route;
+    enum content content;
+    const char* body;
+    size_t body_len;
+    const char* password;
+    int status;
+    const char* content_type;
+    struct buf response;
+    struct job* next;
+};
+
+struct conn {
+    int fd;
+    struct buf in;
+    struct buf out;
+    size_t out_off;
+    struct request req;
+    struct job job;
+    int busy;
+    int eof;
+    int close_after;
+    int closed;
+    unsigned events;
+    time_t last_active;
+    struct conn* prev;
+    struct conn* next;
+};
+
+static void json_error(struct job* job, int status, const char* error)
+{
+    job->status = status;
+    job->content_type = "application/json";
+    job->response.len = 0;
+    buf_printf(&job->response, "{\"error\":");
+    json_put_string(&job->response, error, strlen(error));
+    buf_printf(&job->response, ",\"success\":false}\n");
+}
+
+static void run_encrypt_json(struct job* job)
+{
+    struct json_field fields[] = { { .name = "data" }, { .name = "password" } };
+    if (json_fields(job->body, job->body + job->body_len, fields, 2) != 0) {
+        json_error(job, 500, "Encryption failed: " BAD_REQUEST);
+    } else if (!fields[0].present || !fields[1].present) {
+        json_error(job, 400, "Missing required fields: data, password");
+    } else if (!fields[0].is_string || !fields[1].is_string) {
+        json_error(job, 400, "Data and password must be strings");
+    } else if (fields[1].len == 0) {
+        json_error(job, 400, "Password cannot be empty");
+    } else {
+        unsigned char* blob;
+        size_t blob_len;
+        if (memchr(fields[1].value, '\0', fields[1].len)
+            || vault_encrypt_bytes((unsigned char*)fields[0].value, fields[0].len,
+                   fields[1].value, &blob, &blob_len) != 0) {
+            json_error(job, 500, ENCRYPT_FAILED);
+        } else {
+            job->status = 200;
+            job->content_type = "application/json";
+            buf_printf(&job->response, "{\"encrypted_data\":\"");
+            hex_encode(&job->response, blob, blob_len);
+            buf_printf(&job->response, "\",\"size\":%zu,\"success\":true}\n", blob_len);
+            crypto_free(blob);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        free(fields[i].value);
+    }
+}
+
+static void run_decrypt_json(struct job* job)
+{
+    struct json_field fields[] = { { .name = "encrypted_data" }, { .name = "password" } };
+    unsigned char* blob = NULL;
+    size_t blob_len;
+    if (json_fields(job->body, job->body + job->body_len, fields, 2) != 0) {
+        json_error(job, 500, "Decryption failed: " BAD_REQUEST);
+    } else if (!fields[0].present || !fields[1].present) {
+        json_error(job, 400, "Missing required fields: encrypted_data, password");
+    } else if (!fields[0].is_string || !fields[1].is_string) {
+        json_error(job, 400, "Encrypted_data and password must be strings");
+    } else if (fields[1].len == 0) {
+        json_error(job, 400, "Password cannot be empty");
+    } else if (hex_decode(fields[0].value, fields[0].len, &blob, &blob_len) != 0) {
+        json_error(job, 400, "Invalid hex data in encrypted_data");
+    } else {
+        char* text;
+        size_t text_len;
+        long chars = -1;
+        if (!memchr(fields[1].value, '\0', fields[1].len)
+            && vault_decrypt(blob, blob_len, fields[1].value, &text, &text_len) == 0) {
+            chars = utf8_length((unsigned char*)text, text_len);
+            if (chars >= 0) {
+                job->status = 200;
+                job->content_type = "application/json";
+                buf_printf(&job->response, "{\"data\":");
+                json_put_string(&job->response, text, text_len);
+                buf_printf(&job->response, ",\"size\":%ld,\"success\":true}\n", chars);
+            }
+            crypto_free(text);
+        }
+        if (chars < 0) {
+            json_error(job, 500, DECRYPT_FAILED);
+        }
+    }
+    free(blob);
+    for (int i = 0; i < 2; i++) {
+        free(fields[i].value);
+    }
+}
+
+static void run_raw(struct job* job)
+{
+    if (!job->password) {
+        json_error(job, 400, "Missing required header: X-Vault-Password");
+        return;
+    }
+    if (!*job->password) {
+        json_error(job, 400, "Password cannot be empty");
+        return;
+    }
+
+    // The result goes straight into the response buffer. Decryption starts
+    // from a guess and, if that falls short, retries at the exact size.
+    const unsigned char* body = (const unsigned char*)job->body;
+    struct buf* out = &job->response;
+    size_t want = job->body_len * 4 > MAX_HEADER ? job->body_len * 4 : MAX_HEADER;
+    if (job->route == ROUTE_ENCRYPT) {
+        want = vault_encrypt_bound(job->body_len);
+    }
+
+    int res = VAULT_TOO_SMALL;
+    for (int attempt = 0; attempt < 2 && res == VAULT_TOO_SMALL; attempt++) {
+        if (buf_reserve(out, want) != 0) {
+            res = -1;
+            break;
+        }
+        if (job->route == ROUTE_ENCRYPT) {
+            res = vault_encrypt_into(body, job->body_len, job->password,
+                (unsigned char*)out->data, out->cap, &out->len);
+        } else {
+            res = vault_decrypt_into(body, job->body_len, job->password,
+                (unsigned char*)out->data, out->cap, &out->len);
+        }
+        want = out->len;
+        if (res != 0) {
+            out->len = 0;
+        }
+    }
+    if (res != 0) {
+        json_error(job, 500, job->route == ROUTE_ENCRYPT ? "Encryption failed" : "Decryption failed");
+        return;
+    }
+
+    job->status = 200;
+    job->content_type = "application/octet-stream";
+}
+
+static void run_job(struct job* job)
+{
+    job->response.len = 0;
+    if (job->content == CONTENT_RAW) {
+        run_raw(job);
+    } else if (job->content != CONTENT_JSON) {
+        json_error(job, 400, "Request must be JSON");
+    } else if (job->route == ROUTE_ENCRYPT) {
+        run_encrypt_json(job);
+    } else {
+        run_decrypt_json(job);
+    }
+    if (!job->response.data) {
+        json_error(job, 500, "Out of memory");
+    }
+}
+
+// Worker pool. Finished jobs are queued for the loop and announced on an
+// eventfd.
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static struct job* pool_queue;
+static struct job** pool_queue_tail = &pool_queue;
+static struct job* pool_done;
+static int pool_fd = -1;
+
+static void* pool_worker(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (!pool_queue) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+        struct job* job = pool_queue;
+        pool_queue = job->next;
+        if (!pool_queue) {
+            pool_queue_tail = &pool_queue;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        run_job(job);
+
+        pthread_mutex_lock(&pool_lock);
+        job->next = pool_done;
+        pool_done = job;
+        pthread_mutex_unlock(&pool_lock);
+
+        uint64_t one = 1;
+        while (write(pool_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+    }
+    return NULL;
+}
+
+// Starts up to threads workers and returns how many started, or -1 if
+// none did.
+static long pool_start(long threads)
+{
+    pool_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool_fd < 0) {
+        return -1;
+    }
+    long started = 0;
+    while (started < threads) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+    return started ? started : -1;
+}
+
+static void pool_submit(struct job* job)
+{
+    pthread_mutex_lock(&pool_lock);
+    job->next = NULL;
+    *pool_queue_tail = job;
+    pool_queue_tail = &job->next;
+    pthread_cond_signal(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Connections
+
+static int epfd;
+static struct conn* conns;
+static int conns_closed;
+
+static void conn_free(struct conn* c)
+{
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    buf_free(&c->in);
+    buf_free(&c->out);
+    buf_free(&c->job.response);
+    free(c->req.password);
+    free(c);
+}
+
+// Closes the socket now. The memory goes in conn_reap(), once the events
+// already fetched have been handled and no job refers to it.
+static void conn_close(struct conn* c)
+{
+    if (!c->closed) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->closed = 1;
+        conns_closed++;
+    }
+}
+
+static void conn_reap()
+{
+    struct conn* c = conns;
+    while (c && conns_closed) {
+        struct conn* next = c->next;
+        if (c->closed && !c->busy) {
+            conn_free(c);
+            conns_closed--;
+        }
+        c = next;
+    }
+}
+
+static void conn_watch(struct conn* c)
+{
+    unsigned events = 0;
+    if (c->out_off < c->out.len) {
+        events |= EPOLLOUT;
+    } else if (!c->busy && !c->eof && !c->close_after) {
+        events |= EPOLLIN;
+    }
+    if (events != c->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+static const char* status_text(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    default: return "Internal Server Error";
+    }
+}
+
+static void conn_respond(struct conn* c, int status, const char* content_type,
+    const char* body, size_t body_len)
+{
+    if (buf_printf(&c->out,
+            "HTTP/1.1 %d %s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: %s\r\n"
+            "\r\n",
+            status, status_text(status), content_type, body_len,
+            c->close_after ? "close" : "keep-alive")
+            != 0
+        || buf_append(&c->out, body, body_len) != 0) {
+        c->close_after = 1;
+    }
+}
+
+// Answers the current request from the loop itself; failures that leave
+// the stream out of step close the connection once the reply is out.
+static void conn_error(struct conn* c, int status, const char* error, int fatal)
+{
+    struct job job = { 0 };
+    if (fatal) {
+        c->close_after = 1;
+    }
+    json_error(&job, status, error);
+    conn_respond(c, status, job.content_type, job.response.data, job.response.len);
+    buf_free(&job.response);
+}
+
+static int header_is(const char* name, size_t name_len, const char* want)
+{
+    return name_len == strlen(want) && strncasecmp(name, want, name_len) == 0;
+}
+
+static int value_has(const char* value, size_t len, const char* token)
+{
+    size_t n = strlen(token);
+    for (size_t i = 0; i + n <= len; i++) {
+        if (strncasecmp(value + i, token, n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Parses the request line and headers once they are all buffered. Returns
+// 1 when parsed, 0 when more input is needed and -1 after answering a
+// request that cannot be served.
+static int parse_request(struct conn* c)
+{
+    struct request* req = &c->req;
+    const char* data = c->in.data;
+    size_t scan = c->in.len < MAX_HEADER ? c->in.len : MAX_HEADER;
+    const char* head_end = data ? memmem(data, scan, "\r\n\r\n", 4) : NULL;
+    if (!head_end) {
+        if (c->in.len >= MAX_HEADER) {
+            conn_error(c, 431, "Request headers too large", 1);
+            return -1;
+        }
+        return 0;
+    }
+
+    memset(req, 0, sizeof(*req));
+    req->header_len = head_end - data + 4;
+
+    const char* line_end = memmem(data, req->header_len, "\r\n", 2);
+    const char* sp1 = memchr(data, ' ', line_end - data);
+    const char* sp2 = sp1 ? memchr(sp1 + 1, ' ', line_end - sp1 - 1) : NULL;
+    if (!sp2) {
+        conn_error(c, 400, "Malformed request line", 1);
+        return -1;
+    }
+
+    req->post = sp1 - data == 4 && memcmp(data, "POST", 4) == 0;
+    int get = sp1 - data == 3 && memcmp(data, "GET", 3) == 0;
+    const char* path = sp1 + 1;
+    size_t path_len = sp2 - path;
+    const char* query = memchr(path, '?', path_len);
+    if (query) {
+        path_len = query - path;
+    }
+    if (path_len == 7 && memcmp(path, "/health", 7) == 0) {
+        req->route = ROUTE_HEALTH;
+    } else if (path_len == 8 && memcmp(path, "/encrypt", 8) == 0) {
+        req->route = ROUTE_ENCRYPT;
+    } else if (path_len == 8 && memcmp(path, "/decrypt", 8) == 0) {
+        req->route = ROUTE_DECRYPT;
+    }
+    if (req->route == ROUTE_HEALTH && !get) {
+        req->route = ROUTE_NONE;
+        req->post = -1;
+    }
+
+    int http10 = line_end - sp2 - 1 == 8 && memcmp(sp2 + 1, "HTTP/1.0", 8) == 0;
+    req->keep_alive = !http10;
+
+    int chunked = 0;
+    const char* line = line_end + 2;
+    while (line < head_end + 2) {
+        const char* next = memmem(line, head_end + 2 - line, "\r\n", 2);
+        const char* colon = memchr(line, ':', next - line);
+        if (!colon) {
+            conn_error(c, 400, "Malformed header", 1);
+            return -1;
+        }
+        const char* value = colon + 1;
+        while (value < next && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        size_t value_len = next - value;
+        while (value_len && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+            value_len--;
+        }
+        size_t name_len = colon - line;
+
+        if (header_is(line, name_len, "Content-Length")) {
+            char* num_end;
+            errno = 0;
+            unsigned long long n = strtoull(value, &num_end, 10);
+            if (!isdigit((unsigned char)*value) || num_end != value + value_len || errno) {
+                conn_error(c, 400, "Invalid Content-Length", 1);
+                return -1;
+            }
+            if (n > MAX_BODY) {
+                conn_error(c, 413, "Request body too large", 1);
+                return -1;
+            }
+            req->body_len = n;
+        } else if (header_is(line, name_len, "Transfer-Encoding")) {
+            chunked = 1;
+        } else if (header_is(line, name_len, "Connection")) {
+            if (value_has(value, value_len, "close")) {
+                req->keep_alive = 0;
+            } else if (value_has(value, value_len, "keep-alive")) {
+                req->keep_alive = 1;
+            }
+        } else if (header_is(line, name_len, "Expect")) {
+            req->expect_continue = value_has(value, value_len, "100-continue");
+        } else if (header_is(line, name_len, "Content-Type")) {
+            if (value_len >= 16 && strncasecmp(value, "application/json", 16) == 0) {
+                req->content = CONTENT_JSON;
+            } else if (value_len >= 24 && strncasecmp(value, "application/octet-stream", 24) == 0) {
+                req->content = CONTENT_RAW;
+            }
+        } else if (header_is(line, name_len, "X-Vault-Password")) {
+            free(req->password);
+            req->password = strndup(value, value_len);
+        }
+        line = next + 2;
+    }
+
+    if (chunked) {
+        conn_error(c, 411, "Chunked bodies are not supported", 1);
+        return -1;
+    }
+    req->parsed = 1;
+    return 1;
+}
+
+static void conn_finish_request(struct conn* c)
+{
+    size_t used = c->req.header_len + c->req.body_len;
+    memmove(c->in.data, c->in.data + used, c->in.len - used);
+    c->in.len -= used;
+    if (!c->req.keep_alive) {
+        c->close_after = 1;
+    }
+    free(c->req.password);
+    memset(&c->req, 0, sizeof(c->req));
+    if (c->in.len == 0 && c->in.cap > MAX_HEADER) {
+        buf_free(&c->in);
+    }
+}
+
+// Serves every complete request in the input buffer until one is handed to
+// the workers.
+static void conn_process(struct conn* c)
+{
+    while (!c->busy && !c->close_after) {
+        if (!c->req.parsed) {
+            int res = parse_request(c);
+            if (res < 0) {
+                break;
+            }
+            if (res == 0) {
+                if (c->eof) {
+                    c->close_after = 1;
+                }
+                break;
+            }
+        }
+
+        struct request* req = &c->req;
+        if (c->in.len < req->header_len + req->body_len) {
+            if (c->eof) {
+                c->close_after = 1;
+            } else if (req->expect_continue && !req->continue_sent) {
+                buf_printf(&c->out, "HTTP/1.1 100 Continue\r\n\r\n");
+                req->continue_sent = 1;
+            }
+            break;
+        }
+
+        if (!req->keep_alive) {
+            c->close_after = 1;
+        }
+        if (req->route == ROUTE_NONE) {
+            if (req->post < 0) {
+                conn_error(c, 405, "Method not allowed for this endpoint", 0);
+            } else {
+                conn_error(c, 404, "Endpoint not found", 0);
+            }
+        } else if (req->route != ROUTE_HEALTH && !req->post) {
+            conn_error(c, 405, "Method not allowed for this endpoint", 0);
+        } else if (req->route == ROUTE_HEALTH) {
+            static const char health[]
+                = "{\"service\":\"crypto-api\",\"status\":\"healthy\",\"version\":\"1.0\"}\n";
+            conn_respond(c, 200, "application/json", health, sizeof(health) - 1);
+        } else {
+            struct job* job = &c->job;
+            job->conn = c;
+            job->route = req->route;
+            job->content = req->content;
+            job->body = c->in.data + req->header_len;
+            job->body_len = req->body_len;
+            job->password = req->password;
+            c->busy = 1;
+            pool_submit(job);
+            break;
+        }
+        conn_finish_request(c);
+    }
+}
+
+static void conn_flush(struct conn* c)
+{
+    while (c->out_off < c->out.len) {
+        ssize_t n = write(c->fd, c->out.data + c->out_off, c->out.len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                conn_close(c);
+                return;
+            }
+            break;
+        }
+        c->out_off += n;
+    }
+    if (c->out_off == c->out.len) {
+        c->out.len = c->out_off = 0;
+        if (c->close_after && !c->busy) {
+            conn_close(c);
+            return;
+        }
+    }
+    conn_watch(c);
+}
+
+static void conn_read(struct conn* c, unsigned events)
+{
+    // A job still reads the body in place, so the buffer must stay put.
+    if (c->busy) {
+        if (events & EPOLLHUP) {
+            conn_close(c);
+        }
+        return;
+    }
+
+    for (;;) {
+        size_t want = MAX_HEADER;
+        if (c->req.parsed) {
+            want = c->req.header_len + c->req.body_len;
+        }
+        if (c->in.len >= want) {
+            break;
+        }
+        if (buf_reserve(&c->in, want - c->in.len) != 0) {
+            c->close_after = 1;
+            break;
+        }
+        ssize_t n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                conn_close(c);
+                return;
+            }
+            break;
+        }
+        if (n == 0) {
+            c->eof = 1;
+            break;
+        }
+        c->in.len += n;
+        if (!c->req.parsed && parse_request(c) < 0) {
+            break;
+        }
+    }
+    c->last_active = time(NULL);
+    conn_process(c);
+    conn_flush(c);
+}
+
+static void jobs_done()
+{
+    uint64_t count;
+    while (read(pool_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    struct job* done = pool_done;
+    pool_done = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    while (done) {
+        struct job* job = done;
+        done = job->next;
+        struct conn* c = job->conn;
+        c->busy = 0;
+        if (c->closed) {
+            continue;
+        }
+        conn_respond(c, job->status, job->content_type, job->response.data, job->response.len);
+        if (job->response.cap > MAX_HEADER) {
+            buf_free(&job->response);
+        }
+        conn_finish_request(c);
+        c->last_active = time(NULL);
+        conn_process(c);
+        conn_flush(c);
+    }
+}
+
+static void accept_all(int listen_fd)
+{
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct conn* c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        c->last_active = time(NULL);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->next = conns;
+        if (conns) {
+            conns->prev = c;
+        }
+        conns = c;
+    }
+}
+
+static void close_idle()
+{
+    time_t now = time(NULL);
+    struct conn* c = conns;
+    while (c) {
+        struct conn* next = c->next;
+        if (!c->busy && !c->closed && now - c->last_active > IDLE_TIMEOUT) {
+            conn_close(c);
+        }
+        c = next;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "usage: %s [port]\n", argv[0]);
+        return 1;
+    }
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* env = getenv("VAULT_THREADS");
+    if (env && *env) {
+        threads = atol(env);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    crypto_init();
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // Only the web app on this host talks to the crypto service.
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(listen_fd, SOMAXCONN) != 0) {
+        perror("listen");
+        return 1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0 || (threads = pool_start(threads)) < 0) {
+        perror("startup");
+        return 1;
+    }
+
+    static int listen_token, pool_token;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_token };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &pool_token;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, pool_fd, &ev);
+
+    printf("Starting crypto API server on http://127.0.0.1:%d (%ld workers)\n", port, threads);
+    fflush(stdout);
+
+    time_t last_sweep = time(NULL);
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &listen_token) {
+                accept_all(listen_fd);
+                continue;
+            }
+            if (ptr == &pool_token) {
+                jobs_done();
+                continue;
+            }
+
+            struct conn* c = ptr;
+            if (c->closed) {
+                continue;
+            }
+            if (events[i].events & EPOLLERR) {
+                conn_close(c);
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+                conn_read(c, events[i].events);
+            } else if (events[i].events & EPOLLOUT) {
+                conn_flush(c);
+            }
+        }
+
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            close_idle();
+            last_sweep = now;
+        }
+        conn_reap();
+    }
+}
@@ -1,97 +1,296 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <zlib.h>
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 
+#include "vault.h"
+
 #define SALT_SIZE 16
 #define IV_SIZE 16
 #define KEY_SIZE 32 // 256 bits for AES-256
 #define PBKDF2_ITERATIONS 100000
+#define DIGEST_SIZE 32 // HMAC-SHA256
+#define KEY_CACHE_SLOTS 32
+#define KEY_CACHE_TTL 300 // seconds; VAULT_KEY_CACHE_TTL overrides, 0 disables
+
+// Keys derived by PBKDF2 are cached so that a decrypt followed by an
+// encrypt under the same password costs one derivation. The cache lives in
+// pages locked into RAM and left out of core dumps. An entry is keyed by
+// the salt and an HMAC of the password under a random per-process key, so
+// the cache never holds anything cheaper to attack than the vaults. Entries
+// expire KEY_CACHE_TTL seconds after the derivation however often they are
+// used. A sweeper thread wipes them when they expire, whether or not the
+// cache is used again, and evicted entries are wiped when replaced.
+struct key_cache_entry {
+    unsigned char digest[DIGEST_SIZE];
+    unsigned char salt[SALT_SIZE];
+    unsigned char key[KEY_SIZE];
+    time_t derived;
+    unsigned long used;
+    int valid;
+};
+
+struct key_cache {
+    unsigned char hmac_key[DIGEST_SIZE];
+    struct key_cache_entry entries[KEY_CACHE_SLOTS];
+};
+
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct key_cache* key_cache;
+static size_t key_cache_size;
+static int key_cache_ttl = KEY_CACHE_TTL;
+static unsigned long key_cache_clock;
+
+static time_t monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
 
-int crypto_init()
+static void key_cache_wipe(struct key_cache_entry* entry)
 {
-    OpenSSL_add_all_algorithms();
-    ERR_load_crypto_strings();
-    return 0;
+    OPENSSL_cleanse(entry, sizeof(*entry));
 }
 
-void crypto_cleanup()
+// Wipes expired entries and returns the seconds until the next one
+// expires. Called with key_cache_lock held.
+static time_t key_cache_expire()
 {
-    EVP_cleanup();
-    ERR_free_strings();
+    time_t now = monotonic_seconds();
+    time_t wait = key_cache_ttl > 0 ? key_cache_ttl : 1;
+    for (int i = 0; i < KEY_CACHE_SLOTS; i++) {
+        struct key_cache_entry* entry = &key_cache->entries[i];
+        if (!entry->valid)
+            continue;
+        time_t left = entry->derived + key_cache_ttl - now;
+        if (left <= 0)
+            key_cache_wipe(entry);
+        else if (left < wait)
+            wait = left;
+    }
+    return wait;
 }
 
-int derive_key(const char* password, const unsigned char* salt, unsigned char* key)
+// Sleeps until the oldest entry is due and wipes it. An entry stored while
+// the sweeper sleeps expires no earlier than the wake-up, since every sleep
+// is at most the TTL.
+static void* key_cache_sweeper(void* arg)
 {
-    if (!PKCS5_PBKDF2_HMAC(password, strlen(password), salt, SALT_SIZE,
-            PBKDF2_ITERATIONS, EVP_sha256(), KEY_SIZE, key)) {
-        return -1;
-    }
-    return 0;
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&key_cache_lock);
+        time_t wait = key_cache_expire();
+        pthread_mutex_unlock(&key_cache_lock);
+        sleep(wait);
+    }
+    return NULL;
 }
 
-int compress_data(const unsigned char* data, size_t data_len,
-    unsigned char** compressed, size_t* compressed_len)
+// Maps and locks the cache and starts its sweeper on first use. Called with
+// key_cache_lock held. If the pages cannot be locked or the sweeper cannot
+// start, the cache stays off rather than risk swapping keys out or keeping
+// them past their TTL.
+static int key_cache_open()
 {
-    *compressed_len = data_len + 64;
-    *compressed = malloc(*compressed_len);
-    if (!*compressed) {
+    if (key_cache)
+        return 0;
+    if (key_cache_ttl <= 0)
+        return -1;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (sizeof(struct key_cache) + page - 1) / page * page;
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        key_cache_ttl = 0;
+        return -1;
+    }
+    if (mlock(mem, size) != 0) {
+        munmap(mem, size);
+        key_cache_ttl = 0;
+        return -1;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(mem, size, MADV_DONTDUMP);
+#endif
+
+    struct key_cache* cache = mem;
+    if (RAND_bytes(cache->hmac_key, DIGEST_SIZE) != 1) {
+        munlock(mem, size);
+        munmap(mem, size);
+        key_cache_ttl = 0;
         return -1;
     }
 
-    int res = compress((Bytef*)*compressed, (uLongf*)compressed_len, (Bytef*)data, data_len);
-    if (res != Z_OK) {
-        free(*compressed);
-        *compressed = NULL;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int started = pthread_create(&thread, &attr, key_cache_sweeper, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started) {
+        OPENSSL_cleanse(cache, size);
+        munlock(mem, size);
+        munmap(mem, size);
+        key_cache_ttl = 0;
         return -1;
     }
 
+    key_cache = cache;
+    key_cache_size = size;
     return 0;
 }
 
-int decompress_data(const unsigned char* compressed, size_t compressed_len,
-    unsigned char** data, size_t* data_len)
+// Opens the cache, drops expired entries and computes the password digest.
+// Called with key_cache_lock held; returns -1 if the cache is off.
+static int key_cache_prepare(const char* password, unsigned char* digest)
 {
-    size_t buffer_size = compressed_len * 4;
-    *data = malloc(buffer_size);
-    if (!*data) {
+    if (key_cache_open() != 0)
+        return -1;
+
+    key_cache_expire();
+
+    if (!HMAC(EVP_sha256(), key_cache->hmac_key, DIGEST_SIZE,
+            (const unsigned char*)password, strlen(password), digest, NULL)) {
         return -1;
     }
+    return 0;
+}
 
-    *data_len = buffer_size;
-    int res = uncompress((Bytef*)*data, (uLongf*)data_len, (Bytef*)compressed, compressed_len);
-    
-    while (res == Z_BUF_ERROR) {
-        buffer_size *= 2;
-        *data = realloc(*data, buffer_size);
-        if (!*data) {
-            return -1;
+// Finds the key for password under salt, or when salt is NULL the most
+// recently used key for password and the salt it was derived with.
+static int key_cache_get(const char* password, const unsigned char* salt,
+    unsigned char* salt_out, unsigned char* key)
+{
+    unsigned char digest[DIGEST_SIZE];
+    struct key_cache_entry* found = NULL;
+
+    pthread_mutex_lock(&key_cache_lock);
+    if (key_cache_prepare(password, digest) == 0) {
+        for (int i = 0; i < KEY_CACHE_SLOTS; i++) {
+            struct key_cache_entry* entry = &key_cache->entries[i];
+            if (!entry->valid || CRYPTO_memcmp(entry->digest, digest, DIGEST_SIZE) != 0)
+                continue;
+            if (salt && memcmp(entry->salt, salt, SALT_SIZE) != 0)
+                continue;
+            if (!found || entry->used > found->used)
+                found = entry;
         }
-        *data_len = buffer_size;
-        res = uncompress((Bytef*)*data, (uLongf*)data_len, (Bytef*)compressed, compressed_len);
     }
+    if (found) {
+        found->used = ++key_cache_clock;
+        if (salt_out)
+            memcpy(salt_out, found->salt, SALT_SIZE);
+        memcpy(key, found->key, KEY_SIZE);
+    }
+    pthread_mutex_unlock(&key_cache_lock);
 
-    if (res != Z_OK) {
-        free(*data);
-        *data = NULL;
-        return -1;
+    OPENSSL_cleanse(digest, DIGEST_SIZE);
+    return found ? 0 : -1;
+}
+
+// Stores a freshly derived key, evicting the least recently used entry
+// when every slot is taken.
+static void key_cache_put(const char* password, const unsigned char* salt,
+    const unsigned char* key)
+{
+    unsigned char digest[DIGEST_SIZE];
+
+    pthread_mutex_lock(&key_cache_lock);
+    if (key_cache_prepare(password, digest) == 0) {
+        struct key_cache_entry* slot = NULL;
+        for (int i = 0; i < KEY_CACHE_SLOTS; i++) {
+            struct key_cache_entry* entry = &key_cache->entries[i];
+            if (!entry->valid) {
+                slot = entry;
+                break;
+            }
+            if (!slot || entry->used < slot->used)
+                slot = entry;
+        }
+        key_cache_wipe(slot);
+        memcpy(slot->digest, digest, DIGEST_SIZE);
+        memcpy(slot->salt, salt, SALT_SIZE);
+        memcpy(slot->key, key, KEY_SIZE);
+        slot->derived = monotonic_seconds();
+        slot->used = ++key_cache_clock;
+        slot->valid = 1;
+    }
+    pthread_mutex_unlock(&key_cache_lock);
+
+    OPENSSL_cleanse(digest, DIGEST_SIZE);
+}
+
+void vault_key_cache_clear()
+{
+    pthread_mutex_lock(&key_cache_lock);
+    if (key_cache) {
+        for (int i = 0; i < KEY_CACHE_SLOTS; i++)
+            key_cache_wipe(&key_cache->entries[i]);
+    }
+    pthread_mutex_unlock(&key_cache_lock);
+}
+
+int crypto_init()
+{
+    OpenSSL_add_all_algorithms();
+    ERR_load_crypto_strings();
+
+    const char* ttl = getenv("VAULT_KEY_CACHE_TTL");
+    if (ttl && *ttl) {
+        pthread_mutex_lock(&key_cache_lock);
+        key_cache_ttl = atoi(ttl);
+        pthread_mutex_unlock(&key_cache_lock);
     }
+    return 0;
+}
+
+void crypto_cleanup()
+{
+    vault_key_cache_clear();
+    EVP_cleanup();
+    ERR_free_strings();
+}
 
+int derive_key(const char* password, const unsigned char* salt, unsigned char* key)
+{
+    if (key_cache_get(password, salt, NULL, key) == 0) {
+        return 0;
+    }
+    if (!PKCS5_PBKDF2_HMAC(password, strlen(password), salt, SALT_SIZE,
+            PBKDF2_ITERATIONS, EVP_sha256(), KEY_SIZE, key)) {
+        return -1;
+    }
+    key_cache_put(password, salt, key);
     return 0;
 }
 
-int encrypt_data(const unsigned char* plaintext, size_t plaintext_len,
+// Compression and encryption run as one pass over CHUNK_SIZE pieces: deflate
+// fills a small buffer that the cipher encrypts straight into the blob, and
+// on the way back each decrypted piece is inflated straight into the result.
+// Neither direction keeps an intermediate copy of the payload.
+#define CHUNK_SIZE 16384
+#define HEADER_SIZE (SALT_SIZE + IV_SIZE)
+
+// Compresses and encrypts data into out, which must hold out_size >=
+// compressBound(data_len) bytes, and sets *out_len to the bytes written.
+static int seal_stream(const unsigned char* data, size_t data_len,
     const unsigned char* key, const unsigned char* iv,
-    unsigned char** ciphertext, size_t* ciphertext_len)
+    unsigned char* out, size_t out_size, size_t* out_len)
 {
-
     EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
     if (!ctx) {
         return -1;
@@ -102,39 +301,81 @@ int encrypt_data(const unsigned char* plaintext, size_t plaintext_len,
         return -1;
     }
 
-    *ciphertext_len = plaintext_len;
-    *ciphertext = malloc(*ciphertext_len);
-    if (!*ciphertext) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
         EVP_CIPHER_CTX_free(ctx);
         return -1;
     }
 
-    int len;
-    if (EVP_EncryptUpdate(ctx, *ciphertext, &len, plaintext, plaintext_len) != 1) {
-        free(*ciphertext);
-        *ciphertext = NULL;
-        EVP_CIPHER_CTX_free(ctx);
-        return -1;
+    unsigned char chunk[CHUNK_SIZE];
+    size_t consumed = 0;
+    size_t written = 0;
+    int flush = Z_NO_FLUSH;
+    int res = Z_OK;
+    while (res == Z_OK) {
+        if (strm.avail_in == 0 && flush == Z_NO_FLUSH) {
+            size_t take = data_len - consumed;
+            if (take > UINT_MAX) {
+                take = UINT_MAX;
+            }
+            strm.next_in = (Bytef*)data + consumed;
+            strm.avail_in = take;
+            consumed += take;
+            if (consumed == data_len) {
+                flush = Z_FINISH;
+            }
+        }
+
+        strm.next_out = chunk;
+        strm.avail_out = CHUNK_SIZE;
+        res = deflate(&strm, flush);
+        if (res != Z_OK && res != Z_STREAM_END) {
+            break;
+        }
+
+        size_t have = CHUNK_SIZE - strm.avail_out;
+        int len = 0;
+        if (have > out_size - written
+            || (have && EVP_EncryptUpdate(ctx, out + written, &len, chunk, have) != 1)) {
+            res = Z_BUF_ERROR;
+            break;
+        }
+        written += len;
     }
 
-    int final_len;
-    if (EVP_EncryptFinal_ex(ctx, *ciphertext + len, &final_len) != 1) {
-        free(*ciphertext);
-        *ciphertext = NULL;
-        EVP_CIPHER_CTX_free(ctx);
-        return -1;
+    int final_len = 0;
+    if (res == Z_STREAM_END && EVP_EncryptFinal_ex(ctx, out + written, &final_len) != 1) {
+        res = Z_BUF_ERROR;
     }
 
-    *ciphertext_len = len + final_len;
+    deflateEnd(&strm);
     EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_cleanse(chunk, CHUNK_SIZE);
+    if (res != Z_STREAM_END) {
+        return -1;
+    }
+
+    *out_len = written + final_len;
     return 0;
 }
 
-int decrypt_data(const unsigned char* ciphertext, size_t ciphertext_len,
-    const unsigned char* key, const unsigned char* iv,
-    unsigned char** plaintext, size_t* plaintext_len)
+// Where open_stream puts the plaintext. A growable sink is a malloc'd
+// buffer that doubles when full and keeps one byte back for a terminator;
+// inflate carries on where it stopped, so growing never redoes any work.
+// A fixed sink is the caller's buffer: once it is full the rest is
+// inflated into scratch space and only counted, so len ends up as the size
+// the caller needs.
+struct sink {
+    char* data;
+    size_t size;
+    size_t len;
+    int grow;
+};
+
+static int open_stream(const unsigned char* in, size_t in_len,
+    const unsigned char* key, const unsigned char* iv, struct sink* sink)
 {
-
     EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
     if (!ctx) {
         return -1;
@@ -145,122 +386,342 @@ int decrypt_data(const unsigned char* ciphertext, size_t ciphertext_len,
         return -1;
     }
 
-    *plaintext = malloc(ciphertext_len);
-    if (!*plaintext) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK) {
         EVP_CIPHER_CTX_free(ctx);
         return -1;
     }
 
-    int len;
-    if (EVP_DecryptUpdate(ctx, *plaintext, &len, ciphertext, ciphertext_len) != 1) {
-        free(*plaintext);
-        *plaintext = NULL;
-        EVP_CIPHER_CTX_free(ctx);
-        return -1;
-    }
+    size_t limit = sink->grow ? sink->size - 1 : sink->size;
+    unsigned char chunk[CHUNK_SIZE];
+    unsigned char scratch[CHUNK_SIZE];
+    size_t consumed = 0;
+    int res = Z_OK;
+    while (res == Z_OK || res == Z_BUF_ERROR) {
+        if (strm.avail_in == 0) {
+            if (consumed == in_len) {
+                break;
+            }
+            size_t take = in_len - consumed;
+            if (take > CHUNK_SIZE) {
+                take = CHUNK_SIZE;
+            }
+            int len;
+            if (EVP_DecryptUpdate(ctx, chunk, &len, in + consumed, take) != 1) {
+                break;
+            }
+            consumed += take;
+            strm.next_in = chunk;
+            strm.avail_in = len;
+        }
 
-    int final_len;
-    if (EVP_DecryptFinal_ex(ctx, *plaintext + len, &final_len) != 1) {
-        free(*plaintext);
-        *plaintext = NULL;
-        EVP_CIPHER_CTX_free(ctx);
-        return -1;
+        if (sink->len >= limit && sink->grow) {
+            char* grown = realloc(sink->data, sink->size * 2);
+            if (!grown) {
+                break;
+            }
+            sink->data = grown;
+            sink->size *= 2;
+            limit = sink->size - 1;
+        }
+
+        size_t room = CHUNK_SIZE;
+        strm.next_out = scratch;
+        if (sink->len < limit) {
+            room = limit - sink->len;
+            if (room > UINT_MAX) {
+                room = UINT_MAX;
+            }
+            strm.next_out = (Bytef*)sink->data + sink->len;
+        }
+        strm.avail_out = room;
+        res = inflate(&strm, Z_NO_FLUSH);
+        sink->len += room - strm.avail_out;
     }
 
-    *plaintext_len = len + final_len;
+    inflateEnd(&strm);
     EVP_CIPHER_CTX_free(ctx);
-    return 0;
+    OPENSSL_cleanse(chunk, CHUNK_SIZE);
+    OPENSSL_cleanse(scratch, CHUNK_SIZE);
+    return res == Z_STREAM_END ? 0 : -1;
 }
 
-int vault_encrypt(const char* data, const char* password,
-    unsigned char** output, size_t* output_len)
+static int open_blob(const unsigned char* input, size_t input_len, const char* password,
+    struct sink* sink)
 {
-
-    unsigned char salt[SALT_SIZE], iv[IV_SIZE];
-    if (RAND_bytes(salt, SALT_SIZE) != 1 || RAND_bytes(iv, IV_SIZE) != 1) {
+    if (input_len < HEADER_SIZE) {
         return -1;
     }
 
+    const unsigned char* salt = input;
+    const unsigned char* iv = input + SALT_SIZE;
+    const unsigned char* encrypted = input + HEADER_SIZE;
+    size_t encrypted_len = input_len - HEADER_SIZE;
+
     unsigned char key[KEY_SIZE];
     if (derive_key(password, salt, key) != 0) {
+        OPENSSL_cleanse(key, KEY_SIZE);
         return -1;
     }
 
-    unsigned char* compressed;
-    size_t compressed_len;
-    if (compress_data((unsigned char*)data, strlen(data), &compressed, &compressed_len) != 0) {
+    int res = open_stream(encrypted, encrypted_len, key, iv, sink);
+    OPENSSL_cleanse(key, KEY_SIZE);
+    return res;
+}
+
+size_t vault_encrypt_bound(size_t data_len)
+{
+    return HEADER_SIZE + compressBound(data_len);
+}
+
+int vault_encrypt_into(const unsigned char* data, size_t data_len, const char* password,
+    unsigned char* output, size_t output_size, size_t* output_len)
+{
+    if (output_size < HEADER_SIZE) {
         return -1;
     }
 
-    unsigned char* encrypted;
+    unsigned char salt[SALT_SIZE], iv[IV_SIZE];
+    if (RAND_bytes(iv, IV_SIZE) != 1) {
+        return -1;
+    }
+
+    // A key still cached for this password is reused under its own salt;
+    // the fresh IV keeps the CTR keystream unique.
+    unsigned char key[KEY_SIZE];
+    if (key_cache_get(password, NULL, salt, key) != 0) {
+        if (RAND_bytes(salt, SALT_SIZE) != 1 || derive_key(password, salt, key) != 0) {
+            OPENSSL_cleanse(key, KEY_SIZE);
+            return -1;
+        }
+    }
+
+    memcpy(output, salt, SALT_SIZE);
+    memcpy(output + SALT_SIZE, iv, IV_SIZE);
+
     size_t encrypted_len;
-    if (encrypt_data(compressed, compressed_len, key, iv, &encrypted, &encrypted_len) != 0) {
-        free(compressed);
+    int res = seal_stream(data, data_len, key, iv,
+        output + HEADER_SIZE, output_size - HEADER_SIZE, &encrypted_len);
+    OPENSSL_cleanse(key, KEY_SIZE);
+    if (res != 0) {
         return -1;
     }
 
-    *output_len = SALT_SIZE + IV_SIZE + encrypted_len;
-    *output = malloc(*output_len);
+    *output_len = HEADER_SIZE + encrypted_len;
+    return 0;
+}
+
+int vault_encrypt_bytes(const unsigned char* data, size_t data_len, const char* password,
+    unsigned char** output, size_t* output_len)
+{
+    *output = malloc(vault_encrypt_bound(data_len));
     if (!*output) {
-        free(compressed);
-        free(encrypted);
         return -1;
     }
 
-    memcpy(*output, salt, SALT_SIZE);
-    memcpy(*output + SALT_SIZE, iv, IV_SIZE);
-    memcpy(*output + SALT_SIZE + IV_SIZE, encrypted, encrypted_len);
+    if (vault_encrypt_into(data, data_len, password,
+            *output, vault_encrypt_bound(data_len), output_len) != 0) {
+        free(*output);
+        *output = NULL;
+        return -1;
+    }
 
-    free(compressed);
-    free(encrypted);
+    unsigned char* shrunk = realloc(*output, *output_len);
+    if (shrunk) {
+        *output = shrunk;
+    }
     return 0;
 }
 
+int vault_encrypt(const char* data, const char* password,
+    unsigned char** output, size_t* output_len)
+{
+    return vault_encrypt_bytes((const unsigned char*)data, strlen(data), password, output, output_len);
+}
+
 int vault_decrypt(const unsigned char* input, size_t input_len, const char* password,
     char** output, size_t* output_len)
 {
+    // The plaintext length is not stored; start at four times the
+    // ciphertext, which covers typical vault CSV.
+    struct sink sink = { NULL, input_len * 4 + 1, 0, 1 };
+    sink.data = malloc(sink.size);
+    if (!sink.data) {
+        return -1;
+    }
 
-    if (input_len < SALT_SIZE + IV_SIZE) {
+    if (open_blob(input, input_len, password, &sink) != 0) {
+        free(sink.data);
         return -1;
     }
 
-    const unsigned char* salt = input;
-    const unsigned char* iv = input + SALT_SIZE;
-    const unsigned char* encrypted = input + SALT_SIZE + IV_SIZE;
-    size_t encrypted_len = input_len - SALT_SIZE - IV_SIZE;
+    char* shrunk = realloc(sink.data, sink.len + 1);
+    *output = shrunk ? shrunk : sink.data;
+    (*output)[sink.len] = '\0';
+    *output_len = sink.len;
+    return 0;
+}
 
-    unsigned char key[KEY_SIZE];
-    if (derive_key(password, salt, key) != 0) {
+int vault_decrypt_into(const unsigned char* input, size_t input_len, const char* password,
+    unsigned char* output, size_t output_size, size_t* output_len)
+{
+    struct sink sink = { (char*)output, output ? output_size : 0, 0, 0 };
+    if (open_blob(input, input_len, password, &sink) != 0) {
         return -1;
     }
 
-    unsigned char* decrypted;
-    size_t decrypted_len;
-    if (decrypt_data(encrypted, encrypted_len, key, iv, &decrypted, &decrypted_len) != 0) {
-        return -1;
+    *output_len = sink.len;
+    return sink.len > sink.size ? VAULT_TOO_SMALL : 0;
+}
+
+// Batches are spread over a pool of worker threads, one per online CPU
+// (VAULT_THREADS overrides), started on the first batch and kept for the
+// life of the process. Workers take one job at a time from the oldest
+// batch, so concurrent callers share the pool and each caller sleeps
+// until its own batch has finished.
+struct vault_batch {
+    vault_job* jobs;
+    size_t count;
+    int decrypt;
+    size_t next;
+    size_t done;
+    pthread_cond_t finished;
+    struct vault_batch* link;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static struct vault_batch* pool_head;
+static struct vault_batch** pool_tail = &pool_head;
+static int pool_threads = -1;
+
+static void run_job(vault_job* job, int decrypt)
+{
+    job->output = NULL;
+    job->output_len = 0;
+    if (!job->input || !job->password) {
+        job->status = -1;
+    } else if (decrypt) {
+        job->status = vault_decrypt(job->input, job->input_len, job->password,
+            (char**)&job->output, &job->output_len);
+    } else {
+        job->status = vault_encrypt_bytes(job->input, job->input_len, job->password,
+            &job->output, &job->output_len);
     }
+}
 
-    unsigned char* decompressed;
-    size_t decompressed_len;
-    if (decompress_data(decrypted, decrypted_len, &decompressed, &decompressed_len) != 0) {
-        free(decrypted);
-        return -1;
+// Hands out the next job of the oldest batch. Called with pool_lock held
+// and a batch queued.
+static vault_job* pool_take(struct vault_batch** batch)
+{
+    *batch = pool_head;
+    vault_job* job = &pool_head->jobs[pool_head->next++];
+    if (pool_head->next == pool_head->count) {
+        pool_head = pool_head->link;
+        if (!pool_head) {
+            pool_tail = &pool_head;
+        }
     }
+    return job;
+}
 
-    *output = malloc(decompressed_len + 1);
-    if (!*output) {
-        free(decrypted);
-        free(decompressed);
-        return -1;
+static void* pool_worker(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!pool_head) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+        }
+
+        struct vault_batch* batch;
+        vault_job* job = pool_take(&batch);
+        pthread_mutex_unlock(&pool_lock);
+        run_job(job, batch->decrypt);
+        pthread_mutex_lock(&pool_lock);
+
+        if (++batch->done == batch->count) {
+            pthread_cond_signal(&batch->finished);
+        }
     }
+    return NULL;
+}
 
-    memcpy(*output, decompressed, decompressed_len);
-    (*output)[decompressed_len] = '\0';
-    *output_len = decompressed_len;
+// Starts the workers on first use. Called with pool_lock held; returns the
+// number running, which is 0 if none could be started.
+static int pool_start()
+{
+    if (pool_threads >= 0) {
+        return pool_threads;
+    }
 
-    free(decrypted);
-    free(decompressed);
-    return 0;
+    long wanted = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* env = getenv("VAULT_THREADS");
+    if (env && *env) {
+        wanted = atol(env);
+    }
+    if (wanted < 1) {
+        wanted = 1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pool_threads = 0;
+    for (long i = 0; i < wanted; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, pool_worker, NULL) != 0) {
+            break;
+        }
+        pool_threads++;
+    }
+    pthread_attr_destroy(&attr);
+    return pool_threads;
+}
+
+static int run_batch(vault_job* jobs, size_t count, int decrypt)
+{
+    if (!jobs || count == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_start() == 0) {
+        pthread_mutex_unlock(&pool_lock);
+        for (size_t i = 0; i < count; i++) {
+            run_job(&jobs[i], decrypt);
+        }
+    } else {
+        struct vault_batch batch = { .jobs = jobs, .count = count, .decrypt = decrypt };
+        pthread_cond_init(&batch.finished, NULL);
+        *pool_tail = &batch;
+        pool_tail = &batch.link;
+        pthread_cond_broadcast(&pool_work);
+        while (batch.done < batch.count) {
+            pthread_cond_wait(&batch.finished, &pool_lock);
+        }
+        pthread_mutex_unlock(&pool_lock);
+        pthread_cond_destroy(&batch.finished);
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].status != 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+int vault_encrypt_batch(vault_job* jobs, size_t count)
+{
+    return run_batch(jobs, count, 0);
+}
+
+int vault_decrypt_batch(vault_job* jobs, size_t count)
+{
+    return run_batch(jobs, count, 1);
 }
 
 void crypto_free(void* ptr)
@@ -0,0 +1,56 @@
+#ifndef VAULT_H
+#define VAULT_H
+
+#include <stddef.h>
+
+int crypto_init();
+void crypto_cleanup();
+
+// Blobs are salt || iv || AES-256-CTR(zlib(data)), keyed by PBKDF2 of the
+// password. Outputs are malloc'd; release them with crypto_free().
+int vault_encrypt(const char* data, const char* password,
+    unsigned char** output, size_t* output_len);
+// vault_encrypt for data of a given length, which may hold NUL bytes.
+int vault_encrypt_bytes(const unsigned char* data, size_t data_len, const char* password,
+    unsigned char** output, size_t* output_len);
+int vault_decrypt(const unsigned char* input, size_t input_len, const char* password,
+    char** output, size_t* output_len);
+void crypto_free(void* ptr);
+
+// Variants that write into a buffer the caller owns. A buffer of
+// vault_encrypt_bound(data_len) bytes always holds the blob.
+// vault_decrypt_into leaves the output unterminated; if it does not fit it
+// returns VAULT_TOO_SMALL with *output_len set to the size needed, so
+// passing a NULL output queries the size.
+#define VAULT_TOO_SMALL 1
+
+size_t vault_encrypt_bound(size_t data_len);
+int vault_encrypt_into(const unsigned char* data, size_t data_len, const char* password,
+    unsigned char* output, size_t output_size, size_t* output_len);
+int vault_decrypt_into(const unsigned char* input, size_t input_len, const char* password,
+    unsigned char* output, size_t output_size, size_t* output_len);
+
+// One item of a batch. For encryption input is the plaintext, for
+// decryption a blob; output is malloc'd (and NUL-terminated when
+// decrypting) and belongs to the caller, who frees it with crypto_free().
+// status is 0 on success and output NULL otherwise.
+typedef struct {
+    const unsigned char* input;
+    size_t input_len;
+    const char* password;
+    unsigned char* output;
+    size_t output_len;
+    int status;
+} vault_job;
+
+// Runs every job across the worker pool and returns once all have finished.
+// Returns the number of jobs that failed.
+int vault_encrypt_batch(vault_job* jobs, size_t count);
+int vault_decrypt_batch(vault_job* jobs, size_t count);
+
+// Wipes every cached derived key.
+void vault_key_cache_clear();
+
+int execute_command(const char* command, char** output, char** error, int* return_code);
+
+#endif
@@ -2,6 +2,19 @@ import ctypes
 import os
 from pathlib import Path
 
+VAULT_TOO_SMALL = 1
+
+
+class VaultJob(ctypes.Structure):
+    _fields_ = [
+        ("input", ctypes.POINTER(ctypes.c_ubyte)),
+        ("input_len", ctypes.c_size_t),
+        ("password", ctypes.c_char_p),
+        ("output", ctypes.POINTER(ctypes.c_ubyte)),
+        ("output_len", ctypes.c_size_t),
+        ("status", ctypes.c_int),
+    ]
+
 
 class VaultCryptoBridge:
     def __init__(self, lib_path=None):
@@ -37,6 +50,36 @@ class VaultCryptoBridge:
             ctypes.POINTER(ctypes.c_size_t),
         ]
         self.lib.vault_decrypt.restype = ctypes.c_int
+        self.lib.vault_encrypt_bound.argtypes = [ctypes.c_size_t]
+        self.lib.vault_encrypt_bound.restype = ctypes.c_size_t
+        self.lib.vault_encrypt_into.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_size_t,
+            ctypes.c_char_p,
+            ctypes.c_void_p,
+            ctypes.c_size_t,
+            ctypes.POINTER(ctypes.c_size_t),
+        ]
+        self.lib.vault_encrypt_into.restype = ctypes.c_int
+        self.lib.vault_decrypt_into.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_size_t,
+            ctypes.c_char_p,
+            ctypes.c_void_p,
+            ctypes.c_size_t,
+            ctypes.POINTER(ctypes.c_size_t),
+        ]
+        self.lib.vault_decrypt_into.restype = ctypes.c_int
+        self.lib.vault_encrypt_batch.argtypes = [
+            ctypes.POINTER(VaultJob),
+            ctypes.c_size_t,
+        ]
+        self.lib.vault_encrypt_batch.restype = ctypes.c_int
+        self.lib.vault_decrypt_batch.argtypes = [
+            ctypes.POINTER(VaultJob),
+            ctypes.c_size_t,
+        ]
+        self.lib.vault_decrypt_batch.restype = ctypes.c_int
         self.lib.crypto_free.argtypes = [ctypes.c_void_p]
         self.lib.crypto_free.restype = None
 
@@ -48,54 +91,135 @@ class VaultCryptoBridge:
         ]
         self.lib.execute_command.restype = ctypes.c_int
 
+    @staticmethod
+    def _bytes_like(data):
+        """data as a flat byte buffer _address accepts, copied only when it must be"""
+        if isinstance(data, memoryview):
+            if not data.c_contiguous:
+                return bytes(data)
+            data = data.cast("B")
+            # A read-only view has no address ctypes can reach unless it
+            # spans a whole bytes object
+            if data.readonly and not (
+                isinstance(data.obj, bytes) and data.nbytes == len(data.obj)
+            ):
+                return bytes(data)
+            return data
+        if isinstance(data, (bytes, bytearray)):
+            return data
+        return bytes(data)
+
+    @staticmethod
+    def _address(buffer):
+        """Address of a bytes-like object, without copying it"""
+        if isinstance(buffer, memoryview) and buffer.readonly:
+            buffer = buffer.obj
+        if isinstance(buffer, bytes):
+            return ctypes.cast(ctypes.c_char_p(buffer), ctypes.c_void_p).value
+        return ctypes.addressof(ctypes.c_char.from_buffer(buffer))
+
     def encrypt_data(self, data, master_password):
+        """Encrypt into a bytearray sized by vault_encrypt_bound"""
         try:
-            data_bytes = data.encode("utf-8") if isinstance(data, str) else data
+            if isinstance(data, str):
+                data = data.encode("utf-8")
+            else:
+                data = self._bytes_like(data)
             password_bytes = master_password.encode("utf-8")
-            output_ptr = ctypes.POINTER(ctypes.c_ubyte)()
+            output = bytearray(self.lib.vault_encrypt_bound(len(data)))
             output_len = ctypes.c_size_t()
-            result = self.lib.vault_encrypt(
-                data_bytes,
+            result = self.lib.vault_encrypt_into(
+                self._address(data) if data else None,
+                len(data),
                 password_bytes,
-                ctypes.byref(output_ptr),
+                self._address(output),
+                len(output),
                 ctypes.byref(output_len),
             )
 
             if result != 0:
                 raise RuntimeError("Encryption failed")
-            encrypted_data = bytes((output_ptr[i] for i in range(output_len.value)))
-            self.lib.crypto_free(output_ptr)
-            return encrypted_data
+            del output[output_len.value :]
+            return output
 
         except Exception as e:
             raise RuntimeError(f"Failed to encrypt data: {e}")
 
     def decrypt_data(self, encrypted_data, master_password):
+        """Decrypt into a bytearray; a second pass runs only if the first guess was short"""
         try:
-            input_array = (ctypes.c_ubyte * len(encrypted_data))(*encrypted_data)
-            input_len = ctypes.c_size_t(len(encrypted_data))
+            encrypted_data = self._bytes_like(encrypted_data)
             password_bytes = master_password.encode("utf-8")
-            output_ptr = ctypes.c_char_p()
+            output = bytearray(max(len(encrypted_data) * 4, 4096))
             output_len = ctypes.c_size_t()
 
-            result = self.lib.vault_decrypt(
-                input_array,
-                input_len,
-                password_bytes,
-                ctypes.byref(output_ptr),
-                ctypes.byref(output_len),
-            )
+            for _ in range(2):
+                result = self.lib.vault_decrypt_into(
+                    self._address(encrypted_data) if encrypted_data else None,
+                    len(encrypted_data),
+                    password_bytes,
+                    self._address(output),
+                    len(output),
+                    ctypes.byref(output_len),
+                )
+                if result != VAULT_TOO_SMALL:
+                    break
+                output = bytearray(output_len.value)
 
             if result != 0:
                 raise RuntimeError("Decryption failed")
-            decrypted_data = output_ptr.value.decode("utf-8")
-            self.lib.crypto_free(output_ptr)
-
-            return decrypted_data
+            del output[output_len.value :]
+            return output.decode("utf-8")
 
         except Exception as e:
             raise RuntimeError(f"Failed to decrypt data: {e}")
 
+    def _run_batch(self, run, items):
+        inputs = [ctypes.create_string_buffer(data, len(data)) for data, _ in items]
+        passwords = [password.encode("utf-8") for _, password in items]
+        jobs = (VaultJob * len(items))()
+        for job, data, password in zip(jobs, inputs, passwords):
+            job.input = ctypes.cast(data, ctypes.POINTER(ctypes.c_ubyte))
+            job.input_len = len(data)
+            job.password = password
+
+        run(jobs, len(items))
+
+        results = []
+        for job in jobs:
+            if job.status != 0:
+                results.append(None)
+                continue
+            results.append(ctypes.string_at(job.output, job.output_len))
+            self.lib.crypto_free(job.output)
+        return results
+
+    def encrypt_batch(self, items):
+        """Encrypt (data, password) pairs in one call; None marks a failed item"""
+        try:
+            items = [
+                (data.encode("utf-8") if isinstance(data, str) else data, password)
+                for data, password in items
+            ]
+            return self._run_batch(self.lib.vault_encrypt_batch, items)
+
+        except Exception as e:
+            raise RuntimeError(f"Failed to encrypt batch: {e}")
+
+    def decrypt_batch(self, items):
+        """Decrypt (blob, password) pairs in one call; None marks a failed item"""
+        try:
+            results = []
+            for result in self._run_batch(self.lib.vault_decrypt_batch, items):
+                try:
+                    results.append(result.decode("utf-8"))
+                except (AttributeError, UnicodeDecodeError):
+                    results.append(None)
+            return results
+
+        except Exception as e:
+            raise RuntimeError(f"Failed to decrypt batch: {e}")
+
     def execute_command(self, command):
         try:
             command_bytes = command.encode("utf-8")
@@ -148,6 +272,16 @@ class VaultCrypto:
         bridge = VaultCrypto._get_bridge()
         return bridge.decrypt_data(encrypted_blob, master_password)
 
+    @staticmethod
+    def encrypt_batch(items):
+        bridge = VaultCrypto._get_bridge()
+        return bridge.encrypt_batch(items)
+
+    @staticmethod
+    def decrypt_batch(items):
+        bridge = VaultCrypto._get_bridge()
+        return bridge.decrypt_batch(items)
+
     @staticmethod
     def execute_command(command):
         bridge = VaultCrypto._get_bridge()